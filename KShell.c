@@ -39,6 +39,9 @@
 6. Multiple Commands(with args) to run assync:
 	>> ps & ps -ax & gedit
 	>> ls & ls & ls & nano
+	Background jobs are reaped as they finish and reported at the prompt;
+	'jobs', 'wait', 'fg' and 'bg' manage them and 'set -o max-jobs=N'
+	queues new ones while N are running
 *******************
 7. Multiple '&' operator followed by multiple '|':
 	>> gedit file.txt & gedit file2.txt & ps all | grep gnome | grep keyboard
@@ -47,10 +50,149 @@
 	>> ls > file.txt
 	>> echo "kevin" > file.txt
         >> ps all | grep a > file.txt
+   and the other redirections, applied left to right to any command:
+	>> sort < in.txt >> sorted.txt
+	>> make 2> errors.txt
+	>> make > build.log 2>&1
+	>> make &> build.log
+	>> cat 3< in.txt <&3 3<&-
 *******************
 9. K-Shell internal Commands:
 	>> close: close the shell
 	>> help: show internal commands
+	>> echo, true, false, pwd, cd, test, printf: run inside the shell
+	   (in a forked child, without exec, when part of a pipeline)
+	>> enable -n echo: use the external echo instead
+	>> cat, tee: move the bytes inside the kernel (splice, tee(2),
+	   sendfile) instead of exec'ing /bin/cat; 'cat file | cmd' just
+	   runs 'cmd < file'. Other options go to the external command
+*******************
+10. Command lines run in sequence with ';':
+	>> ls -ax > file.txt ; grep a file.txt
+*******************
+11. Commands with a deadline (SIGTERM when it expires, status 124):
+	>> timeout 5 ping www.google.com
+	>> timeout 1.5 yes | wc -l
+*******************
+12. A command over many inputs, N at a time (default: one per CPU);
+    the output of each run comes out in one piece:
+	>> parallel -j 4 gzip -k {} ::: a.txt b.txt c.txt
+	>> ls *.txt | parallel wc -l
+*******************
+13. Commands from a script, a string or a pipe (no banner or prompt
+    unless stdin is a terminal; exits at the end of the input):
+	$ kshell script.ksh
+	$ kshell -c "ls -ax | grep out"
+	$ generate_commands | kshell
+*******************
+14. Where the time goes: one row per stage (wall, user/sys CPU, max RSS,
+    context switches) and the total, on stderr. The numbers of the last
+    foreground job are also in the KSH_LAST_STATS shell variable:
+	>> time ps all | grep a | grep b > out
+*******************
+15. Trace log, off by default: parsing, pipes, fork/spawn, waits and
+    exit statuses as JSON lines, on stderr or in a file (or /dev/fd/N):
+	>> set -o trace=debug trace-file=/tmp/kshell.trace
+*******************
+16. Pipe capacity and CPU placement of the stages. 'pipesize' sets it
+    for one pipeline, pipe-size for all of them (0: kernel default);
+    compact puts neighbouring stages on cores that share a cache,
+    spread keeps them apart. 'time' shows the CPU and the pipe size:
+	>> time pipesize 1M zcat big.gz | grep error | sort
+	>> set -o pipe-size=256K pipeline-affinity=compact
+*******************
+17. Launchers: spawn (default), fork, or zygote: a pool of pre-forked
+    helpers that get argv, environment, fds, working directory and umask
+    over a socket and exec, so the shell never forks on the way to a
+    command. The helpers are forked by a spawner process, not by the
+    shell; with --launcher=zygote it starts before the shell grows, with
+    'set -o launcher=zygote' at that point. The pool grows
+    with the commands per line up to zygote-pool. 'launchstat' shows the
+    launch latency percentiles of each launcher:
+	>> set -o launcher=zygote zygote-pool=16
+	>> launchstat
+*******************
+18. Server mode: one warm shell on a Unix socket. Every connection gets
+    its own session (forked from the server, with its caches and
+    options) that runs the lines it receives and answers each one with
+    framed stdout, stderr and exit status. Statistics of every
+    connection go to the server's stderr when it closes:
+	$ kshell --serve /tmp/kshell.sock &
+	$ kshell --client /tmp/kshell.sock -c "ls -ax | grep out"
+	$ generate_commands | kshell --client /tmp/kshell.sock
+*******************
+19. Output cache for slow read-only commands: 'cache cmd' replays the
+    stdout and exit status of an earlier run while argv, the directory,
+    the locale/PATH variables and the files named in argv (inode, size,
+    mtime) are the same. The store is on disk (cache-dir, by default
+    ~/.cache/kshell), bounded by cache-size, least recently used out
+    first. Not for commands that read stdin. 'cache' alone shows the
+    hits, misses and evictions, 'cache -r' empties it:
+	>> cache ls -ax /usr/share
+	>> cache --ttl 10m ps all
+	>> set -o cache-size=256M
+*******************
+20. History: every line is appended to ~/.kshell_history (history-file),
+    shared by all the sessions and mapped into memory with a trigram
+    index, so searching millions of lines stays fast. '!!' is the last
+    line, '!n' line n, '!-n' n lines back, '!prefix' the last line that
+    starts with prefix (outside of single quotes). Scripts keep their
+    history in memory only, without expansion, unless history-file is set:
+	>> history 20
+	>> history search rsync
+	>> !ssh
+*******************
+21. Quoting and operators: 'single quotes' keep everything, "double
+    quotes" keep blanks and operators (\" \\ \$ \` are escapes inside
+    them), a backslash keeps the next char, '#' starts a comment.
+    Operators need no blanks around them. The lexer scans for the bytes
+    that matter 16 or 32 at a time (SSE2/AVX2, picked at run time);
+    lexer=check also runs the plain C scan and reports any difference:
+	>> ls -ax|grep "my file">out.txt 2>&1
+	>> set -o lexer=check
+*******************
+22. Pathname expansion: '*', '?' and '[a-z]' (or '[!a-z]') in unquoted
+    words, '**' for any number of directories. Names starting with '.'
+    need a '.' in the pattern, the paths come out sorted (byte order),
+    and a pattern that matches nothing is passed as it is. Directories
+    are read once per line and kept for the other globs on it (set -o
+    glob-cache=off to read them every time):
+	>> ls -l *.log
+	>> grep -c TODO [a-m]*.[ch]
+	>> cd src ; wc -l ** | sort -n
+*******************
+23. Variables: NAME=value sets one, 'export' puts it in the environment
+    of the commands and 'unset' removes it. $NAME, ${NAME},
+    ${NAME:-default} (unset or empty), ${NAME-default} (unset), $? (last
+    status), $$ (the shell) and $! (last background job) are replaced
+    when the command starts, inside double quotes too. A value is never
+    split: it is one argument, or none if it is empty and unquoted (an
+    unquoted one may still be a pattern):
+	>> LOGS=/var/log ; export LANG=C
+	>> grep -c error "$LOGS/app.log" > ${OUT:-counts.txt}
+	>> echo $? $$ $!
+*******************
+24. Fused filters: after the first stage of a pipeline, a run of grep
+    (fixed strings, -v, -F), head [-n N], wc -l/-c and cut -d X -f LIST
+    stages runs as one 'filters' process, with no exec and no pipes
+    between them: memmem skips to the lines a grep selects and the input
+    stops at the end of a head. The output is the one of GNU grep, head,
+    wc and cut; anything else (other options, regular expressions,
+    redirections) stays external, and 'set -o fuse-filters=off' turns it
+    off:
+	>> ps all | grep gnome | grep -v grep | head -n 5
+	>> cat access.log | grep GET | cut -d ' ' -f 1 | wc -l
+*******************
+25. Job limits: 'limit' before a pipeline sets cputime=SECONDS, as=SIZE
+    (address space) and files=N with setrlimit in each of its processes.
+    cpu=N% (of one CPU), mem=SIZE and pids=N put the job in its own
+    cgroup v2 (cpu.max, memory.max, pids.max) when the shell's cgroup
+    is writable; otherwise mem becomes an address space limit and cpu
+    and pids are left out. bg-limit is the default for background jobs,
+    and 'jobstat' shows the limits and what each job is using:
+	>> limit cpu=50% mem=512M make -j8 &
+	>> set -o bg-limit="mem=1G files=1024"
+	>> jobstat %1
 
 
 */
@@ -58,6 +200,7 @@
  * Includes
  ***************************************
  ***************************************/
+#define _GNU_SOURCE  // strchrnul and the Linux specific calls
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/wait.h>
@@ -65,562 +208,6453 @@
 #include <string.h>
 #include <sys/queue.h>
 #include <fcntl.h> 
+#include <signal.h>
+#include <spawn.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/pidfd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <stdarg.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <limits.h>
+#include <dirent.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 /*************************************** 
  * Constants
  ***************************************
  ***************************************/
-#define LINE_BUFFER_SIZE 100
 #define SHELL_STATUS_CLOSE 0
 #define SHELL_STATUS_CONTINUE 1
-#define MAX_COMMAND_BY_LINE 30
-#define MAX_COMMAND_SIZE 100
 #define TRUE 1
 #define FALSE 0
 #define READ_END 0
 #define WRITE_END 1
+#define LAUNCHER_FORK 0
+#define LAUNCHER_SPAWN 1
+#define LAUNCHER_ZYGOTE 2
+#define N_LAUNCHERS 3
+#define DEFAULT_ZYGOTE_POOL 8  // helpers kept at most
+#define MAX_ZYGOTE_POOL 256
+#define LAUNCH_SAMPLES 4096  // latencies kept per launcher for 'launchstat'
+#define FRAME_HEADER_SIZE 5  // type byte + 32 bit length in network order
+#define FRAME_STDOUT 'O'
+#define FRAME_STDERR 'E'
+#define FRAME_EXIT 'X'  // 32 bit exit status: the reply to a line is complete
+#define ARENA_BLOCK_SIZE (64*1024)
+#define ARENA_ALIGN 16
+#define DEFAULT_MAX_JOBS 256
+#define EVENT_BATCH_SIZE 16  // epoll events handled per wakeup
+#define EVENT_DATA(kind, pid) (((uint64_t) (kind) << 32) | (uint32_t) (pid))
+#define INPUT_BUFFER_SIZE (64*1024)  // initial size, doubles for longer lines
+#define PARALLEL_MAX_SLOTS 1024  // 'parallel -j 0' over stdin
+#define TRACE_RING_SIZE 1024  // records kept before a flush
+#define TRACE_DETAIL_SIZE 128
+#define TRACE_FLUSH_BUFFER (64*1024)
+#define TRACE_RECORD_MAX (6*TRACE_DETAIL_SIZE + 256)  // a record as JSON, escapes included
+// Tracing: the arguments are only evaluated when 'level' is enabled, so a
+// disabled TRACE is a load and a compare
+#define TRACE(level, event, pid, value, ...) do{ \
+	if(__builtin_expect((level) <= TRACE_LEVEL, 0)) \
+		trace_event(level, event, pid, value, __VA_ARGS__); \
+}while(0)
+#define SHELL_TERMINAL STDIN_FILENO
+#define PATH_CACHE_INITIAL_CAPACITY 64  // power of two
+#define DEFAULT_CACHE_SIZE (64*1024*1024)  // bytes on disk for 'cache' outputs
+#define CACHE_MAGIC "kshcach1"
+#define HISTORY_INITIAL_CAPACITY 1024  // entries
+#define LEXER_AUTO 0  // lexer option: the widest scan the CPU has
+#define LEXER_SCALAR 1
+#define LEXER_SSE2 2
+#define LEXER_AVX2 3
+#define LEXER_CHECK 4  // the widest scan, checked against the scalar one
+#define GLOB_DENTS_SIZE (256*1024)  // getdents64 buffer
+#define GLOB_CACHE_BUCKETS 256  // per line directory listings (power of two)
+#define VARIABLES_INITIAL_CAPACITY 128  // power of two
+#define ENVIRONMENT_INITIAL_CAPACITY 64
+#define WORD_GLOB 1  // word flags: has unquoted wildcards
+#define WORD_VARS 2  // has $ references
+#define TRIGRAM_BITS 6  // per byte: the index is over the low 6 bits of each byte
+#define TRIGRAM_BUCKETS (1 << (3*TRIGRAM_BITS))
+#define DEFAULT_PATH "/bin:/usr/bin"  // used when PATH is unset, like execvp
+#define COPY_CHUNK_SIZE (1024*1024)  // asked per splice/sendfile (a pipe moves less)
+#define COPY_BUFFER_SIZE (64*1024)  // read/write fallback
+#define CGROUP_CPU 1  // limits a job cgroup could not take
+#define CGROUP_MEMORY 2
+#define CGROUP_PIDS 4
+#define CPU_MAX_PERIOD 100000  // cpu.max period (us): cpu=N% is a quota of N*1000
+#define MAX_CPUS CPU_SETSIZE
+#define FILTER_BUFFER_SIZE (256*1024)  // input read at a time (doubles for longer lines)
+#define FILTER_OUTPUT_SIZE (64*1024)
+#define FILTER_MAX_FIELDS 256  // cut -f N-M: up to this field (N- has no limit)
+#define GREP_BINARY_MESSAGE "grep: (standard input): binary file matches\n"  // GNU grep 3.5 and later
+/*************************************** 
+ * Types
+ ***************************************
+ ***************************************/
+// Arena: everything a command line needs (the line itself, tokens, argv
+// vectors and the command tree) is bump-allocated here and released at once
+struct arena_block{
+	struct arena_block* next;
+	size_t size;
+	size_t used;
+	_Alignas(ARENA_ALIGN) char data[];  // the header is padded: every block starts ARENA_ALIGN aligned
+};
+struct arena{
+	struct arena_block* head;
+	struct arena_block* current;  // block being filled
+	size_t used;  // bytes handed out since the last reset
+	size_t peak;  // largest 'used' ever seen
+	size_t reserved;  // bytes held by all blocks
+};
+// Lexer
+enum token_type{
+	TOKEN_WORD,
+	TOKEN_PIPE,  // '|'
+	TOKEN_BACKGROUND,  // '&'
+	TOKEN_SEQUENCE,  // ';'
+	TOKEN_REDIRECT,  // '<', '>', '>>', '2>', '2>&1', '&>', '3<&-'...
+	TOKEN_END  // end of the line
+};
+struct token{
+	enum token_type type;
+	char* text;
+	int expand;  // WORD_* flags; if any, the quoted specials of text are escaped and '"$' is a quoted reference
+};
+// Lexer: which bytes end a plain run of chars
+enum lexer_stop{
+	STOP_WORD,  // outside quotes: blanks, quotes, backslash, operators, wildcards, '$'
+	STOP_DOUBLE_QUOTED,  // '"', backslash and '$'
+	STOP_SPECIAL,  // wildcards, backslash, '$' and '"': escaped in quoted parts of words
+	N_LEXER_STOPS
+};
+typedef size_t (*lexer_scan_function)(const char* text, size_t len, enum lexer_stop stop);
+// Globbing: a pattern is compiled one path segment at a time
+enum glob_op{ GLOB_CHAR, GLOB_ANY, GLOB_STAR, GLOB_CLASS };
+struct glob_element{
+	enum glob_op op;
+	unsigned char c;  // GLOB_CHAR
+	unsigned char class[32];  // GLOB_CLASS: bit per byte
+};
+struct glob_segment{
+	char* literal;  // no wildcards: the name itself, unescaped
+	struct glob_element* elements;
+	int n_elements;
+	int recursive;  // '**'
+	int dot;  // starts with a '.': may match hidden names
+};
+struct glob_results{  // grows by doubling
+	char** paths;
+	size_t count;
+	size_t capacity;
+};
+struct dir_listing{
+	char* path;
+	char* names;  // '\0' separated
+	size_t* offsets;
+	unsigned char* types;  // d_type
+	size_t count;
+	struct dir_listing* next;  // same cache bucket
+};
+struct expansion{  // argv before expand_command, put back by restore_command
+	char** argv;
+	int argc;
+	char* expand;
+	char** files;  // redirect files before expand_command (NULL: none changed)
+};
+// Variables
+struct variable{
+	char* name;  // NULL: empty slot
+	char* value;  // NULL: unset (the slot stays while exported)
+	int exported;
+	int env_index;  // its "name=value" in VARIABLES.envp (-1: none)
+};
+struct variable_table{  // open addressing, linear probing
+	struct variable* slots;
+	size_t capacity;  // power of two
+	size_t count;
+	char** envp;  // the exported ones, NULL terminated: 'environ' points here
+	int n_env;
+	int env_capacity;
+};
+// Fused filters: the stages one 'filters' process runs
+enum filter_type{ FILTER_GREP, FILTER_HEAD, FILTER_WC, FILTER_CUT };
+struct filter_stage{
+	enum filter_type type;
+	char* pattern;  // grep: fixed string
+	size_t pattern_len;
+	int invert;  // grep -v
+	int selected;  // grep: some line was selected (exit status 0)
+	int binary;  // grep: a NUL byte came, the next match ends it
+	int suppressed;  // grep: left out a badly encoded line (told at the end)
+	long left;  // head: lines still to write
+	int lines, bytes;  // wc -l, wc -c
+	long n_lines, n_bytes;
+	char delimiter;  // cut -d
+	unsigned char fields[FILTER_MAX_FIELDS/8];  // cut -f: a bit per field number
+	long fields_from;  // cut -f N-: every field from N on (0: none)
+	long last_field;  // cut: highest field in 'fields'
+	char* line;  // cut: the line it writes
+	size_t line_capacity;
+	int closed;  // takes no more lines: head wrote them all, grep found a binary match
+};
+struct filter_chain{
+	struct filter_stage* stages;
+	int n_stages;
+	int done;  // a stage closed: the rest of the input is not read
+	int utf8;  // UTF-8 locale: grep takes badly encoded lines as binary
+	char* out;
+	size_t out_len;
+};
+// Redirections
+enum redirect_type{
+	REDIRECT_INPUT,  // [n]< file
+	REDIRECT_OUTPUT,  // [n]> file (truncates)
+	REDIRECT_APPEND,  // [n]>> file
+	REDIRECT_DUP,  // [n]>&m, [n]<&m
+	REDIRECT_CLOSE  // [n]>&-, [n]<&-
+};
+struct redirect{
+	enum redirect_type type;
+	int fd;  // descriptor it changes
+	int source_fd;  // REDIRECT_DUP: fd becomes a copy of it
+	char* file;  // REDIRECT_INPUT, REDIRECT_OUTPUT and REDIRECT_APPEND
+	int expand;  // file has $ references
+};
+// Job limits: 'limit key=value...' and the bg-limit option (0: no limit)
+struct job_limits{
+	long cpu_time;  // cputime: RLIMIT_CPU seconds
+	long address_space;  // as: RLIMIT_AS bytes
+	long open_files;  // files: RLIMIT_NOFILE
+	long cpu_percent;  // cpu: cpu.max, percent of one CPU
+	long memory;  // mem: memory.max bytes
+	long pids;  // pids: pids.max
+};
+// Command Tree: sequence -> job -> pipeline -> simple command
+struct command_node{  // a simple command and its redirections
+	char** argv;  // NULL terminated
+	int argc;
+	char* path;  // resolved argv[0], set when the command is launched
+	struct builtin* builtin;  // internal command run instead of exec (or NULL)
+	struct redirect* redirects;  // applied in order, after the pipes
+	int n_redirects;
+	long timeout_ms;  // 'timeout N' prefix (0: none)
+	char* expand;  // WORD_* flags of each argv (NULL: nothing to expand, redirects included)
+	pid_t pid;  // process running the command (0 if it was not started)
+	STAILQ_ENTRY(command_node) next;
+};
+struct pipeline_node{  // commands connected by '|'
+	STAILQ_HEAD(command_list, command_node) commands;
+	int n_commands;
+	int timed;  // 'time' prefix
+	int pipe_size;  // 'pipesize' prefix (0: the pipe-size option)
+	struct job_limits* limits;  // 'limit' prefix (NULL: none)
+};
+struct job_node{  // a pipeline and how it is waited for
+	struct pipeline_node pipeline;
+	int background;  // ended by '&'
+	STAILQ_ENTRY(job_node) next;
+};
+struct sequence_node{  // jobs in the order they appear in the line
+	STAILQ_HEAD(job_list, job_node) jobs;
+};
+struct parser{
+	struct token* tokens;
+	int pos;  // current token
+};
+// Launcher
+struct launch_spec{  // how a command is wired when it is launched
+	int in_fd;  // becomes stdin
+	int out_fd;  // becomes stdout
+	int unused_fd;  // shell descriptor the child must not keep (or -1)
+	int status_fd;  // CLOEXEC: a failed exec writes its errno here and leaves the message to the shell (-1: none)
+	pid_t pgid;  // -1: stay in the shell's group, 0: lead a new one, >0: join it
+	int foreground;  // the process group takes the terminal
+	struct job_limits* limits;  // set by the child before exec (NULL: none)
+	int cgroup_fd;  // directory of the job's cgroup, joined by the child (-1: none)
+};
+// Zygote launcher: a pre-forked helper waiting for a command
+struct zygote{
+	pid_t pid;
+	int fd;  // shell end of its socket
+};
+struct zygote_request{  // followed by n_redirects zygote_redirect, then the strings:
+	pid_t pgid;         // path, argv, environment and the redirect files
+	int foreground;
+	mode_t umask;  // the shell's; the working directory comes as an fd
+	int argc;
+	int envc;
+	int n_redirects;
+};
+struct zygote_redirect{
+	int type;
+	int fd;
+	int source_fd;
+	int has_file;
+};
+// Server mode: what a session did, logged when its connection closes
+struct connection_stats{
+	int id;
+	long requests;
+	long errors;  // lines with a non-zero exit status
+	long bytes_in;
+	long bytes_out;
+	double busy;  // seconds running lines
+	double slowest;
+	struct timespec opened;  // CLOCK_MONOTONIC
+};
+struct launch_stats{  // per launcher: how long the shell is busy starting a command
+	long samples[LAUNCH_SAMPLES];  // ns, a ring
+	long count;
+};
+// Job table: every pipeline started by the shell, keyed by process group
+enum process_state{ PROCESS_RUNNING, PROCESS_STOPPED, PROCESS_DONE };
+enum job_state{ JOB_QUEUED, JOB_RUNNING, JOB_STOPPED, JOB_DONE };
+struct job_process{
+	pid_t pid;  // -1: could not be started
+	enum process_state state;
+	int status;  // wait status once done
+	int pidfd;  // watched by the event loop while it runs (or -1)
+	int timer_fd;  // 'timeout' deadline (or -1)
+	int timed_out;  // killed by its 'timeout'
+	char name[32];  // argv[0], for the 'time' report
+	int cpu;  // pinned by pipeline-affinity (-1: anywhere)
+	struct timespec started;  // CLOCK_MONOTONIC
+	struct timespec finished;
+	struct rusage usage;  // from wait4, once done
+};
+struct job{
+	int id;  // number shown by 'jobs' (%N)
+	pid_t pgid;  // process group (first process)
+	enum job_state state;
+	int background;
+	int timed;  // report its resource usage when it is done
+	int notified;  // the user was told it stopped
+	char* text;  // command line shown by 'jobs'
+	struct job_process* processes;  // one per pipeline stage
+	int n_processes;
+	int in_fd;  // stdin of the first stage (handed over when it starts)
+	int out_fd;  // stdout of the last stage
+	int pipe_size;  // capacity its pipes got (0: no pipes)
+	struct pipeline_node* pipeline;  // heap copy kept while queued
+	struct job_limits limits;
+	int limited;  // limits apply: its processes are forked
+	char* cgroup;  // its cgroup directory (NULL: rlimits only)
+	int cgroup_fd;  // cgroup, opened (-1: none)
+	TAILQ_ENTRY(job) next;
+};
+// Output cache: an entry file is the header, the key and the output
+struct cache_header{
+	char magic[8];  // CACHE_MAGIC
+	int32_t status;
+	uint32_t key_len;
+	int64_t created;  // CLOCK_REALTIME seconds, for --ttl
+	int64_t output_size;
+};
+struct cache_file{  // eviction scan
+	char name[32];
+	off_t size;
+	struct timespec used;  // mtime, touched on every hit
+};
+struct cache_stats{
+	long hits;
+	long misses;
+	long evictions;  // least recently used entries dropped for cache-size
+	long expired;  // entries older than --ttl
+};
+// History: the lines are in the mapped file, one per '\n'
+struct trigram_postings{
+	uint32_t* ids;  // entries that contain it, ascending
+	uint32_t n_ids;
+	uint32_t capacity;
+};
+struct history{
+	int fd;  // -1: not opened yet
+	char* map;
+	size_t mapped;
+	size_t indexed;  // bytes of the file that are in the index
+	size_t* offsets;  // entry i is offsets[i] .. offsets[i + 1] - 1 (the '\n')
+	uint32_t count;
+	uint32_t capacity;
+	struct trigram_postings* trigrams;  // TRIGRAM_BUCKETS, built on the first search
+	uint32_t trigram_count;  // entries in the trigram index
+	long current;  // entry of the line being run, -1: none
+};
+// parallel: one running input
+struct parallel_task{
+	struct job* job;  // NULL: free slot
+	int output;  // memfd the job writes to
+};
+// Event loop: what woke epoll_wait up (the pid goes in the low 32 bits)
+enum event_kind{ EVENT_INPUT, EVENT_SIGNAL, EVENT_CHILD, EVENT_TIMEOUT, EVENT_ACCEPT };
+struct input_buffer{  // where command lines come from; never read through stdio
+	char* data;  // read() chunks, a mapped script or the '-c' string
+	size_t size;  // bytes data can hold
+	size_t start;  // next byte to hand out
+	size_t end;  // bytes filled
+	int fd;  // refilled from here (-1: everything is in data already)
+	int eof;
+};
+// Trace log
+enum trace_level{ TRACE_OFF, TRACE_ERROR, TRACE_INFO, TRACE_DEBUG };
+// pipeline-affinity: where the stages of a pipeline run
+enum pipeline_affinity{ AFFINITY_OFF, AFFINITY_COMPACT, AFFINITY_SPREAD };
+struct cpu_place{  // a CPU the shell may use, from /sys/devices/system/cpu
+	int cpu;
+	int package;
+	int cache;  // last level cache id
+	int core;
+	int thread;  // sibling number inside its core
+	int rank;  // its core's place inside its cache (compact order)
+};
+struct trace_record{  // formatted as JSON only when flushed
+	struct timespec time;  // CLOCK_REALTIME
+	enum trace_level level;
+	char* event;  // static string
+	pid_t pid;  // process the event is about
+	long value;  // fd, status, errno... depending on the event
+	char detail[TRACE_DETAIL_SIZE];
+};
+// Shell options ('set -o name=value')
+struct shell_option{
+	char* name;
+	int* value;
+	char** choices;  // value indexes it; NULL for numeric options
+	char** text;  // string options (value is NULL)
+	void (*changed)();  // called after every change (or NULL)
+};
+// Internal commands
+struct builtin{
+	char* name;
+	int (*run)(char** argv);  // returns the exit status
+	char* usage;
+	int special;  // exists only in the shell: can't be disabled
+	int enabled;  // FALSE: the name runs the external command ('enable -n')
+	char* options;  // option letters it knows (NULL: all); others go to the external command
+	int child;  // always runs in a child: it reads until EOF, ^C and ^Z must reach it
+};
+// Command path cache: command name -> absolute path of the executable
+struct path_cache_entry{
+	char* name;  // NULL: empty slot
+	char* path;  // NULL: forgotten, resolved again on the next lookup
+	unsigned long hits;
+};
+struct path_cache{
+	struct path_cache_entry* slots;  // open addressing, linear probing
+	size_t capacity;  // power of two
+	size_t count;  // slots in use
+	char* path_env;  // PATH the entries were resolved against
+	unsigned long hits;
+	unsigned long misses;
+};
 /*************************************** 
  * Prototypes
  ***************************************
  ***************************************/
 // Shell LifeCycle Functions
+int parse_shell_options(int argc, char** argv);
 void start_shell();
 void loop_shell();
+void print_prompt();
 void finish_shell();
-// Command Manipulation
-char** split_commands(char* line);
-char** get_command_parameters(char** matrix, int* index);
-// Command Execution
+// Server Mode
+int serve(char* path);
+void serve_accept();
+void serve_connection(int fd, int id);
+int send_frame(int sock, char type, char* data, int data_fd, size_t len);
+int run_client(char* path);
+int read_full(int fd, void* data, size_t len);
+// Arena
+void* arena_alloc(struct arena* arena, size_t size);
+void arena_reset(struct arena* arena);
+// Lexer
+struct token* split_commands(char* line);
+struct token* lex_line(char* line, lexer_scan_function scan);
+size_t lex_operator(char* text);
+size_t lex_reference(char* text);
+size_t lex_copy_quoted(char* out, char* text, size_t len, lexer_scan_function scan, int* escapes);
+int lexer_check(char* line, struct token* tokens);
+void lexer_changed();
+size_t lexer_scan_scalar(const char* text, size_t len, enum lexer_stop stop);
+size_t lexer_scan_sse2(const char* text, size_t len, enum lexer_stop stop);
+size_t lexer_scan_avx2(const char* text, size_t len, enum lexer_stop stop);
+enum token_type token_type_of(char* text);
+int parse_redirect_operator(char* text, struct redirect* redirect);
+// Parser
+struct sequence_node* parse_sequence(struct token* tokens);
+struct job_node* parse_job(struct parser* p);
+int parse_pipeline(struct parser* p, struct pipeline_node* pipeline);
+struct command_node* parse_command(struct parser* p);
+// Command Execution (command tree handlers)
 int execute_commands(char* line);
-int execute_standard_sync_command(char** argv);
-int execute_standard_async_command(char** argv);
-// Operator Position Idenftify
-int cmd_no_operator(char** argv);  // command without operator
-int cmd_before_operator(char** argv, char* operator, char** cmd_tokens, int* index);
-int cmd_between_operator(char** argv, char* before_operator, char* after_operator, char** cmd_tokens, int* index); // command between operators
-int cmd_after_operator(char** argv, char* operator);  // command after operator
-int is_operator(char* str, char operator);
-int exists_operator_before(char** commands, int index);  // if there's a operator before the index
-int exists_operator_after(char** commands, int index);  // if there's a operator after the index
-// Operator Handling
-int cmd_before_operator_handle_pipe(char** argv);  // command before operator
-int cmd_between_operator_handle_pipe_pipe(char** argv);  // command between pipes
-int cmd_between_operator_handle_redirect_out_pipe(char** argv, char** cmd_tokens, int* index); // command betweeen '|' and '>'
-int cmd_after_operator_handle_pipe(char** argv);  // command after operator
-int cmd_before_operator_handle_background(char** commands, int* index);  // command to run in background
-int cmd_before_operator_handle_redirect_out(char** argv, char** cmd_tokens, int* index);
-
+int execute_sequence(struct sequence_node* sequence);
+int execute_job(struct job_node* job);
+int execute_simple_command(struct pipeline_node* pipeline);
+int execute_standard_async_command(struct pipeline_node* pipeline);
+// Redirections
+int redirect_open_flags(enum redirect_type type);
+int apply_redirects(struct command_node* command, int* saved);
+void restore_redirects(struct command_node* command, int* saved, int n);
+int format_redirect(char* out, size_t size, struct redirect* redirect);
+// Word Expansion
+int expand_command(struct command_node* command, struct expansion* saved);
+void restore_command(struct command_node* command, struct expansion* saved);
+char* expand_variables(char* text, int* pattern, int* literal);
+void glob_expand(char* pattern, struct glob_results* results);
+int glob_compile(char* text, size_t len, struct glob_segment* segment);
+void glob_walk(char* path, size_t path_len, struct glob_segment* segments, int n_segments, int i, struct glob_results* results);
+int glob_match(struct glob_segment* segment, char* name);
+int glob_is_dir(char* path, unsigned char type);
+struct dir_listing* glob_list_dir(char* path);
+void free_dir_listing(struct dir_listing* listing);
+void glob_cache_clear();
+void glob_add(struct glob_results* results, char* path);
+char* glob_unescape(char* text);
+int compare_path(const void* a, const void* b);
+// Variables
+void init_variables();
+struct variable* variable_slot(char* name);
+void variables_grow();
+char* variable_get(char* name);
+void variable_set(char* name, char* value, int export);
+void variable_unset(char* name);
+void variable_sync_env(struct variable* variable);
+size_t variable_name_length(char* text);
+int is_assignment_list(struct command_node* command);
+int execute_assignments(struct command_node* command);
+// Pipeline Execution
+int execute_pipeline(struct pipeline_node* pipeline);
+int start_pipeline(struct pipeline_node* pipeline, struct job* job);
+void fold_leading_cat(struct pipeline_node* pipeline);
+void fuse_filters(struct pipeline_node* pipeline);
+int pipeline_pipe_size(struct pipeline_node* pipeline);
+void pin_stage(struct job_process* process, int stage);
+void affinity_changed();
+int compare_cpu_compact(const void* a, const void* b);
+int compare_cpu_spread(const void* a, const void* b);
+int read_sysfs_int(int cpu, char* file, int fallback);
+// Job Control
+void init_job_control();
+void job_process_changed(pid_t pid, int status, struct rusage* usage);
+struct job_process* find_job_process(pid_t pid, struct job** owner);
+void job_update_state(struct job* job);
+int run_job(struct pipeline_node* pipeline, int background);
+struct job* job_create(struct pipeline_node* pipeline, int background);
+void job_remove(struct job* job);
+int wait_for_job(struct job* job);
+int job_exit_status(struct job* job);
+void job_record_stats(struct job* job);
+double elapsed_seconds(struct timespec* from, struct timespec* to);
+int count_running_jobs();
+void start_queued_jobs();
+int notify_jobs();
+char* job_state_text(struct job* job);
+struct job* find_job(char* spec);
+void continue_job(struct job* job);
+char* pipeline_text(struct pipeline_node* pipeline);
+struct pipeline_node* clone_pipeline(struct pipeline_node* pipeline);
+void free_pipeline_copy(struct pipeline_node* pipeline);
+// Job Limits
+int parse_job_limit(char* word, struct job_limits* limits);
+int format_job_limits(char* out, size_t size, struct job_limits* limits);
+void bg_limit_changed();
+int cgroup_init();
+int cgroup_write(char* dir, char* file, char* value);
+int cgroup_read(char* dir, char* file, char* buffer, size_t size);
+int cgroup_enable(char* dir);
+void job_limits_setup(struct job* job, struct pipeline_node* pipeline);
+void job_limits_release(struct job* job);
+void apply_job_limits(struct launch_spec* spec);
+void set_rlimit(int resource, long soft, long hard);
+void cgroup_release();
+// Input
+int open_input_fd(int fd);
+int open_input_file(char* path);
+int open_input_string(char* commands);
+char* read_line();
+char* input_next_line(struct input_buffer* input, size_t* len);
+void fill_input(struct input_buffer* input);
+// History
+int history_open();
+void history_sync();
+void history_index();
+uint32_t trigram_bucket(char* text);
+void history_add(char* line);
+char* history_entry(long id, size_t* len);
+char* history_expand(char* line);
+long history_find_prefix(char* prefix, size_t len);
+long history_next_match(char* pattern, size_t len, long before);
+// Event Loop
+void init_event_loop();
+int event_loop_run(int want_input);
+void event_loop_watch_input(int watch);
+void event_loop_watch_process(struct job_process* process, long timeout_ms);
+void event_loop_forget_process(struct job_process* process);
+void event_loop_forget_timer(struct job_process* process);
+void event_loop_reset();
+void reap_children(pid_t pid);
+void expire_timeout(pid_t pid);
+// Launcher
+pid_t launch_command(struct command_node* command, struct launch_spec* spec);
+pid_t launch_with_fork(struct command_node* command, struct launch_spec* spec);
+pid_t launch_with_spawn(struct command_node* command, struct launch_spec* spec);
+pid_t launch_with_zygote(struct command_node* command, struct launch_spec* spec);
+void zygote_refill();
+void zygote_spawner_start();
+void zygote_spawner_main(int sock);
+pid_t zygote_from_spawner(int* fd);
+void zygote_main(int fd);
+void zygote_forget(pid_t pid);
+void zygote_reset();
+void launcher_changed();
+void record_launch(int launcher, struct timespec* start);
+int compare_long(const void* a, const void* b);
+void child_default_signals(sigset_t* signals);
+void exec_pipeline_stage(struct command_node* command, struct launch_spec* spec);
+// Command Path Cache
+char* path_cache_lookup(char* name);
+char* path_cache_refresh(char* name);
+struct path_cache_entry* path_cache_slot(char* name);
+void path_cache_grow();
+void path_cache_clear();
+char* resolve_in_path(char* name, char* path_env);
+unsigned long hash_string(char* str);
+// Output Cache
+char* cache_directory();
+char* cache_key(char** argv);
+int cache_replay(char* path, char* key, long ttl_ms);
+void cache_store(char* directory, char* path, char* key, int output, int status);
+void cache_evict(char* directory, off_t limit);
+int compare_cache_file(const void* a, const void* b);
 // Internal Commands
-int execute_internal_help();
-int execute_internal_last();
+struct builtin* find_builtin(char* name);
+struct builtin* find_command_builtin(char** argv);
+int compare_builtin(const void* name, const void* builtin);
+int run_builtin_in_shell(struct command_node* command);
+int execute_internal_help(char** argv);
+int execute_internal_close(char** argv);
+int execute_internal_last(char** argv);
+int execute_internal_history(char** argv);
+int execute_internal_arena(char** argv);
+int execute_internal_hash(char** argv);
+int execute_internal_launchstat(char** argv);
+int execute_internal_enable(char** argv);
+int execute_internal_true(char** argv);
+int execute_internal_false(char** argv);
+int execute_internal_pwd(char** argv);
+int execute_internal_cd(char** argv);
+int execute_internal_echo(char** argv);
+int execute_internal_printf(char** argv);
+int printf_format(char* format, char*** args);
+int print_escaped(char* str, int printf_style);
+int print_escape(char* escape, int printf_style);
+int execute_internal_cat(char** argv);
+int execute_internal_tee(char** argv);
+int copy_fd(int in_fd, int out_fd);
+int tee_fds(int* fds, int n_fds);
+int splice_all(int in_fd, int out_fd, size_t len);
+int write_all(int fd, char* data, size_t len);
+int execute_internal_filters(char** argv);
+int filter_compile(char** argv, int argc, struct filter_stage* stage);
+int filter_parse_fields(char* list, struct filter_stage* stage);
+size_t filter_lines(struct filter_chain* chain, char* data, size_t len);
+void filter_line(struct filter_chain* chain, int i, char* line, size_t len, int newline);
+char* filter_cut(struct filter_stage* stage, char* line, size_t* len);
+void filter_finish(struct filter_chain* chain);
+void filter_write(struct filter_chain* chain, char* data, size_t len);
+void filter_flush(struct filter_chain* chain);
+int utf8_valid(char* text, size_t len);
+int execute_internal_test(char** argv);
+int test_expression(char** args, int n);
+int execute_internal_jobs(char** argv);
+int execute_internal_jobstat(char** argv);
+int execute_internal_wait(char** argv);
+int execute_internal_fg(char** argv);
+int execute_internal_bg(char** argv);
+int execute_internal_set(char** argv);
+int execute_internal_export(char** argv);
+int execute_internal_unset(char** argv);
+int execute_internal_parallel(char** argv);
+int parallel_start(struct parallel_task* task, char** template, int n_template, char* input, pid_t group);
+void parallel_finish(struct parallel_task* task);
+struct pipeline_node* single_command_pipeline(char** argv, int argc);
+int execute_internal_cache(char** argv);
+int set_shell_option(char* assignment);
+// Trace
+void trace_event(int level, char* event, pid_t pid, long value, char* format, ...);
+void trace_flush();
+void trace_changed();
+size_t json_escape(char* out, char* text);
 // Auxiliary Functions and Procedures
-int count_args(char** argv, int index);
 void close_fd(int fd);
-void read_line(char* buffer);
-int is_operador(char* c);
+long parse_duration(char* text);
+long parse_size(char* text);
 int is_operador_char(char c);
-int is_command(char* c);
-void close_pipes();
 // Print and Format Procedures
-void print_commands(char** command_matrix);
+void print_tokens(struct token* tokens);
 void print_error(char* c);
+void printf_error(char* format, char* c);
 void print_alert(char* c);
 void printf_alert(char* format, char* c);
 /*************************************** 
  * Global Variables
  ***************************************
  ***************************************/
-int GLOBAL_PIPE1[2];
-int GLOBAL_PIPE2[2];
-int MULTIPLE_PIPES_FLAG = FALSE;
-char LAST_COMMAND_LINE[MAX_COMMAND_SIZE];
+int LEXER = LEXER_AUTO;
+lexer_scan_function LEXER_SCAN = NULL;  // set from the lexer option on first use
+char* LEXER_STOP_CHARS[N_LEXER_STOPS] = {" \t'\"\\|&;<>*?[$", "\"\\$", "*?[\\$\""};
+unsigned char LEXER_STOP_TABLE[N_LEXER_STOPS][256];  // scalar scan
+int GLOB_CACHE = TRUE;  // glob-cache option
+int FUSE_FILTERS = TRUE;  // fuse-filters option
+struct dir_listing* GLOB_CACHE_TABLE[GLOB_CACHE_BUCKETS];
+char* GLOB_DENTS = NULL;  // getdents64 buffer
+struct history HISTORY = {-1, NULL, 0, 0, NULL, 0, 0, NULL, 0, -1};
+char* HISTORY_FILE = NULL;  // NULL: ~/.kshell_history if interactive, memory otherwise
 char* LAST_COMMAND_MATRIX;
+struct arena LINE_ARENA;  // reset after every command line
+int LAUNCHER = LAUNCHER_SPAWN;  // how commands are started (--launcher=fork|spawn|zygote)
+char* SERVE_PATH = NULL;  // --serve: socket the server listens on
+char* CLIENT_PATH = NULL;  // --client: socket of the server to send the lines to
+int SERVER_FD = -1;  // listening socket
+int N_CONNECTIONS = 0;  // accepted so far (connection ids)
+struct zygote ZYGOTES[MAX_ZYGOTE_POOL];  // idle helpers
+int N_ZYGOTES = 0;
+int ZYGOTE_POOL = DEFAULT_ZYGOTE_POOL;  // zygote-pool option
+int ZYGOTE_SPAWNER = -1;  // socket to the process the helpers are forked from (-1: the shell forks them)
+int ZYGOTE_DEMAND = 1;  // helpers wanted: recent peak of commands between refills
+int ZYGOTE_USED = 0;  // helpers taken since the last refill
+long ZYGOTE_HITS = 0, ZYGOTE_MISSES = 0;
+struct launch_stats LAUNCH_STATS[N_LAUNCHERS];
+extern char** environ;
+struct variable_table VARIABLES;
+pid_t SHELL_PID;  // $$ (the same in subshells)
+pid_t LAST_BACKGROUND_PID = 0;  // $!: last process of the last background job
+struct path_cache PATH_CACHE;
+char* CACHE_DIR = NULL;  // NULL: $XDG_CACHE_HOME/kshell or ~/.cache/kshell
+int CACHE_SIZE = DEFAULT_CACHE_SIZE;
+struct cache_stats CACHE_STATS;
+char* CACHE_ENV[] = {"PATH", "HOME", "LANG", "LC_ALL", "LC_COLLATE", "LC_CTYPE", "LC_MESSAGES", "LC_NUMERIC", "LC_TIME", "TZ", "COLUMNS", NULL};  // part of the key
+int LAST_EXIT_STATUS = 0;  // exit status of the last foreground command
+int SHELL_CLOSE_REQUESTED = FALSE;  // set by 'close'
+TAILQ_HEAD(job_table, job) JOBS = TAILQ_HEAD_INITIALIZER(JOBS);
+int JOB_CONTROL = FALSE;  // interactive: jobs get process groups and the terminal
+pid_t SHELL_PGID;
+int MAX_JOBS = DEFAULT_MAX_JOBS;  // background jobs running at once (0: no limit)
+int PIPE_SIZE = 0;  // F_SETPIPE_SZ for pipeline pipes (0: kernel default)
+char* BG_LIMIT = NULL;  // bg-limit option: 'limit' words for background jobs
+struct job_limits BG_LIMITS;  // BG_LIMIT, parsed
+char* CGROUP_DIR = NULL;  // <the shell's cgroup>/kshell-PID, parent of the job cgroups (NULL: none)
+pid_t CGROUP_OWNER = 0;  // process that made CGROUP_DIR (a forked session makes its own)
+int CGROUP_SHELL_MOVED = FALSE;  // the shell left its cgroup for CGROUP_DIR/shell
+int PIPELINE_AFFINITY = AFFINITY_OFF;
+struct cpu_place CPU_ORDER[MAX_CPUS];  // stage i runs on CPU_ORDER[i % N_CPU_ORDER]
+int N_CPU_ORDER = 0;
+int EVENT_LOOP = -1;  // epoll instance
+int SIGNAL_FD = -1;  // SIGCHLD
+int INPUT_WATCHED = FALSE;  // stdin is in the epoll set
+int INPUT_NOT_POLLABLE = FALSE;  // input is a regular file: always readable
+struct input_buffer INPUT;
+int INTERACTIVE = FALSE;  // commands come from a terminal: banner, prompt and job control
+int TRACE_LEVEL = TRACE_OFF;
+char* TRACE_FILE = NULL;  // NULL: stderr
+int TRACE_FD = -1;  // opened on the first flush
+struct trace_record TRACE_RING[TRACE_RING_SIZE];
+int TRACE_COUNT = 0;  // records waiting for a flush
+char* LAUNCHER_CHOICES[] = {"fork", "spawn", "zygote", NULL};  // indexed by LAUNCHER_*
+char* TRACE_LEVELS[] = {"off", "error", "info", "debug", NULL};  // indexed by TRACE_*
+char* AFFINITY_CHOICES[] = {"off", "compact", "spread", NULL};  // indexed by AFFINITY_*
+char* SWITCH_CHOICES[] = {"off", "on", NULL};
+char* LEXER_CHOICES[] = {"auto", "scalar", "sse2", "avx2", "check", NULL};  // indexed by LEXER_*
+struct shell_option SHELL_OPTIONS[] = {
+	{"bg-limit", NULL, NULL, &BG_LIMIT, bg_limit_changed},
+	{"cache-dir", NULL, NULL, &CACHE_DIR, NULL},
+	{"cache-size", &CACHE_SIZE, NULL, NULL, NULL},
+	{"fuse-filters", &FUSE_FILTERS, SWITCH_CHOICES, NULL, NULL},
+	{"glob-cache", &GLOB_CACHE, SWITCH_CHOICES, NULL, glob_cache_clear},
+	{"history-file", NULL, NULL, &HISTORY_FILE, NULL},
+	{"launcher", &LAUNCHER, LAUNCHER_CHOICES, NULL, launcher_changed},
+	{"lexer", &LEXER, LEXER_CHOICES, NULL, lexer_changed},
+	{"max-jobs", &MAX_JOBS, NULL, NULL, NULL},
+	{"pipe-size", &PIPE_SIZE, NULL, NULL, NULL},
+	{"pipeline-affinity", &PIPELINE_AFFINITY, AFFINITY_CHOICES, NULL, affinity_changed},
+	{"trace", &TRACE_LEVEL, TRACE_LEVELS, NULL, trace_changed},
+	{"trace-file", NULL, NULL, &TRACE_FILE, trace_changed},
+	{"zygote-pool", &ZYGOTE_POOL, NULL, NULL, launcher_changed},
+};
+#define N_SHELL_OPTIONS ((int) (sizeof(SHELL_OPTIONS)/sizeof(SHELL_OPTIONS[0])))
+struct builtin BUILTINS[] = {  // sorted by name (binary search)
+	{"[", execute_internal_test, "<[ expr ]>: Same as test", FALSE, TRUE, NULL, FALSE},
+	{"arena", execute_internal_arena, "<arena>: Show command line memory usage", TRUE, TRUE, NULL, FALSE},
+	{"bg", execute_internal_bg, "<bg [%job]>: Resume a stopped job in the background", TRUE, TRUE, NULL, FALSE},
+	{"cache", execute_internal_cache, "<cache [-r] [--ttl N] [cmd...]>: Replay the output of an earlier identical run of cmd", TRUE, TRUE, NULL, FALSE},
+	{"cat", execute_internal_cat, "<cat [file...]>: Write the files (or stdin) without copying them through the shell", FALSE, TRUE, "u", TRUE},
+	{"cd", execute_internal_cd, "<cd [dir|-]>: Change the working directory", TRUE, TRUE, NULL, FALSE},
+	{"close", execute_internal_close, "<close>: Close K-Shell", TRUE, TRUE, NULL, FALSE},
+	{"echo", execute_internal_echo, "<echo [-neE] [arg...]>: Write the arguments", FALSE, TRUE, NULL, FALSE},
+	{"enable", execute_internal_enable, "<enable [-n] [name...]>: Enable/disable internal commands", TRUE, TRUE, NULL, FALSE},
+	{"export", execute_internal_export, "<export [name[=value]...]>: Put variables in the environment of the commands (or list them)", TRUE, TRUE, NULL, FALSE},
+	{"false", execute_internal_false, "<false>: Exit with status 1", FALSE, TRUE, NULL, FALSE},
+	{"fg", execute_internal_fg, "<fg [%job]>: Bring a job to the foreground", TRUE, TRUE, NULL, FALSE},
+	{"filters", execute_internal_filters, "<filters stage ['|' stage...]>: Run grep, head, wc and cut stages in one process", FALSE, TRUE, NULL, TRUE},
+	{"hash", execute_internal_hash, "<hash [-r] [name...]>: Show, clear or fill the command path cache", TRUE, TRUE, NULL, FALSE},
+	{"help", execute_internal_help, "<help>: Show Internal Commands", TRUE, TRUE, NULL, FALSE},
+	{"history", execute_internal_history, "<history [N] | history search text>: Show the last N lines, or the lines that contain text", TRUE, TRUE, NULL, FALSE},
+	{"jobs", execute_internal_jobs, "<jobs [-l]>: List the jobs", TRUE, TRUE, NULL, FALSE},
+	{"jobstat", execute_internal_jobstat, "<jobstat [%job]>: Show the limits of the jobs and what their cgroups used", TRUE, TRUE, NULL, FALSE},
+	{"last", execute_internal_last, "<last>: Show the last command line", TRUE, TRUE, NULL, FALSE},
+	{"launchstat", execute_internal_launchstat, "<launchstat [-r]>: Show (or reset) the launch latency of each launcher", TRUE, TRUE, NULL, FALSE},
+	{"parallel", execute_internal_parallel, "<parallel [-j N] cmd {} [::: input...]>: Run cmd for each input (or stdin line), N at a time", FALSE, TRUE, NULL, FALSE},
+	{"printf", execute_internal_printf, "<printf format [arg...]>: Formatted output", FALSE, TRUE, NULL, FALSE},
+	{"pwd", execute_internal_pwd, "<pwd>: Show the working directory", FALSE, TRUE, NULL, FALSE},
+	{"set", execute_internal_set, "<set -o [name=value...]>: Show or change shell options", TRUE, TRUE, NULL, FALSE},
+	{"tee", execute_internal_tee, "<tee [-a] [file...]>: Copy stdin to stdout and to the files", FALSE, TRUE, "a", TRUE},
+	{"test", execute_internal_test, "<test expr>: Evaluate a conditional expression", FALSE, TRUE, NULL, FALSE},
+	{"true", execute_internal_true, "<true>: Exit with status 0", FALSE, TRUE, NULL, FALSE},
+	{"unset", execute_internal_unset, "<unset name...>: Remove variables", TRUE, TRUE, NULL, FALSE},
+	{"wait", execute_internal_wait, "<wait [%job|pid...]>: Wait for background jobs", TRUE, TRUE, NULL, FALSE},
+};
+#define N_BUILTINS ((int) (sizeof(BUILTINS)/sizeof(BUILTINS[0])))
 /*************************************** 
  * Main
  ***************************************
  ***************************************/
 int main(int argc, char** argv){
+	init_variables();
+	if(parse_shell_options(argc, argv) < 0)
+		return 1;
+	if(CLIENT_PATH != NULL)
+		return run_client(CLIENT_PATH);
+	if(SERVE_PATH == NULL && LAUNCHER == LAUNCHER_ZYGOTE)
+		zygote_spawner_start();  // while the shell is still small
 	start_shell();
-	loop_shell();
+	if(SERVE_PATH != NULL)
+		serve(SERVE_PATH);
+	else
+		loop_shell();
 	finish_shell();
-	return 0;
+	trace_flush();
+	return LAST_EXIT_STATUS;
 }
 /*************************************** 
  * Shell LifeCycle
  ***************************************
  ***************************************/
+int parse_shell_options(int argc, char** argv){
+	// '--name=value' sets the shell option 'name' (see 'set -o'), '--serve
+	// sock' and '--client sock' pick the server modes. Then the input:
+	// '-c commands', a script file or, by default, stdin (none for --serve)
+	int i;
+	for(i = 1; i < argc && strncmp(argv[i], "--", 2) == 0; i++){
+		if((strcmp(argv[i], "--serve") == 0 || strcmp(argv[i], "--client") == 0) && i + 1 < argc){
+			if(argv[i][2] == 's')
+				SERVE_PATH = argv[++i];
+			else
+				CLIENT_PATH = argv[++i];
+		}else if(set_shell_option(argv[i] + 2) < 0)
+			break;
+	}
+	if(SERVE_PATH != NULL && i == argc)
+		return 0;
+	if(i < argc && strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+		return open_input_string(argv[i + 1]);
+	if(i < argc && argv[i][0] != '-')
+		return open_input_file(argv[i]);
+	if(i < argc){
+		printf_error("Opcao invalida: %s", argv[i]);
+		print_alert("Uso: kshell [--opcao=valor...] [--serve sock | --client sock] [-c comandos | script]");
+		return -1;
+	}
+	return open_input_fd(STDIN_FILENO);
+}
 void start_shell(){
+	init_job_control();
+	if(!INTERACTIVE)
+		return;
 	printf("\033[0;1m"); // white bold
 	printf("---------------\033[1;32m K-Shell\033[0;1m ---------------");
 	printf("\n---------------------------------------\n");
 }
 void loop_shell(){
-	char *line;  // line read buffer
+	char *line;  // line read, in the line arena
 	int status; // commands return status
 	do{
-		line = (char*) malloc(sizeof(char)*LINE_BUFFER_SIZE);
-		printf("\033[0;1m >> \033[0m");  
-		read_line(line);// reads the line from stdin
+		notify_jobs();  // background jobs that finished meanwhile
+		print_prompt();
+		line = read_line();// reads the next line of input
+		if(line == NULL){  // end of the input: same as 'close'
+			if(INTERACTIVE)
+				printf("\n");
+			break;
+		}
 		// parse commands in a command matrix
 		status = execute_commands(line);
-		free(line);// I don't know if it's necessary
+		arena_reset(&LINE_ARENA);// releases the line and everything parsed from it
+		trace_flush();
 	}while(status == SHELL_STATUS_CONTINUE);
 
 }
+void print_prompt(){
+	if(!INTERACTIVE)
+		return;
+	printf("\033[0;1m >> \033[0m");  
+	fflush(stdout);  // stdin is not read through stdio, which used to flush it
+}
 void finish_shell(){
-	close_pipes();
+	cgroup_release();
+	if(!INTERACTIVE)
+		return;
 	printf("\033[0;1m----------------------------------\033[1;31mbye\033[0;1m..\n");
 }
 /*************************************** 
- * Command Management
+ * Server Mode
  ***************************************
  ***************************************/
-char** split_commands(char* line){
-		char ** commands = (char**) malloc(sizeof(char*)*MAX_COMMAND_BY_LINE*MAX_COMMAND_SIZE);
-	int i = 0;
-	char *p = strtok(line, " ");
-	while(p != NULL) {
-		commands[i++] = p;
-    	p = strtok(NULL, " ");
-	}
-	return commands;
-}
-char** get_command_parameters(char** matrix, int* index){
-	char** args = (char**) malloc(sizeof(char*)*MAX_COMMAND_SIZE);
-	int i = *index;  // le argumentos a partir do comando atual
-	// inclui o nome do comando como argumento
-	int ii = 0;
-	//printf("Comando na posicao <%d> da matriz de comandos\n",i);
-	char* arg = matrix[i];  // argumento atual
-	while(arg != NULL && !is_operador(arg)){
-		//printf("Adicionando <%s> como argumento \n", arg);
-		args[ii] = matrix[i];
-		arg = matrix[++i];
-		ii++;
-	}
-	args[i] = NULL;
-	*index = i;
-	return args;
+int serve(char* path){
+	// 'kshell --serve sock': listens on a Unix socket and gives every
+	// connection a session, forked from this already warm shell (path
+	// cache, options, enabled builtins). The server itself only accepts and
+	// reaps, so a slow line never holds up the other clients
+	struct sockaddr_un address;
+	struct epoll_event event;
+	struct stat info;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(address.sun_path)){
+		printf_error("Caminho do socket muito longo: %s", path);
+		return -1;
+	}
+	strcpy(address.sun_path, path);
+	if(stat(path, &info) == 0 && S_ISSOCK(info.st_mode))
+		unlink(path);  // left by a server that was killed
+	SERVER_FD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(SERVER_FD < 0 || bind(SERVER_FD, (struct sockaddr*) &address, sizeof(address)) < 0 || listen(SERVER_FD, SOMAXCONN) < 0){
+		printf_error("Erro ao abrir o socket: %s", path);
+		perror("->");
+		fflush(stdout);
+		LAST_EXIT_STATUS = 1;
+		return -1;
+	}
+	event.events = EPOLLIN;
+	event.data.u64 = EVENT_DATA(EVENT_ACCEPT, 0);
+	epoll_ctl(EVENT_LOOP, EPOLL_CTL_ADD, SERVER_FD, &event);
+	TRACE(TRACE_INFO, "serve", getpid(), SERVER_FD, "%s", path);
+	trace_flush();
+	while(!SHELL_CLOSE_REQUESTED){
+		event_loop_run(FALSE);
+		trace_flush();
+	}
+	close(SERVER_FD);
+	unlink(path);
+	return 0;
+}
+void serve_accept(){
+	int fd, id;
+	pid_t pid;
+	while((fd = accept4(SERVER_FD, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0){
+		id = ++N_CONNECTIONS;
+		fflush(stdout);
+		pid = fork();
+		if(pid == 0){
+			TRACE_COUNT = 0;  // the server flushes its own records
+			fcntl(fd, F_SETFL, 0);  // blocking, like any input
+			serve_connection(fd, id);
+		}
+		if(pid < 0)
+			TRACE(TRACE_ERROR, "fork", 0, errno, "connection %d", id);
+		else
+			TRACE(TRACE_INFO, "connection", pid, id, "accepted");
+		close(fd);
+	}
+}
+void serve_connection(int fd, int id){
+	// A session: reads lines from the client like a script from a pipe
+	// and runs each one with stdout and stderr in memfds, which are sent
+	// back as frames followed by the exit status. Never returns
+	struct connection_stats stats;
+	struct timespec start, end;
+	sigset_t pipe_signal;
+	int out = memfd_create("stdout", MFD_CLOEXEC), err = memfd_create("stderr", MFD_CLOEXEC);
+	int log = dup(STDERR_FILENO);  // the server's stderr, for the statistics
+	int null = open("/dev/null", O_RDONLY);
+	char* line;
+	uint32_t status;
+	struct stat info;
+	event_loop_reset();  // the server's jobs and epoll are not ours
+	close(SERVER_FD);
+	if(fd == STDIN_FILENO)
+		fd = fcntl(fd, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+	if(null >= 0 && null != STDIN_FILENO){  // commands read nothing, not the server's stdin
+		dup2(null, STDIN_FILENO);
+		close(null);
+	}
+	sigemptyset(&pipe_signal);
+	sigaddset(&pipe_signal, SIGPIPE);
+	sigprocmask(SIG_BLOCK, &pipe_signal, NULL);  // a client that goes away is EPIPE, not death
+	memset(&stats, 0, sizeof(stats));
+	stats.id = id;
+	clock_gettime(CLOCK_MONOTONIC, &stats.opened);
+	open_input_fd(fd);
+	INPUT_NOT_POLLABLE = FALSE;
+	while(out >= 0 && err >= 0 && (line = read_line()) != NULL){
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		stats.requests++;
+		stats.bytes_in += strlen(line) + 1;
+		ftruncate(out, 0);
+		ftruncate(err, 0);
+		lseek(out, 0, SEEK_SET);
+		lseek(err, 0, SEEK_SET);
+		dup2(out, STDOUT_FILENO);
+		dup2(err, STDERR_FILENO);
+		status = execute_commands(line);
+		arena_reset(&LINE_ARENA);
+		trace_flush();
+		fflush(stdout);
+		fflush(stderr);
+		if(LAST_EXIT_STATUS != 0)
+			stats.errors++;
+		fstat(out, &info);
+		if(send_frame(fd, FRAME_STDOUT, NULL, out, info.st_size) < 0)
+			break;
+		stats.bytes_out += info.st_size;
+		fstat(err, &info);
+		if(send_frame(fd, FRAME_STDERR, NULL, err, info.st_size) < 0)
+			break;
+		stats.bytes_out += info.st_size;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		stats.busy += elapsed_seconds(&start, &end);
+		if(elapsed_seconds(&start, &end) > stats.slowest)
+			stats.slowest = elapsed_seconds(&start, &end);
+		if(status == SHELL_STATUS_CLOSE)
+			SHELL_CLOSE_REQUESTED = TRUE;
+		status = htonl((uint32_t) LAST_EXIT_STATUS);
+		if(send_frame(fd, FRAME_EXIT, (char*) &status, -1, sizeof(status)) < 0 || SHELL_CLOSE_REQUESTED)
+			break;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	dprintf(log, "kshell: conexao %d: %ld linhas, %ld com erro, %ld bytes in, %ld bytes out, ocupada %.3fs (mais lenta %.3fs), aberta %.3fs\n",
+		stats.id, stats.requests, stats.errors, stats.bytes_in, stats.bytes_out, stats.busy, stats.slowest, elapsed_seconds(&stats.opened, &end));
+	TRACE(TRACE_INFO, "connection_closed", getpid(), stats.requests, "%d", stats.id);
+	trace_flush();
+	_exit(0);
+}
+int send_frame(int sock, char type, char* data, int data_fd, size_t len){
+	// A frame: the type, the length and the data, from 'data' or (sendfile)
+	// from the start of 'data_fd'. Empty output frames are not sent
+	char header[FRAME_HEADER_SIZE];
+	uint32_t length = htonl((uint32_t) len);
+	off_t offset = 0;
+	ssize_t n;
+	if(len == 0 && type != FRAME_EXIT)
+		return 0;
+	header[0] = type;
+	memcpy(header + 1, &length, sizeof(length));
+	if(write_all(sock, header, sizeof(header)) < 0)
+		return -1;
+	if(data != NULL)
+		return write_all(sock, data, len);
+	while(offset < (off_t) len){
+		n = sendfile(sock, data_fd, &offset, len - offset);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return -1;
+	}
+	return 0;
+}
+int run_client(char* path){
+	// 'kshell --client sock': sends each input line to the server and waits
+	// for its reply, writing the frames to stdout and stderr. Exits with the
+	// status of the last line
+	struct sockaddr_un address;
+	char header[FRAME_HEADER_SIZE];
+	char buffer[COPY_BUFFER_SIZE];
+	uint32_t length, status = 0;
+	char* line;
+	int sock, done;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(sock < 0 || connect(sock, (struct sockaddr*) &address, sizeof(address)) < 0){
+		printf_error("Erro ao conectar: %s", path);
+		perror("->");
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	init_event_loop();  // read_line sleeps in it
+	while(TRUE){
+		print_prompt();
+		if((line = read_line()) == NULL)
+			break;
+		if(write_all(sock, line, strlen(line)) < 0 || write_all(sock, "\n", 1) < 0)
+			break;
+		arena_reset(&LINE_ARENA);
+		for(done = FALSE; !done; ){
+			if(read_full(sock, header, sizeof(header)) < 0){
+				close(sock);  // the session ran 'close' (or the server died)
+				return (int) status;
+			}
+			memcpy(&length, header + 1, sizeof(length));
+			length = ntohl(length);
+			if(header[0] == FRAME_EXIT){
+				if(length != sizeof(status) || read_full(sock, &status, sizeof(status)) < 0)
+					return 1;
+				status = ntohl(status);
+				done = TRUE;
+				continue;
+			}
+			while(length > 0){
+				size_t chunk = length < sizeof(buffer) ? length : sizeof(buffer);
+				if(read_full(sock, buffer, chunk) < 0)
+					return 1;
+				write_all(header[0] == FRAME_STDERR ? STDERR_FILENO : STDOUT_FILENO, buffer, chunk);
+				length -= chunk;
+			}
+		}
+	}
+	close(sock);
+	return (int) status;
+}
+int read_full(int fd, void* data, size_t len){
+	// Returns -1 at EOF or on error before 'len' bytes arrived
+	ssize_t n;
+	while(len > 0){
+		n = read(fd, data, len);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return -1;
+		data = (char*) data + n;
+		len -= n;
+	}
+	return 0;
 }
 /*************************************** 
- * Execução dos Comandos
+ * Arena
  ***************************************
  ***************************************/
-int execute_commands(char* line){
-	char** cmd_tokens = split_commands(line);  // Split line in command tokens
-	//print_commands(cmd_tokens);
-	int i = 0, status;
-	while(cmd_tokens[i] != NULL){
-		if(is_command(cmd_tokens[i])){// encontrou um COMANDO
-			char** argv; // Command Args
-			if(exists_operator_before(cmd_tokens, i)){
-				if(exists_operator_after(cmd_tokens, i)){
-					print_alert("There's a command between operators");
-					char* before_operator = cmd_tokens[i-1];  // before operator (always is the token before the command itself)
-					argv = get_command_parameters(cmd_tokens, &i);// get command arguments
-					char* after_operator = cmd_tokens[i];  // after operator
-					status = cmd_between_operator(argv, before_operator, after_operator, cmd_tokens, &i);// handle operator and execute the command
-				}else{
-					print_alert("There's a operator before command");
-					char* operator = cmd_tokens[i-1];  // actual operator (always is the token before the command itself)
-					argv = get_command_parameters(cmd_tokens, &i);// get command arguments
-					status = cmd_after_operator(argv, operator);// handle operator and execute the command
-				}
-			}else if(exists_operator_after(cmd_tokens, i)){
-				print_alert("There's a operator after command");
-				argv = get_command_parameters(cmd_tokens, &i);// get command arguments
-				char* operator = cmd_tokens[i];  // actual operator
-				status = cmd_before_operator(argv, operator, cmd_tokens, &i);// handle operator and execute the command
+void* arena_alloc(struct arena* arena, size_t size){
+	// Bumps a pointer in the current block. Blocks are kept across resets and
+	// reused in order, so after the first few lines nothing is malloc'd
+	struct arena_block* block = arena->current;
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	while(block == NULL || block->used + size > block->size){
+		if(block != NULL && block->next != NULL && block->next->size >= size){
+			block = block->next;  // reuse a block from a previous line
+		}else{
+			size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+			struct arena_block* fresh = (struct arena_block*) malloc(sizeof(struct arena_block) + block_size);
+			if(fresh == NULL){
+				print_error("Sem memoria");
+				exit(1);
+			}
+			fresh->size = block_size;
+			arena->reserved += block_size;
+			if(block == NULL){
+				fresh->next = NULL;
+				arena->head = fresh;
 			}else{
-				print_alert("Single Command");
-				argv = get_command_parameters(cmd_tokens, &i);// get command arguments
-				status = cmd_no_operator(argv);
+				fresh->next = block->next;
+				block->next = fresh;
 			}
+			block = fresh;
 		}
-		i++; // Next Token
+		block->used = 0;
 	}
-	close_pipes();
-	MULTIPLE_PIPES_FLAG = FALSE;
-	strcpy(LAST_COMMAND_LINE, line); // Store last command line
-	printf("\033[0m");
-	return status;// SHELL_STATUS_CONTINUE
+	arena->current = block;
+	block->used += size;
+	arena->used += size;
+	if(arena->used > arena->peak)
+		arena->peak = arena->used;
+	return block->data + block->used - size;
 }
-int execute_standard_sync_command(char** argv){
-	pid_t child;
-	//print_commands(com_mat);
-	child = fork();
-	if(child == 0){
-		if(execvp(argv[0], argv) < 0){
-			print_error("Comando possívelmente invalido ou incompleto:");
-			perror("->");
+void arena_reset(struct arena* arena){
+	// O(1): later blocks are cleared when the allocator moves into them
+	arena->current = arena->head;
+	if(arena->head != NULL)
+		arena->head->used = 0;
+	arena->used = 0;
+}
+/*************************************** 
+ * Lexer
+ ***************************************
+ ***************************************/
+struct token* split_commands(char* line){
+	// The tokens of the line (ending with a TOKEN_END), or NULL after an
+	// error message
+	struct token* tokens;
+	if(LEXER_SCAN == NULL)
+		lexer_changed();
+	tokens = lex_line(line, LEXER_SCAN);
+	if(tokens != NULL && LEXER == LEXER_CHECK && !lexer_check(line, tokens))
+		return NULL;
+	return tokens;
+}
+struct token* lex_line(char* line, lexer_scan_function scan){
+	// Words come out with the quotes and escapes removed, in a copy of the
+	// line in the arena (an operator that touches a word needs its own
+	// '\0'). Plain runs are found by 'scan' and copied in one go; only the
+	// bytes it stops at are looked at one by one. Quoted text is always
+	// part of a word, even "|" or ''. A word with an unquoted wildcard or
+	// a $ reference is expanded when its command starts: its quoted
+	// specials get a backslash, a reference is copied as it is (with a '"'
+	// before it when it is in double quotes)
+	size_t len = strlen(line), i = 0, o = 0, run;
+	char* out = (char*) arena_alloc(&LINE_ARENA, 2*len + 2);
+	struct token* tokens = (struct token*) arena_alloc(&LINE_ARENA, sizeof(struct token)*(len + 2));
+	int n = 0, escapes;
+	char* end;
+	while(TRUE){
+		while(line[i] == ' ' || line[i] == '\t')
+			i++;
+		if(i >= len || line[i] == '#')  // '#' starting a word: comment
+			break;
+		tokens[n].text = out + o;
+		tokens[n].expand = 0;
+		escapes = 0;
+		if((run = lex_operator(line + i)) > 0){
+			memcpy(out + o, line + i, run);
+			o += run;
+			i += run;
+			out[o++] = '\0';
+			tokens[n].type = token_type_of(tokens[n].text);
+			n++;
+			continue;
 		}
-	}else{
-		waitpid(child, NULL, 0);
+		while(i < len){
+			run = scan(line + i, len - i, STOP_WORD);
+			memcpy(out + o, line + i, run);
+			o += run;
+			i += run;
+			if(i >= len || strchr(" \t|&;<>", line[i]) != NULL)
+				break;
+			if(line[i] == '*' || line[i] == '?' || line[i] == '['){
+				tokens[n].expand |= WORD_GLOB;
+				out[o++] = line[i++];
+			}else if(line[i] == '$'){
+				if((run = lex_reference(line + i)) > 0){
+					memcpy(out + o, line + i, run);
+					o += run;
+					i += run;
+					tokens[n].expand |= WORD_VARS;
+				}else
+					o += lex_copy_quoted(out + o, line + i++, 1, scan, &escapes);  // just a '$'
+			}else if(line[i] == '\\'){  // a trailing backslash is dropped
+				if(i + 1 < len)
+					o += lex_copy_quoted(out + o, line + i + 1, 1, scan, &escapes);
+				i += 2;
+			}else if(line[i] == '\''){
+				if((end = (char*) memchr(line + i + 1, '\'', len - i - 1)) == NULL){
+					print_error("Aspas simples nao fechadas");
+					return NULL;
+				}
+				o += lex_copy_quoted(out + o, line + i + 1, end - (line + i + 1), scan, &escapes);
+				i = end + 1 - line;
+			}else{  // '"'
+				for(i++; TRUE; ){
+					run = scan(line + i, len - i, STOP_DOUBLE_QUOTED);
+					o += lex_copy_quoted(out + o, line + i, run, scan, &escapes);
+					i += run;
+					if(i >= len){
+						print_error("Aspas duplas nao fechadas");
+						return NULL;
+					}
+					if(line[i] == '$' && (run = lex_reference(line + i)) > 0){
+						out[o++] = '"';  // quoted reference: its value is not a pattern
+						memcpy(out + o, line + i, run);
+						o += run;
+						i += run;
+						tokens[n].expand |= WORD_VARS;
+						continue;
+					}
+					if(line[i] == '$'){
+						o += lex_copy_quoted(out + o, line + i++, 1, scan, &escapes);
+						continue;
+					}
+					if(line[i++] == '"')
+						break;
+					if(i < len && strchr("\"\\$`", line[i]) != NULL)
+						o += lex_copy_quoted(out + o, line + i++, 1, scan, &escapes);
+					else
+						o += lex_copy_quoted(out + o, "\\", 1, scan, &escapes);
+				}
+			}
+		}
+		out[o++] = '\0';
+		if(escapes > 0 && tokens[n].expand == 0)  // nothing to expand after all
+			glob_unescape(tokens[n].text);
+		tokens[n++].type = TOKEN_WORD;
 	}
-	return SHELL_STATUS_CONTINUE;
+	tokens[n].type = TOKEN_END;
+	tokens[n].text = NULL;
+	tokens[n].expand = 0;
+	return tokens;
 }
-int execute_standard_async_command(char** argv){
-	print_alert("Background Command");
-	pid_t child;
-	child = fork();// FORK NO child
-	if(child == 0){  // PRIMEIRO COMANDO
-		if(execvp(argv[0], argv) < 0){  // EXECUTA O COMANDO
-			print_error("Comando possívelmente invalido ou incompleto:");
-			perror("->");
+size_t lex_copy_quoted(char* out, char* text, size_t len, lexer_scan_function scan, int* escapes){
+	// Copies quoted text to 'out' with a backslash before each wildcard,
+	// backslash, '$' and '"', in case the word turns out to be expanded.
+	// Returns the bytes written
+	size_t o = 0, i = 0, run;
+	while(i < len){
+		run = scan(text + i, len - i, STOP_SPECIAL);
+		memcpy(out + o, text + i, run);
+		o += run;
+		i += run;
+		if(i < len){
+			out[o++] = '\\';
+			out[o++] = text[i++];
+			(*escapes)++;
 		}
-	}else{ // CODIGO DO PAI
-		//waitpid(child, NULL, 0); Aqui esta o segredo hehe
-		print_alert("Async command finished");
 	}
-	return SHELL_STATUS_CONTINUE;
+	return o;
+}
+size_t lex_operator(char* text){
+	// Length of the operator at 'text', 0 if a word starts there:
+	// | & ; && || (words for the parser, as before), [n]< [n]> [n]>>
+	// [n]<&m [n]>&m [n]<&- [n]>&- &> &>>. The digits of [n] must touch the
+	// '<' or '>', else they start a word
+	char* c = text;
+	while(*c >= '0' && *c <= '9')
+		c++;
+	if(*c == '<' || *c == '>'){
+		if(c[0] == '>' && c[1] == '>')
+			return c + 2 - text;
+		if(c[1] == '&' && c[2] == '-')
+			return c + 3 - text;
+		if(c[1] == '&' && c[2] >= '0' && c[2] <= '9'){
+			for(c += 2; *c >= '0' && *c <= '9'; c++)
+				;
+			return c - text;
+		}
+		return c + 1 - text;
+	}
+	if(c != text)
+		return 0;
+	if(text[0] == '&' && text[1] == '>')
+		return (text[2] == '>') ? 3 : 2;
+	if((text[0] == '&' || text[0] == '|') && text[1] == text[0])
+		return 2;
+	return (text[0] == '|' || text[0] == '&' || text[0] == ';') ? 1 : 0;
+}
+size_t lex_reference(char* text){
+	// Length of the $ reference at 'text': $NAME, ${NAME}, ${NAME:-word},
+	// ${NAME-word}, $?, $$ or $!. 0: just a '$'
+	char* end;
+	size_t n;
+	if(text[1] == '?' || text[1] == '$' || text[1] == '!')
+		return 2;
+	if(text[1] != '{')
+		return ((n = variable_name_length(text + 1)) > 0) ? n + 1 : 0;
+	n = variable_name_length(text + 2);
+	end = text + 2 + n;
+	if(n == 0 || (*end != '}' && *end != '-' && !(end[0] == ':' && end[1] == '-')) || (end = strchr(end, '}')) == NULL)
+		return 0;
+	return end + 1 - text;
+}
+int lexer_check(char* line, struct token* tokens){
+	// lexer=check: lexes the line again with the scalar scan and compares.
+	// Returns FALSE (and the line is not run) if they differ
+	struct token* expected = lex_line(line, lexer_scan_scalar);
+	int i;
+	for(i = 0; expected != NULL; i++){
+		if(tokens[i].type != expected[i].type || tokens[i].expand != expected[i].expand || (tokens[i].text != NULL) != (expected[i].text != NULL)
+			|| (tokens[i].text != NULL && strcmp(tokens[i].text, expected[i].text) != 0)){
+			printf_error("lexer: token diferente do scalar: %s", tokens[i].text != NULL ? tokens[i].text : "(fim)");
+			TRACE(TRACE_ERROR, "lexer_check", getpid(), i, "%s", line);
+			return FALSE;
+		}
+		if(tokens[i].type == TOKEN_END)
+			break;
+	}
+	return TRUE;
+}
+void lexer_changed(){
+	// Builds the scalar tables and picks the scan of the lexer option; a
+	// width the CPU (or the build) doesn't have falls back to the next one
+	int stop;
+	char* c;
+	memset(LEXER_STOP_TABLE, 0, sizeof(LEXER_STOP_TABLE));
+	for(stop = 0; stop < N_LEXER_STOPS; stop++){
+		for(c = LEXER_STOP_CHARS[stop]; *c != '\0'; c++)
+			LEXER_STOP_TABLE[stop][(unsigned char) *c] = TRUE;
+	}
+	LEXER_SCAN = lexer_scan_scalar;
+#ifdef __SSE2__
+	if(LEXER != LEXER_SCALAR)
+		LEXER_SCAN = lexer_scan_sse2;
+	if((LEXER == LEXER_AUTO || LEXER == LEXER_AVX2 || LEXER == LEXER_CHECK) && __builtin_cpu_supports("avx2"))
+		LEXER_SCAN = lexer_scan_avx2;
+#endif
+	if((LEXER == LEXER_AVX2 && LEXER_SCAN != lexer_scan_avx2) || (LEXER == LEXER_SSE2 && LEXER_SCAN != lexer_scan_sse2))
+		printf_alert("lexer: %s nao disponivel, usando o mais largo que ha", LEXER_CHOICES[LEXER]);
+}
+size_t lexer_scan_scalar(const char* text, size_t len, enum lexer_stop stop){
+	// Length of the run of text before the first byte of 'stop'
+	const unsigned char* table = LEXER_STOP_TABLE[stop];
+	size_t i = 0;
+	while(i < len && !table[(unsigned char) text[i]])
+		i++;
+	return i;
+}
+#ifdef __SSE2__
+size_t lexer_scan_sse2(const char* text, size_t len, enum lexer_stop stop){
+	// 16 bytes at a time: one compare per stop byte, OR'ed together; the
+	// lowest set bit of the mask is the first stop. The tail (never read
+	// past len) goes through the scalar scan
+	__m128i needles[16];
+	int n_needles = 0, mask, j;
+	size_t i;
+	char* c;
+	for(c = LEXER_STOP_CHARS[stop]; *c != '\0'; c++)
+		needles[n_needles++] = _mm_set1_epi8(*c);
+	for(i = 0; i + 16 <= len; i += 16){
+		__m128i block = _mm_loadu_si128((const __m128i*) (text + i));
+		__m128i hits = _mm_cmpeq_epi8(block, needles[0]);
+		for(j = 1; j < n_needles; j++)
+			hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, needles[j]));
+		if((mask = _mm_movemask_epi8(hits)) != 0)
+			return i + __builtin_ctz(mask);
+	}
+	return i + lexer_scan_scalar(text + i, len - i, stop);
+}
+__attribute__((target("avx2")))
+size_t lexer_scan_avx2(const char* text, size_t len, enum lexer_stop stop){
+	// Same as the SSE2 scan, 32 bytes at a time
+	__m256i needles[16];
+	int n_needles = 0, j;
+	unsigned int mask;
+	size_t i;
+	char* c;
+	for(c = LEXER_STOP_CHARS[stop]; *c != '\0'; c++)
+		needles[n_needles++] = _mm256_set1_epi8(*c);
+	for(i = 0; i + 32 <= len; i += 32){
+		__m256i block = _mm256_loadu_si256((const __m256i*) (text + i));
+		__m256i hits = _mm256_cmpeq_epi8(block, needles[0]);
+		for(j = 1; j < n_needles; j++)
+			hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, needles[j]));
+		if((mask = (unsigned int) _mm256_movemask_epi8(hits)) != 0)
+			return i + __builtin_ctz(mask);
+	}
+	return i + lexer_scan_sse2(text + i, len - i, stop);
+}
+#else
+size_t lexer_scan_sse2(const char* text, size_t len, enum lexer_stop stop){
+	return lexer_scan_scalar(text, len, stop);
+}
+size_t lexer_scan_avx2(const char* text, size_t len, enum lexer_stop stop){
+	return lexer_scan_scalar(text, len, stop);
+}
+#endif
+enum token_type token_type_of(char* text){
+	if(parse_redirect_operator(text, NULL))
+		return TOKEN_REDIRECT;
+	if(text[1] != '\0' || !is_operador_char(text[0]))  // other operators have a single char
+		return TOKEN_WORD;
+	switch(text[0]){
+		case '|': return TOKEN_PIPE;
+		case '&': return TOKEN_BACKGROUND;
+		case ';': return TOKEN_SEQUENCE;
+		default: return TOKEN_WORD;
+	}
+}
+int parse_redirect_operator(char* text, struct redirect* redirect){
+	// [n]<  [n]>  [n]>>  [n]<&m  [n]>&m  [n]<&-  [n]>&-  &>  &>>
+	// Fills 'redirect' (if not NULL) when 'text' is one of them; for '&>'
+	// that is the stdout part, the parser adds the 2>&1. The file name, when
+	// there is one, is the next token
+	struct redirect parsed;
+	char* c = text;
+	int input;
+	parsed.fd = -1;
+	parsed.source_fd = -1;
+	parsed.file = NULL;
+	if(c[0] == '&' && c[1] == '>'){
+		parsed.fd = STDOUT_FILENO;
+		c++;
+	}
+	for(; *c >= '0' && *c <= '9' && parsed.fd < 1000; c++){
+		if(parsed.fd < 0)
+			parsed.fd = 0;
+		parsed.fd = parsed.fd*10 + (*c - '0');
+	}
+	if(*c != '<' && *c != '>')
+		return FALSE;
+	input = (*c++ == '<');
+	if(parsed.fd < 0)
+		parsed.fd = input ? STDIN_FILENO : STDOUT_FILENO;
+	if(*c == '\0'){
+		parsed.type = input ? REDIRECT_INPUT : REDIRECT_OUTPUT;
+	}else if(!input && c[0] == '>' && c[1] == '\0'){
+		parsed.type = REDIRECT_APPEND;
+	}else if(c[0] == '&' && text[0] != '&'){
+		if(c[1] == '-' && c[2] == '\0'){
+			parsed.type = REDIRECT_CLOSE;
+		}else{
+			char* end;
+			parsed.source_fd = (int) strtol(c + 1, &end, 10);
+			if(c[1] < '0' || c[1] > '9' || *end != '\0')
+				return FALSE;
+			parsed.type = REDIRECT_DUP;
+		}
+	}else{
+		return FALSE;
+	}
+	if(redirect != NULL)
+		*redirect = parsed;
+	return TRUE;
 }
 /*************************************** 
- * Operator Position Idenftify
+ * Parser
  ***************************************
  ***************************************/
-int cmd_no_operator(char** argv){
-	// Comandos internos do shell
-	if( strcmp(argv[0], "close") == 0){
-		return SHELL_STATUS_CLOSE;
-	}else if( strcmp(argv[0], "help") == 0){
-		return execute_internal_help();
-	}else if( strcmp(argv[0], "last") == 0){
-		return execute_internal_last();
-	}else  // Single Command
-		return execute_standard_sync_command(argv);	
-}
-int cmd_before_operator(char** argv, char* operator, char** cmd_tokens, int* index){
-	if( is_operator(operator, '|') ){  // handles pipe operator
-		return cmd_before_operator_handle_pipe(argv);
-	}else if( is_operator(operator, '&') ){  // handles background command
-		return execute_standard_async_command(argv);
-	}else if( is_operator(operator, '>') ){  // handles redirect_out operator
-		return cmd_before_operator_handle_redirect_out(argv, cmd_tokens, index);
-	}else{
-		print_error("Operador nao identificado");
-		return SHELL_STATUS_CONTINUE;
+// sequence := job (('&' | ';') job)* ['&' | ';']
+// job      := pipeline
+// pipeline := command ('|' command)*
+// command  := (WORD | '>' WORD)+
+// Every token is looked at once, so a line is parsed in linear time.
+struct sequence_node* parse_sequence(struct token* tokens){
+	struct parser p = {tokens, 0};
+	struct sequence_node* sequence = (struct sequence_node*) arena_alloc(&LINE_ARENA, sizeof(struct sequence_node));
+	STAILQ_INIT(&sequence->jobs);
+	while(p.tokens[p.pos].type != TOKEN_END){
+		struct job_node* job = parse_job(&p);
+		if(job == NULL)
+			return NULL;
+		STAILQ_INSERT_TAIL(&sequence->jobs, job, next);
+		if(p.tokens[p.pos].type == TOKEN_BACKGROUND){
+			job->background = TRUE;
+			p.pos++;
+		}else if(p.tokens[p.pos].type == TOKEN_SEQUENCE){
+			p.pos++;
+		}
 	}
+	return sequence;
+}
+struct job_node* parse_job(struct parser* p){
+	struct job_node* job = (struct job_node*) arena_alloc(&LINE_ARENA, sizeof(struct job_node));
+	job->background = FALSE;
+	if(parse_pipeline(p, &job->pipeline) < 0)
+		return NULL;
+	return job;
 }
-int cmd_between_operator(char** argv, char* before_operator, char* after_operator, char** cmd_tokens, int* index){
-	// Handles Command between two PIPEs 
-	if( is_operator(before_operator, '|') && is_operator(after_operator, '|')){
-	        print_alert("| e |");
-		return cmd_between_operator_handle_pipe_pipe(argv);
-	}else if( is_operator(before_operator, '&') &&  is_operator(after_operator, '&')){  // Assync command
-		print_alert("& e &");
-		return execute_standard_async_command(argv);  // Just run assync and go to the next command
-	}else if( is_operator(before_operator, '&') &&  is_operator(after_operator, '|')){  // Assync command
-		print_alert("& e |");
-		return cmd_before_operator_handle_pipe(argv);  // Handle the pipe after
-	}else if( is_operator(before_operator, '|') &&  is_operator(after_operator, '>')){  // pipe redirect
-	        print_alert("| e >");
-	        return cmd_between_operator_handle_redirect_out_pipe(argv, cmd_tokens, index);
+int parse_pipeline(struct parser* p, struct pipeline_node* pipeline){
+	STAILQ_INIT(&pipeline->commands);
+	pipeline->n_commands = 0;
+	pipeline->timed = FALSE;
+	pipeline->pipe_size = 0;
+	if(p->tokens[p->pos].type == TOKEN_WORD && strcmp(p->tokens[p->pos].text, "time") == 0
+		&& p->tokens[p->pos + 1].type == TOKEN_WORD){  // 'time pipeline'
+		pipeline->timed = TRUE;
+		p->pos++;
+	}
+	if(p->tokens[p->pos].type == TOKEN_WORD && strcmp(p->tokens[p->pos].text, "pipesize") == 0
+		&& p->tokens[p->pos + 1].type == TOKEN_WORD){  // 'pipesize SIZE pipeline'
+		long size = parse_size(p->tokens[p->pos + 1].text);
+		if(size <= 0 || size > INT_MAX){
+			printf_error("pipesize: tamanho invalido: %s", p->tokens[p->pos + 1].text);
+			return -1;
+		}
+		pipeline->pipe_size = (int) size;
+		p->pos += 2;
+	}
+	pipeline->limits = NULL;
+	if(p->tokens[p->pos].type == TOKEN_WORD && strcmp(p->tokens[p->pos].text, "limit") == 0){  // 'limit key=value... pipeline'
+		struct job_limits limits = {0};
+		int i, found;
+		for(i = p->pos + 1; p->tokens[i].type == TOKEN_WORD && (found = parse_job_limit(p->tokens[i].text, &limits)) != 0; i++){
+			if(found < 0)
+				return -1;
+		}
+		if(i > p->pos + 1){  // else 'limit' is the command
+			pipeline->limits = (struct job_limits*) arena_alloc(&LINE_ARENA, sizeof(struct job_limits));
+			*pipeline->limits = limits;
+			p->pos = i;
+		}
+	}
+	while(TRUE){
+		struct command_node* command = parse_command(p);
+		if(command == NULL)
+			return -1;
+		STAILQ_INSERT_TAIL(&pipeline->commands, command, next);
+		pipeline->n_commands++;
+		if(p->tokens[p->pos].type != TOKEN_PIPE)
+			return 0;
+		p->pos++;
 	}
 }
-int cmd_after_operator(char** argv, char* operator){
-	if( is_operator(operator, '|') ){  // handles pipe operator
-		return cmd_after_operator_handle_pipe(argv);
-	}else if( is_operator(operator, '&') ){  // handles background cmd
-		return execute_standard_sync_command(argv);
+struct command_node* parse_command(struct parser* p){
+	struct token* tokens = p->tokens;
+	struct command_node* command;
+	struct redirect redirect;
+	int argc = 0, n_redirects = 0, i;
+	// First pass: validates the command, counts its words and redirections
+	for(i = p->pos; tokens[i].type == TOKEN_WORD || tokens[i].type == TOKEN_REDIRECT; i++){
+		if(tokens[i].type == TOKEN_REDIRECT){
+			parse_redirect_operator(tokens[i].text, &redirect);
+			n_redirects += (tokens[i].text[0] == '&') ? 2 : 1;
+			if(redirect.type == REDIRECT_DUP || redirect.type == REDIRECT_CLOSE)
+				continue;
+			if(tokens[i+1].type != TOKEN_WORD){
+				printf_error("Especifique um unico arquivo depois de '%s'", tokens[i].text);
+				return NULL;
+			}
+			i++;  // the file name
+		}else
+			argc++;
 	}
+	if(argc == 0){
+		if(tokens[i].type == TOKEN_END)
+			print_error("Comando esperado no fim da linha");
+		else
+			printf_error("Comando esperado antes de '%s'", tokens[i].text);
+		return NULL;
+	}
+	// Second pass: builds argv
+	command = (struct command_node*) arena_alloc(&LINE_ARENA, sizeof(struct command_node));
+	command->argv = (char**) arena_alloc(&LINE_ARENA, sizeof(char*)*(argc + 1));
+	command->argc = argc;
+	command->redirects = (struct redirect*) arena_alloc(&LINE_ARENA, sizeof(struct redirect)*(n_redirects + 1));
+	command->n_redirects = n_redirects;
+	command->expand = NULL;
+	command->pid = 0;
+	argc = 0;
+	n_redirects = 0;
+	for(; p->pos < i; p->pos++){
+		if(tokens[p->pos].type == TOKEN_WORD){
+			if(tokens[p->pos].expand && command->expand == NULL)
+				command->expand = (char*) memset(arena_alloc(&LINE_ARENA, command->argc + 1), 0, command->argc + 1);
+			if(tokens[p->pos].expand)
+				command->expand[argc] = tokens[p->pos].expand;
+			command->argv[argc++] = tokens[p->pos].text;
+			continue;
+		}
+		redirect = (struct redirect){0};
+		parse_redirect_operator(tokens[p->pos].text, &redirect);
+		if(redirect.type != REDIRECT_DUP && redirect.type != REDIRECT_CLOSE){
+			redirect.file = tokens[++p->pos].text;
+			if(tokens[p->pos].expand & WORD_VARS){  // expanded, but never as a pattern
+				redirect.expand = TRUE;
+				if(command->expand == NULL)
+					command->expand = (char*) memset(arena_alloc(&LINE_ARENA, command->argc + 1), 0, command->argc + 1);
+			}else if(tokens[p->pos].expand)
+				glob_unescape(redirect.file);
+		}
+		command->redirects[n_redirects++] = redirect;
+		if(tokens[p->pos - 1].text[0] == '&'){  // '&> file' is '> file 2>&1'
+			redirect.type = REDIRECT_DUP;
+			redirect.fd = STDERR_FILENO;
+			redirect.source_fd = STDOUT_FILENO;
+			redirect.file = NULL;
+			command->redirects[n_redirects++] = redirect;
+		}
+	}
+	command->argv[argc] = NULL;
+	command->timeout_ms = 0;
+	// 'timeout N cmd': the deadline is kept by the event loop, so no extra
+	// process sits between the shell and cmd. Anything else is left to the
+	// external timeout
+	while(command->argc >= 3 && strcmp(command->argv[0], "timeout") == 0){
+		long timeout_ms = parse_duration(command->argv[1]);
+		if(timeout_ms < 0)
+			break;
+		command->timeout_ms = timeout_ms;
+		command->argv += 2;
+		command->argc -= 2;
+		if(command->expand != NULL)
+			command->expand += 2;
+	}
+	return command;
 }
 /*************************************** 
- * Operator Handling
+ * Execução dos Comandos
  ***************************************
  ***************************************/
-int cmd_before_operator_handle_pipe(char** argv){
-	// PRIMEIRO SEMPRE ESCREVE NO PIPE 1
-	MULTIPLE_PIPES_FLAG = !MULTIPLE_PIPES_FLAG;
-	pid_t child;
-	pipe(GLOBAL_PIPE1);// CRIA PIPE 1
-	child = fork();// FORK NO child
-	if(child == 0){  // PRIMEIRO COMANDO
-		close_fd(GLOBAL_PIPE1[READ_END]);// child NUNCA LÊ DO PIPE 1
-		dup2(GLOBAL_PIPE1[WRITE_END], STDOUT_FILENO); // child SEMPRE ESCREVE NO PIPE 1
-		if(execvp(argv[0], argv) < 0){  // EXECUTA O COMANDO
-			print_error("Comando possívelmente invalido ou incompleto:");
-			return SHELL_STATUS_CONTINUE;
-		}
-	}else{ // CODIGO DO PAI
-    	close_fd(GLOBAL_PIPE1[WRITE_END]);// PAI NAO ESCREVE NO PIPE 1 MAS PRECISA LER DELE (child)
-		waitpid(child, NULL, 0);  // ESPERA child 1
-		print_alert("First command finished");
+int execute_commands(char* line){
+	struct token* tokens;
+	struct sequence_node* sequence;
+	int status = SHELL_STATUS_CONTINUE;
+	if(INTERACTIVE || HISTORY_FILE != NULL){  // '!!', '!n', '!prefix'
+		char* expanded = history_expand(line);
+		if(expanded == NULL){
+			LAST_EXIT_STATUS = 1;
+			return status;
+		}
+		if(expanded != line)
+			printf("%s\n", expanded);
+		line = expanded;
 	}
-	return SHELL_STATUS_CONTINUE;
+	history_add(line);  // before the tokens cut it up
+	glob_cache_clear();  // listings are good for one line
+	TRACE(TRACE_INFO, "line", getpid(), strlen(line), "%s", line);
+	tokens = split_commands(line);  // Split line in command tokens
+	if(tokens == NULL){  // unterminated quote
+		LAST_EXIT_STATUS = 2;
+		HISTORY.current = -1;
+		return status;
+	}
+	//print_tokens(tokens);
+	sequence = parse_sequence(tokens);  // Build the command tree
+	TRACE(sequence != NULL ? TRACE_DEBUG : TRACE_ERROR, "parse", getpid(), sequence != NULL ? 0 : -1, "%s", tokens[0].text != NULL ? tokens[0].text : "");
+	if(sequence != NULL)
+		status = execute_sequence(sequence);
+	HISTORY.current = -1;
+	glob_cache_clear();
+	if(INTERACTIVE)
+		printf("\033[0m");
+	return status;// SHELL_STATUS_CONTINUE
 }
-int cmd_between_operator_handle_pipe_pipe(char** argv){
-	MULTIPLE_PIPES_FLAG = !MULTIPLE_PIPES_FLAG;
-	pid_t child;
-	if(MULTIPLE_PIPES_FLAG){ // 
-		// CRIA PIPE 1
-    	if(pipe(GLOBAL_PIPE1) < 0)
-    		print_error("ERRO PIPE 1");
-    	print_alert("criou pipe 1");
-    }else{// PAR
-    	// CRIA PIPE 2
-    	if(pipe(GLOBAL_PIPE2) < 0)
-    		print_error("ERRO PIPE 2");
-    	print_alert("criou pipe 2");
-    }
-	child = fork();
-	if(child == 0){
-    	print_alert("Middle Command");
-		if(MULTIPLE_PIPES_FLAG){ // IMPAR
-			dup2(GLOBAL_PIPE2[READ_END], STDIN_FILENO);// LER DO PIPE 2
-			dup2(GLOBAL_PIPE1[WRITE_END], STDOUT_FILENO); // ESCREVER NO PIPE 1
-		}else{ // PAR
-			dup2(GLOBAL_PIPE1[READ_END], STDIN_FILENO);// LER DO PIPE 1
-			dup2(GLOBAL_PIPE2[WRITE_END], STDOUT_FILENO); // ESCREVER NO PIPE 2
-		}
-		if(execvp(argv[0], argv) < 0)
-			print_error("Comando possívelmente invalido ou incompleto:");
-	}else{
-		if(MULTIPLE_PIPES_FLAG){ // IMPAR
-			close_fd(GLOBAL_PIPE2[READ_END]);// JA PASSOU PARA O child
-			close_fd(GLOBAL_PIPE1[WRITE_END]); // SOMENTE child ESCREVE NO PIPE
-		}else{ 
-			close_fd(GLOBAL_PIPE1[READ_END]);// JA PASSOU PARA O child
-			close_fd(GLOBAL_PIPE2[WRITE_END]); // SOMENTE child ESCREVE NO PIPE
-		}
-		waitpid(child, NULL, 0);
-		print_alert("child do meio terminou");
+int execute_sequence(struct sequence_node* sequence){
+	struct job_node* job;
+	STAILQ_FOREACH(job, &sequence->jobs, next){
+		if(execute_job(job) == SHELL_STATUS_CLOSE || SHELL_CLOSE_REQUESTED)
+			return SHELL_STATUS_CLOSE;
 	}
 	return SHELL_STATUS_CONTINUE;
 }
-int cmd_after_operator_handle_pipe(char** argv){
-// ULTIMO COMANDO: SEMPRE ESCREVE NA SAIDA PADRÃO; PODE LER DO PIPE 1 OU DO 2
-// LE DO PIPE 1 CASO NAO HOUVER COMANDOS INTERNOS OU TIVER UM NUMERO PAR DE COMANDOS INTERNOS
-// LE DO PIPE 2 CASO HOUVER UM NUMERO IMPAR DE COMANDOS INTERNOS
-	pid_t child;
-	child = fork();
-	if(child == 0){ 
-		if(MULTIPLE_PIPES_FLAG){// IMPAR
-			dup2(GLOBAL_PIPE1[READ_END], STDIN_FILENO); // LE DO PIPE 1
-		}else{// OU LE DO 1 OU LE DO 2:
-			dup2(GLOBAL_PIPE2[READ_END], STDIN_FILENO); // LE DO PIPE 2
-		}
-		if(execvp(argv[0], argv) < 0){
-			print_error("Comando possívelmente invalido ou incompleto:");
-			return SHELL_STATUS_CONTINUE;
-		}
-	}else{ // PAI
-		if(MULTIPLE_PIPES_FLAG){// IMPAR
-			close_fd(GLOBAL_PIPE1[READ_END]); // LE DO PIPE 1
-		}else{// OU LE DO 1 OU LE DO 2:
-			close_fd(GLOBAL_PIPE2[READ_END]); // LE DO PIPE 2
-		}
-		waitpid(child, NULL, 0);
-		print_alert("Last command finished");
-	}															
-	return SHELL_STATUS_CONTINUE;
+int execute_job(struct job_node* job){
+	if(job->background)
+		return execute_standard_async_command(&job->pipeline);
+	if(job->pipeline.n_commands == 1)
+		return execute_simple_command(&job->pipeline);
+	return execute_pipeline(&job->pipeline);
 }
-int cmd_before_operator_handle_redirect_out(char** argv, char** cmd_tokens, int* index){
-	pid_t child;
-	int args_after_cmd = count_args(cmd_tokens, *index + 1);// conta numero de 'argumentos' do proximo comando
-	if( args_after_cmd != 1){ // um unico arquivo
-		print_error("Especifique um unico arquivo: <cmd> > <arquivo.txt>");
+int execute_simple_command(struct pipeline_node* pipeline){
+	struct command_node* command = STAILQ_FIRST(&pipeline->commands);
+	struct expansion saved;
+	int expanded;
+	if(is_assignment_list(command) && !pipeline->timed && pipeline->limits == NULL){
+		LAST_EXIT_STATUS = execute_assignments(command);
 		return SHELL_STATUS_CONTINUE;
 	}
-	char* file_name = cmd_tokens[*index + 1]; // Get file name
-	print_alert("File name:"); print_alert(file_name);
-	
-	child = fork();// FORK
-        if(child == 0){
-                int fd = open(file_name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-                dup2(fd, STDOUT_FILENO);   // make stdout go to file
-                close(fd);
-                if(execvp(argv[0], argv) < 0){  // EXECUTA O COMANDO
-	                print_error("Comando possivelmente invalido ou incompleto:");
-	                return SHELL_STATUS_CONTINUE;
-	        }
-        }else{ // CODIGO DO PAI
-                waitpid(child, NULL, 0);  // ESPERA child 1
-        }
-	*index += 1; // proximo comando
-	return SHELL_STATUS_CONTINUE;
-}
-int cmd_between_operator_handle_redirect_out_pipe(char** argv, char** cmd_tokens, int* index){
-        print_alert("identificado");
-        MULTIPLE_PIPES_FLAG = !MULTIPLE_PIPES_FLAG;
-	pid_t child;
-	if(MULTIPLE_PIPES_FLAG){ // 
-    	        if(pipe(GLOBAL_PIPE1) < 0)
-    		        print_error("ERRO PIPE 1");
-    	        print_alert("criou pipe 1");
-        }else{
-                if(pipe(GLOBAL_PIPE2) < 0)
-	                print_error("ERRO PIPE 2");
-                print_alert("criou pipe 2");
-        }
-	int args_after_cmd = count_args(cmd_tokens, *index + 1);// conta numero de 'argumentos' do proximo comando
-	if( args_after_cmd != 1){ // um unico arquivo
-		print_error("Especifique um unico arquivo: <cmd> > <arquivo.txt>");
+	// Comandos internos do shell: run right here, no fork and no exec.
+	// The name may come from a variable, so argv is expanded first
+	expanded = expand_command(command, &saved);
+	if(command->argc == 0){  // only empty variables: nothing to run
+		restore_command(command, &saved);
+		LAST_EXIT_STATUS = 0;
 		return SHELL_STATUS_CONTINUE;
 	}
-	char* file_name = cmd_tokens[*index + 1]; // Get file name
-	print_alert("File name:"); print_alert(file_name);
-	child = fork();
-	if(child == 0){
-    	        print_alert("Middle Command");
-		if(MULTIPLE_PIPES_FLAG){ // IMPAR
-			dup2(GLOBAL_PIPE2[READ_END], STDIN_FILENO);// LER DO PIPE 2
-		}else{ // PAR
-			dup2(GLOBAL_PIPE1[READ_END], STDIN_FILENO);// LER DO PIPE 1
-		}
-		// ESCREVER NO ARQUIVO
-		int fd = open(file_name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-		dup2(fd, STDOUT_FILENO);   
-		//
-		close(fd);
-		if(execvp(argv[0], argv) < 0)
-			print_error("Comando possívelmente invalido ou incompleto:");
-	}else{
-		if(MULTIPLE_PIPES_FLAG){ // IMPAR
-			close_fd(GLOBAL_PIPE2[READ_END]);// JA PASSOU PARA O child
-			close_fd(GLOBAL_PIPE1[WRITE_END]); // SOMENTE child ESCREVE NO PIPE
-		}else{ 
-			close_fd(GLOBAL_PIPE1[READ_END]);// JA PASSOU PARA O child
-			close_fd(GLOBAL_PIPE2[WRITE_END]); // SOMENTE child ESCREVE NO PIPE
-		}
-		waitpid(child, NULL, 0);
-		print_alert("child do meio terminou");
+	command->builtin = find_command_builtin(command->argv);
+	if(command->builtin == NULL || command->builtin->child || command->timeout_ms > 0 || pipeline->timed || pipeline->limits != NULL){  // Single Command (a deadline, 'time' or 'limit' needs a child)
+		if(expanded)
+			restore_command(command, &saved);
+		return execute_pipeline(pipeline);
 	}
-	*index += 1; // proximo comando
+	LAST_EXIT_STATUS = run_builtin_in_shell(command);
+	TRACE(TRACE_INFO, "builtin", getpid(), LAST_EXIT_STATUS, "%s", command->argv[0]);
+	if(expanded)
+		restore_command(command, &saved);
+	return SHELL_CLOSE_REQUESTED ? SHELL_STATUS_CLOSE : SHELL_STATUS_CONTINUE;
+}
+int execute_standard_async_command(struct pipeline_node* pipeline){
+	run_job(pipeline, TRUE);  // reaped by the event loop
 	return SHELL_STATUS_CONTINUE;
 }
 /*************************************** 
- * Internal Commands
+ * Redirections
  ***************************************
  ***************************************/
-int execute_internal_help(){
-	print_alert("-- Shell Internal Commands: --");
-	print_alert("	<help>: Show Internal Commands");
-	print_alert("	<close>: Close K-Shell");
-	return SHELL_STATUS_CONTINUE;
+int redirect_open_flags(enum redirect_type type){
+	switch(type){
+		case REDIRECT_INPUT: return O_RDONLY;
+		case REDIRECT_APPEND: return O_WRONLY | O_CREAT | O_APPEND;
+		default: return O_WRONLY | O_CREAT | O_TRUNC;  // no stale bytes after shorter output
+	}
 }
-int execute_internal_last(){
-	print_alert(LAST_COMMAND_LINE);
-	return SHELL_STATUS_CONTINUE;
+int apply_redirects(struct command_node* command, int* saved){
+	// The open/dup2/close version of the spawn file actions, for commands
+	// that run shell code: forked children and builtins run in the shell.
+	// With 'saved', every descriptor is copied there before it changes (-1:
+	// it was closed) so restore_redirects can put it back. Returns -1 when a
+	// redirection fails, with the ones before it undone
+	char text[32];
+	int i, fd;
+	for(i = 0; i < command->n_redirects; i++){
+		struct redirect* redirect = &command->redirects[i];
+		if(saved != NULL)
+			saved[i] = fcntl(redirect->fd, F_DUPFD_CLOEXEC, 10);  // out of the way of small fds
+		if(redirect->type == REDIRECT_CLOSE){
+			close(redirect->fd);
+			continue;
+		}
+		if(redirect->type == REDIRECT_DUP){
+			if(dup2(redirect->source_fd, redirect->fd) >= 0)
+				continue;
+			sprintf(text, "%d", redirect->source_fd);
+			printf_error("Descritor invalido: %s", text);
+		}else{
+			fd = open(redirect->file, redirect_open_flags(redirect->type) | O_CLOEXEC, 0666);
+			if(fd >= 0){
+				if(fd != redirect->fd){
+					dup2(fd, redirect->fd);  // the copy loses O_CLOEXEC
+					close(fd);
+				}else{
+					fcntl(fd, F_SETFD, 0);
+				}
+				continue;
+			}
+			printf_error("Erro ao abrir arquivo: %s", redirect->file);
+			perror("->");
+		}
+		if(saved != NULL)
+			restore_redirects(command, saved, i + 1);
+		return -1;
+	}
+	return 0;
+}
+void restore_redirects(struct command_node* command, int* saved, int n){
+	// Undoes the first 'n' redirections, last one first
+	while(n-- > 0){
+		if(saved[n] >= 0){
+			dup2(saved[n], command->redirects[n].fd);
+			close(saved[n]);
+		}else{
+			close(command->redirects[n].fd);
+		}
+	}
+}
+int format_redirect(char* out, size_t size, struct redirect* redirect){
+	// 'redirect' as it would be typed, like snprintf (out may be NULL)
+	switch(redirect->type){
+		case REDIRECT_INPUT:
+			if(redirect->fd == STDIN_FILENO)
+				return snprintf(out, size, "< %s", redirect->file);
+			return snprintf(out, size, "%d< %s", redirect->fd, redirect->file);
+		case REDIRECT_OUTPUT:
+		case REDIRECT_APPEND:
+			if(redirect->fd == STDOUT_FILENO)
+				return snprintf(out, size, "%s %s", redirect->type == REDIRECT_APPEND ? ">>" : ">", redirect->file);
+			return snprintf(out, size, "%d%s %s", redirect->fd, redirect->type == REDIRECT_APPEND ? ">>" : ">", redirect->file);
+		case REDIRECT_DUP:
+			return snprintf(out, size, "%d>&%d", redirect->fd, redirect->source_fd);
+		default:
+			return snprintf(out, size, "%d>&-", redirect->fd);
+	}
 }
 /*************************************** 
- * Funções e Procedimentos Auxiliares
+ * Word Expansion
  ***************************************
  ***************************************/
-int count_args(char** argv, int index){
-        int i = index;// Conta o numero de tokens a partir de 'index'
-	int argc = 0;
-	char* arg = argv[i];
-	while(arg != NULL & !is_operador(arg)){
-		arg = argv[++i];
-		argc++;
+int expand_command(struct command_node* command, struct expansion* saved){
+	// Replaces the $ references of argv and of the redirect files, then
+	// each pattern in argv with the paths it matches, sorted; one that
+	// matches nothing stays, unescaped. A word made only of empty unquoted
+	// references goes away (argc may end up 0). The new argv (its vector
+	// doubles as it grows) and files live until restore_command. Returns
+	// FALSE if there was nothing to expand
+	struct glob_results results = {NULL, 0, 0};
+	size_t first;
+	int i, pattern, literal;
+	char* word;
+	if(command->expand == NULL)
+		return FALSE;
+	saved->argv = command->argv;
+	saved->argc = command->argc;
+	saved->expand = command->expand;
+	saved->files = NULL;
+	for(i = 0; i < command->argc; i++){
+		first = results.count;
+		pattern = (command->expand[i] & WORD_GLOB) != 0;
+		literal = TRUE;
+		if(command->expand[i] & WORD_VARS)
+			word = expand_variables(command->argv[i], &pattern, &literal);
+		else
+			word = strdup(command->argv[i]);
+		if(*word == '\0' && !literal){
+			free(word);
+			continue;
+		}
+		if(pattern)
+			glob_expand(word, &results);
+		if(results.count == first)
+			glob_add(&results, command->expand[i] ? glob_unescape(word) : word);
+		else{
+			free(word);
+			qsort(results.paths + first, results.count - first, sizeof(char*), compare_path);
+		}
 	}
-	return argc;
+	glob_add(&results, NULL);
+	for(i = 0; i < command->n_redirects; i++){
+		if(!command->redirects[i].expand)
+			continue;
+		if(saved->files == NULL)
+			saved->files = (char**) calloc(command->n_redirects, sizeof(char*));
+		saved->files[i] = command->redirects[i].file;
+		command->redirects[i].file = glob_unescape(expand_variables(saved->files[i], &pattern, &literal));
+	}
+	command->argv = results.paths;
+	command->argc = results.count - 1;
+	command->expand = NULL;
+	TRACE(TRACE_DEBUG, "expand", getpid(), command->argc, "%s", command->argc > 0 ? command->argv[0] : "");
+	return TRUE;
 }
-int exists_operator_before(char** commands, int index){
-	if(index <= 0)
-		return FALSE;
-	char* cmd = commands[index];
-	while(cmd != NULL && index >= 0){
-		if(is_operador(cmd))
-			return TRUE;// ha operador depois
-		cmd = commands[--index];
+void restore_command(struct command_node* command, struct expansion* saved){
+	int i;
+	for(i = 0; i < command->argc; i++)
+		free(command->argv[i]);
+	free(command->argv);
+	command->argv = saved->argv;
+	command->argc = saved->argc;
+	command->expand = saved->expand;
+	for(i = 0; saved->files != NULL && i < command->n_redirects; i++){
+		if(saved->files[i] != NULL){
+			free(command->redirects[i].file);
+			command->redirects[i].file = saved->files[i];
+		}
 	}
-	return FALSE;
+	free(saved->files);
 }
-int exists_operator_after(char** commands, int index){
-	char* cmd = commands[index];
-	while(cmd != NULL){
-		if(is_operador(cmd))
-			return TRUE;// ha operador depois
-		cmd = commands[++index];
+char* expand_variables(char* text, int* pattern, int* literal){
+	// The word, in the lexer's escaped form, with its $ references
+	// replaced (malloc'd, still escaped). A quoted value and a default get
+	// their wildcards escaped, an unquoted value only its backslashes, so
+	// its wildcards still match. *pattern: an unquoted wildcard is left.
+	// *literal: something besides unquoted references is in the word
+	char number[24];
+	char* buffer = NULL, *c = text, *value, *name, *end;
+	size_t size, len;
+	int quoted, escape, braces, colon;
+	FILE* out = open_memstream(&buffer, &size);
+	*pattern = *literal = FALSE;
+	while(*c != '\0'){
+		if(*c == '\\' && c[1] != '\0'){
+			fputc(*c++, out);
+			fputc(*c++, out);
+			*literal = TRUE;
+			continue;
+		}
+		quoted = (c[0] == '"' && c[1] == '$');
+		if(*c != '$' && !quoted){
+			if(*c == '*' || *c == '?' || *c == '[')
+				*pattern = TRUE;
+			fputc(*c++, out);
+			*literal = TRUE;
+			continue;
+		}
+		c += quoted + 1;
+		*literal |= quoted;
+		escape = quoted;
+		value = NULL;
+		if(*c == '?' || *c == '$' || *c == '!'){
+			if(*c != '!' || LAST_BACKGROUND_PID > 0){
+				sprintf(number, "%d", (*c == '?') ? LAST_EXIT_STATUS : (int) ((*c == '$') ? SHELL_PID : LAST_BACKGROUND_PID));
+				value = number;
+			}
+			len = (value != NULL) ? strlen(value) : 0;
+			c++;
+		}else{
+			braces = (*c == '{');
+			len = variable_name_length(c + braces);
+			name = strndup(c + braces, len);
+			value = variable_get(name);
+			free(name);
+			c += braces + len;
+			len = (value != NULL) ? strlen(value) : 0;
+			if(braces){  // the lexer checked the form
+				end = strchr(c, '}');
+				colon = (*c == ':');
+				if(*c != '}' && (value == NULL || (colon && len == 0))){  // the default, as it was typed
+					value = c + colon + 1;
+					len = end - value;
+					escape = TRUE;
+				}
+				c = end + 1;
+			}
+		}
+		for(; len > 0; value++, len--){
+			if(*value == '\\' || (escape && (*value == '*' || *value == '?' || *value == '[')))
+				fputc('\\', out);
+			else if(*value == '*' || *value == '?' || *value == '[')
+				*pattern = TRUE;
+			fputc(*value, out);
+		}
 	}
-	return FALSE;
+	fclose(out);
+	return buffer;
 }
-void close_pipes(){
-	if(GLOBAL_PIPE1[WRITE_END] != 0)
-		close(GLOBAL_PIPE1[WRITE_END]);
-	if(GLOBAL_PIPE1[READ_END] != 0)
-		close(GLOBAL_PIPE1[READ_END]);	
-	if(GLOBAL_PIPE2[WRITE_END] != 0)
-		close(GLOBAL_PIPE2[WRITE_END]);
-	if(GLOBAL_PIPE2[READ_END] != 0)
-		close(GLOBAL_PIPE2[READ_END]);
-}
-void read_line(char* buffer){
-	int c;  // variavel auxiliar (int pois EOF = -1)
-	int pos = 0;  // indice da linha
+void glob_expand(char* pattern, struct glob_results* results){
+	// Compiles the pattern segment by segment ('/' apart; a trailing '/'
+	// matches only directories) and walks the tree from '/' or '.'
+	struct glob_segment* segments;
+	char path[PATH_MAX];
+	char* c = pattern, *slash;
+	int n_segments = 0, capacity = 8, i;
+	segments = (struct glob_segment*) malloc(sizeof(struct glob_segment)*capacity);
+	path[0] = '\0';
+	if(*c == '/'){
+		strcpy(path, "/");
+		while(*c == '/')
+			c++;
+	}
 	while(TRUE){
-		c = getchar();
-		if( c == EOF || c == '\n'){ // quebra de linha ou fim arqv
-			buffer[pos] = '\0';// indica fim da linha
-			return;  // leitura completa
+		slash = strchr(c, '/');
+		if(n_segments == capacity){
+			capacity *= 2;
+			segments = (struct glob_segment*) realloc(segments, sizeof(struct glob_segment)*capacity);
+		}
+		glob_compile(c, (slash != NULL) ? (size_t) (slash - c) : strlen(c), &segments[n_segments++]);
+		if(slash == NULL)
+			break;
+		for(c = slash; *c == '/'; c++)
+			;
+	}
+	glob_walk(path, strlen(path), segments, n_segments, 0, results);
+	for(i = 0; i < n_segments; i++){
+		free(segments[i].literal);
+		free(segments[i].elements);
+	}
+	free(segments);
+}
+int glob_compile(char* text, size_t len, struct glob_segment* segment){
+	// One segment to elements: '\x' is x, '*' (runs of them are one),
+	// '?', '[...]' with ranges and '!'/'^'. A '[' without its ']' is just
+	// a char. A segment with no wildcard keeps its name in 'literal'
+	struct glob_element* element;
+	size_t i, j;
+	int wild = FALSE, negate, k;
+	memset(segment, 0, sizeof(*segment));
+	segment->elements = (struct glob_element*) malloc(sizeof(struct glob_element)*(len + 1));
+	segment->recursive = (len == 2 && text[0] == '*' && text[1] == '*');
+	for(i = 0; i < len; i++){
+		element = &segment->elements[segment->n_elements];
+		element->op = GLOB_CHAR;
+		if(text[i] == '\\' && i + 1 < len){
+			element->c = text[++i];
+		}else if(text[i] == '*'){
+			if(segment->n_elements > 0 && element[-1].op == GLOB_STAR)
+				continue;
+			element->op = GLOB_STAR;
+		}else if(text[i] == '?'){
+			element->op = GLOB_ANY;
+		}else if(text[i] == '['){
+			j = i + 1;
+			negate = (j < len && (text[j] == '!' || text[j] == '^'));
+			j += negate;
+			memset(element->class, 0, sizeof(element->class));
+			for(k = 0; j < len && (text[j] != ']' || k == 0); k++){  // a ']' right after '[' is a char
+				unsigned char from, to;
+				if(text[j] == '\\' && j + 1 < len)
+					j++;
+				from = to = text[j++];
+				if(j + 1 < len && text[j] == '-' && text[j + 1] != ']'){
+					if(text[j + 1] == '\\' && j + 2 < len)
+						j++;
+					to = text[j + 1];
+					j += 2;
+				}
+				for(; from <= to; from++){
+					element->class[from/8] |= 1 << (from % 8);
+					if(from == 255)
+						break;
+				}
+			}
+			if(j >= len){
+				element->c = '[';
+			}else{
+				if(negate){
+					for(k = 0; k < 32; k++)
+						element->class[k] = ~element->class[k];
+				}
+				element->op = GLOB_CLASS;
+				i = j;
+			}
 		}else{
-			buffer[pos] = c;  // append no buffer de linha
+			element->c = text[i];
 		}
-		pos++;  // anda com o 'cursor'
+		if(element->op != GLOB_CHAR)
+			wild = TRUE;
+		segment->n_elements++;
+	}
+	segment->dot = (segment->n_elements > 0 && segment->elements[0].op == GLOB_CHAR && segment->elements[0].c == '.');
+	if(!wild){
+		segment->literal = (char*) malloc(segment->n_elements + 1);
+		for(k = 0; k < segment->n_elements; k++)
+			segment->literal[k] = segment->elements[k].c;
+		segment->literal[k] = '\0';
 	}
+	return wild;
 }
-void print_commands(char** matrix){
-	int i =0;
-	printf("\033[1;35m---------------\n Comandos:\n");
-	while(matrix[i] != NULL){
-		if(is_operador(matrix[i]))
-			printf("	Operador %d: (%s)\n", i, matrix[i]);
-		else if (is_command(matrix[i]))
-			printf("	Comando %d: <<%s>>\n", i, matrix[i]);
-		/*else
-			print_error("	Operador/Comando invalido");*/
-		i++;
+void glob_walk(char* path, size_t path_len, struct glob_segment* segments, int n_segments, int i, struct glob_results* results){
+	// Matches segments[i] in the directory 'path' (ending with '/', or
+	// empty for '.'), adding the paths of the last segment and going down
+	// the directories for the others. '**' matches here and in every
+	// directory below (not through symlinks, nor into hidden ones)
+	struct glob_segment* segment = &segments[i];
+	struct dir_listing* listing;
+	struct stat info;
+	int last = (i == n_segments - 1);
+	size_t j, name_len;
+	char* name;
+	if(last && segment->n_elements == 0){  // 'pattern/': path is a directory
+		glob_add(results, strdup(path));
+		return;
 	}
-	printf("---------------\033[0m\n");
+	if(segment->literal != NULL){  // no need to read the directory
+		name_len = strlen(segment->literal);
+		if(path_len + name_len + 2 > PATH_MAX)
+			return;
+		memcpy(path + path_len, segment->literal, name_len + 1);
+		if(last && lstat(path, &info) == 0)
+			glob_add(results, strdup(path));
+		else if(!last){
+			strcpy(path + path_len + name_len, "/");
+			glob_walk(path, path_len + name_len + 1, segments, n_segments, i + 1, results);
+		}
+		path[path_len] = '\0';
+		return;
+	}
+	if(segment->recursive && !last)  // '**' as no directory at all
+		glob_walk(path, path_len, segments, n_segments, i + 1, results);
+	if((listing = glob_list_dir(path)) == NULL)
+		return;
+	for(j = 0; j < listing->count; j++){
+		name = listing->names + listing->offsets[j];
+		name_len = strlen(name);
+		if(path_len + name_len + 2 > PATH_MAX)
+			continue;
+		if(segment->recursive ? name[0] == '.' : !glob_match(segment, name))
+			continue;
+		memcpy(path + path_len, name, name_len + 1);
+		if(last)
+			glob_add(results, strdup(path));
+		if(segment->recursive ? listing->types[j] == DT_DIR || (listing->types[j] == DT_UNKNOWN && lstat(path, &info) == 0 && S_ISDIR(info.st_mode))
+			: !last && glob_is_dir(path, listing->types[j])){
+			strcpy(path + path_len + name_len, "/");
+			glob_walk(path, path_len + name_len + 1, segments, n_segments, segment->recursive ? i : i + 1, results);
+		}
+	}
+	path[path_len] = '\0';
+	if(!GLOB_CACHE)
+		free_dir_listing(listing);
 }
-int is_operador_char(char c){
-	if( c  == '|' || c == '&' || c == '<' || c == '>')
+int glob_match(struct glob_segment* segment, char* name){
+	// Wildcard match with one backtrack point (the last '*'), linear for
+	// the usual patterns. '.' and '..' never match, hidden names only if
+	// the pattern starts with '.'
+	struct glob_element* elements = segment->elements;
+	int p = 0, star = -1, n = segment->n_elements;
+	char* mark = NULL;
+	unsigned char c;
+	if(name[0] == '.' && (!segment->dot || name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+		return FALSE;
+	while(*name != '\0'){
+		c = (unsigned char) *name;
+		if(p < n && (elements[p].op == GLOB_ANY || (elements[p].op == GLOB_CHAR && elements[p].c == c)
+			|| (elements[p].op == GLOB_CLASS && (elements[p].class[c/8] & (1 << (c % 8)))))){
+			p++;
+			name++;
+		}else if(p < n && elements[p].op == GLOB_STAR){
+			star = p++;
+			mark = name;
+		}else if(star >= 0){
+			p = star + 1;
+			name = ++mark;
+		}else{
+			return FALSE;
+		}
+	}
+	while(p < n && elements[p].op == GLOB_STAR)
+		p++;
+	return p == n;
+}
+int glob_is_dir(char* path, unsigned char type){
+	// d_type when it says, else stat (symlinks to directories count)
+	struct stat info;
+	if(type == DT_DIR)
 		return TRUE;
-	return FALSE;
+	if(type != DT_LNK && type != DT_UNKNOWN)
+		return FALSE;
+	return stat(path, &info) == 0 && S_ISDIR(info.st_mode);
 }
-void close_fd(int fd){
-	if(fd != 0 && fd != 1)
-		close(fd);
+struct dir_listing* glob_list_dir(char* path){
+	// The names in 'path' ('' is '.'), read with getdents64 in big batches.
+	// Kept in the per line cache unless glob-cache is off (the caller
+	// frees it then). NULL if it can't be read
+	struct dir_listing* listing, **bucket = &GLOB_CACHE_TABLE[hash_string(path) & (GLOB_CACHE_BUCKETS - 1)];
+	size_t names_size = 0, names_capacity = 4096, capacity = 64, len;
+	ssize_t n, k;
+	int fd;
+	if(GLOB_CACHE){
+		for(listing = *bucket; listing != NULL; listing = listing->next){
+			if(strcmp(listing->path, path) == 0)
+				return listing;
+		}
+	}
+	if((fd = open(*path != '\0' ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return NULL;
+	if(GLOB_DENTS == NULL)
+		GLOB_DENTS = (char*) malloc(GLOB_DENTS_SIZE);
+	listing = (struct dir_listing*) calloc(1, sizeof(struct dir_listing));
+	listing->path = strdup(path);
+	listing->names = (char*) malloc(names_capacity);
+	listing->offsets = (size_t*) malloc(sizeof(size_t)*capacity);
+	listing->types = (unsigned char*) malloc(capacity);
+	while((n = getdents64(fd, GLOB_DENTS, GLOB_DENTS_SIZE)) > 0){
+		for(k = 0; k < n; k += ((struct dirent64*) (GLOB_DENTS + k))->d_reclen){
+			struct dirent64* entry = (struct dirent64*) (GLOB_DENTS + k);
+			len = strlen(entry->d_name) + 1;
+			if(listing->count == capacity){
+				capacity *= 2;
+				listing->offsets = (size_t*) realloc(listing->offsets, sizeof(size_t)*capacity);
+				listing->types = (unsigned char*) realloc(listing->types, capacity);
+			}
+			while(names_size + len > names_capacity){
+				names_capacity *= 2;
+				listing->names = (char*) realloc(listing->names, names_capacity);
+			}
+			memcpy(listing->names + names_size, entry->d_name, len);
+			listing->offsets[listing->count] = names_size;
+			listing->types[listing->count++] = entry->d_type;
+			names_size += len;
+		}
+	}
+	close(fd);
+	TRACE(TRACE_DEBUG, "glob_list", getpid(), (long) listing->count, "%s", *path != '\0' ? path : ".");
+	if(GLOB_CACHE){
+		listing->next = *bucket;
+		*bucket = listing;
+	}
+	return listing;
 }
-int is_operador(char* c){
-	if(c == NULL)  // importante
-		return FALSE;
-	int i = 0;
-	int cursor = c[i];
-	while(cursor != '\0' && cursor != EOF)
-		cursor = c[++i];
-	if(i != 1)  // operador de tamanho > 1
-		return FALSE;
-	// Verifica no primeiro(e unico) char
-	return is_operador_char(c[0]);
+void free_dir_listing(struct dir_listing* listing){
+	free(listing->path);
+	free(listing->names);
+	free(listing->offsets);
+	free(listing->types);
+	free(listing);
 }
-int is_operator(char* c, char operator){
-	if(c == NULL)  // important
-		return FALSE;
-	int i = 0;
-	int cursor = c[i];
-	while(cursor != '\0' && cursor != EOF)
-		cursor = c[++i];
-	if(i != 1)  // operador de tamanho > 1
-		return FALSE;
-	// Verifica no primeiro(e unico) char
-	return (c[0] == operator);
+void glob_cache_clear(){
+	struct dir_listing* listing;
+	int i;
+	for(i = 0; i < GLOB_CACHE_BUCKETS; i++){
+		while((listing = GLOB_CACHE_TABLE[i]) != NULL){
+			GLOB_CACHE_TABLE[i] = listing->next;
+			free_dir_listing(listing);
+		}
+	}
 }
-int is_command(char* c){
-	if(c == NULL)
-		return FALSE;
-	// verifica se tem um operador dentro do comando
-	int i = 0;
-	int cursor = c[i];
-	while(cursor != '\0' && cursor != EOF){
-		if(is_operador_char(cursor))
-			return FALSE;
-		cursor = c[++i];
-	} 
-	return TRUE;
+void glob_add(struct glob_results* results, char* path){
+	if(results->count == results->capacity){
+		results->capacity = (results->capacity == 0) ? 16 : results->capacity*2;
+		results->paths = (char**) realloc(results->paths, sizeof(char*)*results->capacity);
+	}
+	results->paths[results->count++] = path;
 }
-void print_error(char* c){
-	printf("\033[1;31mErro: %s\033[0m\n", c);
+char* glob_unescape(char* text){
+	// Drops the backslashes the lexer put in a pattern, in place
+	char* in = text, *out = text;
+	for(; *in != '\0'; in++){
+		if(*in == '\\' && in[1] != '\0')
+			in++;
+		*out++ = *in;
+	}
+	*out = '\0';
+	return text;
+}
+int compare_path(const void* a, const void* b){
+	return strcmp(*(char* const*) a, *(char* const*) b);
+}
+/*************************************** 
+ * Variables
+ ***************************************
+ ***************************************/
+void init_variables(){
+	// Takes over the environment: every variable in it is an exported
+	// shell variable, and from now on 'environ' is VARIABLES.envp, kept up
+	// to date by each change instead of being built for every command
+	char* name, *equals;
+	int i;
+	char** initial = environ;
+	SHELL_PID = getpid();
+	VARIABLES.env_capacity = ENVIRONMENT_INITIAL_CAPACITY;
+	VARIABLES.envp = (char**) calloc(VARIABLES.env_capacity, sizeof(char*));
+	environ = VARIABLES.envp;
+	for(i = 0; initial != NULL && initial[i] != NULL; i++){
+		if((equals = strchr(initial[i], '=')) == NULL)
+			continue;
+		name = strndup(initial[i], equals - initial[i]);
+		if(variable_name_length(name) == strlen(name))
+			variable_set(name, equals + 1, TRUE);
+		free(name);
+	}
+}
+struct variable* variable_slot(char* name){
+	// Slot holding 'name', or the empty slot where it would go
+	size_t i;
+	if(VARIABLES.slots == NULL){
+		VARIABLES.capacity = VARIABLES_INITIAL_CAPACITY;
+		VARIABLES.slots = (struct variable*) calloc(VARIABLES.capacity, sizeof(struct variable));
+	}
+	i = hash_string(name) & (VARIABLES.capacity - 1);
+	while(VARIABLES.slots[i].name != NULL && strcmp(VARIABLES.slots[i].name, name) != 0)
+		i = (i + 1) & (VARIABLES.capacity - 1);
+	return &VARIABLES.slots[i];
+}
+void variables_grow(){
+	// Keeps the load factor under 70%. Unset names that are not exported
+	// keep their slot until here (no tombstones): they are dropped, and the
+	// table doubles only if what is left needs it
+	struct variable* old = VARIABLES.slots;
+	size_t old_capacity = VARIABLES.capacity, i;
+	if(old == NULL || VARIABLES.count*10 < VARIABLES.capacity*7)
+		return;
+	VARIABLES.count = 0;
+	for(i = 0; i < old_capacity; i++){
+		if(old[i].name != NULL && old[i].value == NULL && !old[i].exported){
+			free(old[i].name);
+			old[i].name = NULL;
+		}else if(old[i].name != NULL)
+			VARIABLES.count++;
+	}
+	if(VARIABLES.count*2 >= old_capacity)
+		VARIABLES.capacity *= 2;
+	VARIABLES.slots = (struct variable*) calloc(VARIABLES.capacity, sizeof(struct variable));
+	for(i = 0; i < old_capacity; i++){
+		if(old[i].name != NULL)
+			*variable_slot(old[i].name) = old[i];
+	}
+	free(old);
+}
+char* variable_get(char* name){
+	struct variable* variable = variable_slot(name);
+	return variable->value;  // NULL for an empty slot too
+}
+void variable_set(char* name, char* value, int export){
+	// Sets a variable (value NULL: keeps the one it has) and, with
+	// 'export', exports it; an exported one changes in envp right away
+	struct variable* variable;
+	char* copy = (value != NULL) ? strdup(value) : NULL;  // value may be the old one
+	variables_grow();
+	variable = variable_slot(name);
+	if(variable->name == NULL){
+		variable->name = strdup(name);
+		variable->env_index = -1;
+		VARIABLES.count++;
+	}
+	if(copy != NULL){
+		free(variable->value);
+		variable->value = copy;
+	}
+	variable->exported |= export;
+	variable_sync_env(variable);
+}
+void variable_unset(char* name){
+	struct variable* variable = variable_slot(name);
+	if(variable->name == NULL)
+		return;
+	free(variable->value);
+	variable->value = NULL;
+	variable->exported = FALSE;
+	variable_sync_env(variable);
+}
+void variable_sync_env(struct variable* variable){
+	// Puts "name=value" in envp, where the old one was, or takes it out by
+	// moving the last entry into its place: O(1) either way
+	struct variable* moved;
+	char* entry, *equals;
+	int i = variable->env_index;
+	if(variable->exported && variable->value != NULL){
+		entry = (char*) malloc(strlen(variable->name) + strlen(variable->value) + 2);
+		sprintf(entry, "%s=%s", variable->name, variable->value);
+		if(i < 0){
+			if(VARIABLES.n_env + 1 >= VARIABLES.env_capacity){
+				VARIABLES.env_capacity *= 2;
+				VARIABLES.envp = (char**) realloc(VARIABLES.envp, sizeof(char*)*VARIABLES.env_capacity);
+				environ = VARIABLES.envp;
+			}
+			i = variable->env_index = VARIABLES.n_env++;
+			VARIABLES.envp[VARIABLES.n_env] = NULL;
+		}else
+			free(VARIABLES.envp[i]);
+		VARIABLES.envp[i] = entry;
+		return;
+	}
+	if(i < 0)
+		return;
+	free(VARIABLES.envp[i]);
+	variable->env_index = -1;
+	entry = VARIABLES.envp[--VARIABLES.n_env];
+	VARIABLES.envp[VARIABLES.n_env] = NULL;
+	if(i == VARIABLES.n_env)
+		return;
+	VARIABLES.envp[i] = entry;
+	equals = strchr(entry, '=');
+	*equals = '\0';
+	moved = variable_slot(entry);
+	*equals = '=';
+	moved->env_index = i;
+}
+size_t variable_name_length(char* text){
+	// Length of the name at the start of text: [A-Za-z_][A-Za-z0-9_]*
+	size_t i = 0;
+	while((text[i] >= 'a' && text[i] <= 'z') || (text[i] >= 'A' && text[i] <= 'Z') || text[i] == '_' || (i > 0 && text[i] >= '0' && text[i] <= '9'))
+		i++;
+	return i;
+}
+int is_assignment_list(struct command_node* command){
+	// Every word is NAME=value (and there is nothing else to do)
+	int i;
+	if(command->n_redirects > 0 || command->timeout_ms > 0)
+		return FALSE;
+	for(i = 0; i < command->argc; i++){
+		size_t n = variable_name_length(command->argv[i]);
+		if(n == 0 || command->argv[i][n] != '=')
+			return FALSE;
+	}
+	return command->argc > 0;
+}
+int execute_assignments(struct command_node* command){
+	// Shell variables, exported only if they already were. The value is
+	// expanded but never split nor taken as a pattern
+	char* name, *value;
+	size_t n;
+	int i, pattern, literal;
+	for(i = 0; i < command->argc; i++){
+		n = variable_name_length(command->argv[i]);
+		if(command->expand != NULL && command->expand[i] & WORD_VARS)
+			value = expand_variables(command->argv[i] + n + 1, &pattern, &literal);
+		else
+			value = strdup(command->argv[i] + n + 1);
+		if(command->expand != NULL && command->expand[i])
+			glob_unescape(value);
+		name = strndup(command->argv[i], n);
+		variable_set(name, value, FALSE);
+		free(name);
+		free(value);
+	}
+	return 0;
+}
+/*************************************** 
+ * Pipeline Execution
+ ***************************************
+ ***************************************/
+int execute_pipeline(struct pipeline_node* pipeline){
+	run_job(pipeline, FALSE);
+	return SHELL_STATUS_CONTINUE;
+}
+void fold_leading_cat(struct pipeline_node* pipeline){
+	// 'cat file | cmd' becomes 'cmd < file': the next stage reads the file
+	// itself, one process and one pipe less. Only for a regular file, so
+	// nothing changes when cat would have failed
+	struct command_node* cat = STAILQ_FIRST(&pipeline->commands);
+	struct command_node* next = STAILQ_NEXT(cat, next);
+	struct redirect* redirects;
+	struct builtin* builtin;
+	struct stat info;
+	if(next == NULL || cat->argc != 2 || cat->n_redirects > 0 || cat->timeout_ms > 0 || cat->expand != NULL || cat->argv[1][0] == '-')
+		return;
+	builtin = find_command_builtin(cat->argv);
+	if(builtin == NULL || builtin->run != execute_internal_cat || stat(cat->argv[1], &info) < 0 || !S_ISREG(info.st_mode) || access(cat->argv[1], R_OK) < 0)
+		return;
+	redirects = (struct redirect*) arena_alloc(&LINE_ARENA, sizeof(struct redirect)*(next->n_redirects + 2));
+	redirects[0] = (struct redirect){REDIRECT_INPUT, STDIN_FILENO, -1, cat->argv[1], FALSE};  // before its own '<', which wins
+	memcpy(redirects + 1, next->redirects, sizeof(struct redirect)*next->n_redirects);
+	next->redirects = redirects;
+	next->n_redirects++;
+	STAILQ_REMOVE_HEAD(&pipeline->commands, next);
+	pipeline->n_commands--;
+	TRACE(TRACE_DEBUG, "fold", 0, 0, "cat %s", cat->argv[1]);
+}
+void fuse_filters(struct pipeline_node* pipeline){
+	// Each run of stages 'filters' does exactly like the external grep,
+	// head, wc and cut becomes one 'filters' stage: one process and no
+	// exec, the lines go from stage to stage without pipes. Not the first
+	// stage: the others read a pipe, and that's what 'filters' matches
+	// (wc pads its counts differently for a regular file)
+	struct command_node* command, *first = NULL, *next, *stage_command;
+	struct filter_stage stage;
+	char** argv;
+	int n_run = 0, argc = 0, fused, i, j, k;
+	if(!FUSE_FILTERS || find_builtin("filters") == NULL)
+		return;
+	for(command = STAILQ_NEXT(STAILQ_FIRST(&pipeline->commands), next); command != NULL; command = next){
+		next = STAILQ_NEXT(command, next);
+		fused = command->n_redirects == 0 && command->timeout_ms == 0 && command->expand == NULL && filter_compile(command->argv, command->argc, &stage);
+		if(fused){
+			if(n_run++ == 0)
+				first = command;
+			argc += command->argc + 1;  // and a '|' or 'filters'
+		}
+		if(n_run > 0 && (!fused || next == NULL)){
+			argv = (char**) arena_alloc(&LINE_ARENA, sizeof(char*)*(argc + 1));
+			argv[0] = "filters";
+			stage_command = first;
+			for(i = 1, k = 0; k < n_run; k++){
+				if(k > 0){
+					argv[i++] = "|";
+					stage_command = STAILQ_NEXT(first, next);
+					STAILQ_REMOVE(&pipeline->commands, stage_command, command_node, next);
+					pipeline->n_commands--;
+				}
+				for(j = 0; j < stage_command->argc; j++)
+					argv[i++] = stage_command->argv[j];
+			}
+			argv[argc] = NULL;
+			first->argv = argv;
+			first->argc = argc;
+			TRACE(TRACE_DEBUG, "fuse", 0, argc, "%s", argv[1]);
+			n_run = argc = 0;
+		}
+	}
+}
+int pipeline_pipe_size(struct pipeline_node* pipeline){
+	return (pipeline->pipe_size > 0) ? pipeline->pipe_size : PIPE_SIZE;
+}
+void pin_stage(struct job_process* process, int stage){
+	// Moves a stage to its CPU right after it starts (posix_spawn has no
+	// affinity attribute; it may run elsewhere for its first instants)
+	cpu_set_t set;
+	if(PIPELINE_AFFINITY == AFFINITY_OFF || N_CPU_ORDER == 0)
+		return;
+	CPU_ZERO(&set);
+	CPU_SET(CPU_ORDER[stage % N_CPU_ORDER].cpu, &set);
+	if(sched_setaffinity(process->pid, sizeof(set), &set) == 0)
+		process->cpu = CPU_ORDER[stage % N_CPU_ORDER].cpu;
+	else
+		TRACE(TRACE_ERROR, "affinity", process->pid, errno, "cpu=%d", CPU_ORDER[stage % N_CPU_ORDER].cpu);
+}
+void affinity_changed(){
+	// Orders the CPUs the shell may use for pipeline-affinity.
+	// compact: same package, same last level cache, one thread per core
+	// before the siblings, so stage i and i+1 share a cache.
+	// spread: one stage per cache (and package) before doubling up
+	cpu_set_t allowed;
+	int cpu, i, j;
+	N_CPU_ORDER = 0;
+	if(PIPELINE_AFFINITY == AFFINITY_OFF || sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+		return;
+	for(cpu = 0; cpu < MAX_CPUS; cpu++){
+		struct cpu_place* place = &CPU_ORDER[N_CPU_ORDER];
+		if(!CPU_ISSET(cpu, &allowed))
+			continue;
+		place->cpu = cpu;
+		place->package = read_sysfs_int(cpu, "topology/physical_package_id", 0);
+		place->core = read_sysfs_int(cpu, "topology/core_id", cpu);
+		place->cache = read_sysfs_int(cpu, "cache/index3/id", read_sysfs_int(cpu, "cache/index2/id", 0));
+		place->thread = 0;
+		for(i = 0; i < N_CPU_ORDER; i++){
+			if(CPU_ORDER[i].package == place->package && CPU_ORDER[i].core == place->core)
+				place->thread++;
+		}
+		N_CPU_ORDER++;
+	}
+	qsort(CPU_ORDER, N_CPU_ORDER, sizeof(struct cpu_place), compare_cpu_compact);
+	for(i = 0, j = 0; i < N_CPU_ORDER; i++){
+		if(i > 0 && (CPU_ORDER[i].package != CPU_ORDER[i-1].package || CPU_ORDER[i].cache != CPU_ORDER[i-1].cache))
+			j = 0;  // first CPU of the next cache
+		CPU_ORDER[i].rank = j++;
+	}
+	if(PIPELINE_AFFINITY == AFFINITY_SPREAD)
+		qsort(CPU_ORDER, N_CPU_ORDER, sizeof(struct cpu_place), compare_cpu_spread);
+	TRACE(TRACE_INFO, "affinity", 0, N_CPU_ORDER, "%s", AFFINITY_CHOICES[PIPELINE_AFFINITY]);
+}
+int compare_cpu_compact(const void* a, const void* b){
+	const struct cpu_place* x = (const struct cpu_place*) a;
+	const struct cpu_place* y = (const struct cpu_place*) b;
+	if(x->package != y->package)
+		return x->package - y->package;
+	if(x->cache != y->cache)
+		return x->cache - y->cache;
+	if(x->thread != y->thread)
+		return x->thread - y->thread;
+	if(x->core != y->core)
+		return x->core - y->core;
+	return x->cpu - y->cpu;
+}
+int compare_cpu_spread(const void* a, const void* b){
+	const struct cpu_place* x = (const struct cpu_place*) a;
+	const struct cpu_place* y = (const struct cpu_place*) b;
+	if(x->rank != y->rank)
+		return x->rank - y->rank;
+	if(x->cache != y->cache)
+		return x->cache - y->cache;
+	if(x->package != y->package)
+		return x->package - y->package;
+	return x->cpu - y->cpu;
+}
+int read_sysfs_int(int cpu, char* file, int fallback){
+	// /sys/devices/system/cpu/cpuN/<file>, or 'fallback' if it is missing
+	char path[128];
+	int value;
+	FILE* f;
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/%s", cpu, file);
+	if((f = fopen(path, "re")) == NULL)
+		return fallback;
+	if(fscanf(f, "%d", &value) != 1)
+		value = fallback;
+	fclose(f);
+	return value;
+}
+int start_pipeline(struct pipeline_node* pipeline, struct job* job){
+	// Starts every stage before waiting for any of them, so data streams
+	// through the N-1 pipes instead of piling up in one pipe buffer.
+	// Each pipe is created right before the stage that writes to it and the
+	// shell closes its copies as soon as they are handed to the children, so
+	// a stage sees EOF/SIGPIPE as soon as its real peer is gone.
+	// The stages go into the job's process group and their pids into
+	// job->processes. Returns how many stages were started.
+	struct command_node* command;
+	struct launch_spec spec;
+	struct expansion saved;
+	int fds[2];
+	int started = 0, expanded;
+	int pipe_size = pipeline_pipe_size(pipeline);
+	spec.in_fd = job->in_fd;  // read end for the current stage
+	spec.status_fd = -1;
+	spec.pgid = JOB_CONTROL ? job->pgid : -1;  // 0: the first stage leads a new group
+	spec.foreground = !job->background && job->pgid == 0;  // a group that is joined has the terminal already
+	job_limits_setup(job, pipeline);
+	spec.limits = job->limited ? &job->limits : NULL;
+	spec.cgroup_fd = job->cgroup_fd;
+	STAILQ_FOREACH(command, &pipeline->commands, next){
+		int last = (STAILQ_NEXT(command, next) == NULL);
+		fds[READ_END] = -1;
+		fds[WRITE_END] = job->out_fd;
+		if(!last && pipe(fds) < 0){
+			print_error("Erro ao criar pipe");
+			perror("->");
+			if(spec.in_fd != STDIN_FILENO)
+				close(spec.in_fd);  // the previous stage's read end (or job->in_fd), no one takes it now
+			break;
+		}
+		if(!last){
+			if(pipe_size > 0 && fcntl(fds[WRITE_END], F_SETPIPE_SZ, pipe_size) < 0)  // over pipe-max-size without CAP_SYS_RESOURCE
+				TRACE(TRACE_ERROR, "pipe_size", getpid(), errno, "%d", pipe_size);
+			job->pipe_size = fcntl(fds[WRITE_END], F_GETPIPE_SZ);
+			TRACE(TRACE_DEBUG, "pipe", getpid(), fds[READ_END], "write_fd=%d size=%d", fds[WRITE_END], job->pipe_size);
+		}
+		// the read end belongs to the next stage; a stage that fails to
+		// start is skipped and its neighbours just see EOF/SIGPIPE
+		spec.out_fd = fds[WRITE_END];
+		spec.unused_fd = fds[READ_END];
+		clock_gettime(CLOCK_MONOTONIC, &job->processes[started].started);
+		expanded = expand_command(command, &saved);
+		snprintf(job->processes[started].name, sizeof(job->processes[started].name), "%s", command->argc > 0 ? command->argv[0] : "");
+		command->pid = (command->argc > 0) ? launch_command(command, &spec) : -1;  // only empty variables: skipped like a failed start
+		if(expanded)
+			restore_command(command, &saved);
+		job->processes[started].pid = command->pid;
+		if(command->pid > 0){
+			job->processes[started].state = PROCESS_RUNNING;
+			pin_stage(&job->processes[started], started);
+			event_loop_watch_process(&job->processes[started], command->timeout_ms);
+			if(job->pgid == 0){
+				job->pgid = command->pid;
+				if(JOB_CONTROL){
+					setpgid(command->pid, command->pid);  // the child may not have done it yet
+					spec.pgid = command->pid;
+					if(spec.foreground)
+						tcsetpgrp(SHELL_TERMINAL, job->pgid);
+				}
+			}
+		}else{
+			job->processes[started].state = PROCESS_DONE;
+			job->processes[started].status = 127 << 8;  // exit status 127
+			job->processes[started].finished = job->processes[started].started;
+		}
+		if(spec.in_fd != STDIN_FILENO)
+			close(spec.in_fd);  // handed to this stage
+		if(!last)
+			close(fds[WRITE_END]);  // handed to this stage
+		spec.in_fd = fds[READ_END];
+		started++;
+	}
+	job->n_processes = started;
+	return started;
+}
+/*************************************** 
+ * Job Control
+ ***************************************
+ ***************************************/
+void init_job_control(){
+	// Every child is reaped by the event loop as soon as it changes state,
+	// so no job can be left behind as a zombie. In an interactive shell
+	// each job also gets its own process group and the foreground job owns
+	// the terminal, which is what makes Ctrl-Z, 'fg' and 'bg' work
+	init_event_loop();
+	JOB_CONTROL = INTERACTIVE;
+	if(!JOB_CONTROL)
+		return;
+	signal(SIGINT, SIG_IGN);  // they are meant for the foreground job
+	signal(SIGQUIT, SIG_IGN);
+	signal(SIGTSTP, SIG_IGN);
+	signal(SIGTTIN, SIG_IGN);
+	signal(SIGTTOU, SIG_IGN);
+	setpgid(0, 0);
+	SHELL_PGID = getpgrp();
+	tcsetpgrp(SHELL_TERMINAL, SHELL_PGID);
+}
+void job_process_changed(pid_t pid, int status, struct rusage* usage){
+	struct job* job;
+	struct job_process* process = find_job_process(pid, &job);
+	if(process == NULL){
+		zygote_forget(pid);
+		return;
+	}
+	if(WIFSTOPPED(status)){
+		process->state = PROCESS_STOPPED;
+		TRACE(TRACE_INFO, "stop", pid, WSTOPSIG(status), "%s", process->name);
+	}else if(WIFCONTINUED(status)){
+		process->state = PROCESS_RUNNING;
+		TRACE(TRACE_INFO, "continue", pid, 0, "%s", process->name);
+	}else{
+		TRACE(TRACE_INFO, "exit", pid, WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status), "%s", process->name);
+		process->state = PROCESS_DONE;
+		process->status = status;
+		process->usage = *usage;
+		clock_gettime(CLOCK_MONOTONIC, &process->finished);
+		event_loop_forget_process(process);
+	}
+	job_update_state(job);
+}
+struct job_process* find_job_process(pid_t pid, struct job** owner){
+	struct job* job;
+	int i;
+	TAILQ_FOREACH(job, &JOBS, next){
+		for(i = 0; i < job->n_processes; i++){
+			if(job->processes[i].pid == pid){
+				*owner = job;
+				return &job->processes[i];
+			}
+		}
+	}
+	return NULL;
+}
+void job_update_state(struct job* job){
+	// Running while any process runs; stopped when the rest are stopped
+	int i, running = 0, stopped = 0;
+	for(i = 0; i < job->n_processes; i++){
+		if(job->processes[i].state == PROCESS_RUNNING)
+			running++;
+		else if(job->processes[i].state == PROCESS_STOPPED)
+			stopped++;
+	}
+	if(running > 0)
+		job->state = JOB_RUNNING;
+	else if(stopped > 0)
+		job->state = JOB_STOPPED;
+	else
+		job->state = JOB_DONE;
+}
+int run_job(struct pipeline_node* pipeline, int background){
+	// Registers the pipeline as a job and starts it, or queues it when
+	// 'max-jobs' background jobs are already running. Foreground jobs are
+	// waited for
+	struct job* job;
+	char* text = pipeline_text(pipeline);  // what was typed, not the rewrite below
+	int status = 0;
+	fold_leading_cat(pipeline);
+	fuse_filters(pipeline);
+	job = job_create(pipeline, background);
+	free(job->text);
+	job->text = text;
+	if(background && MAX_JOBS > 0 && count_running_jobs() >= MAX_JOBS){
+		job->pipeline = clone_pipeline(pipeline);
+		job->state = JOB_QUEUED;
+		if(INTERACTIVE)
+			printf("[%d] queued\n", job->id);
+		TRACE(TRACE_INFO, "queue", 0, job->id, "%s", job->text);
+	}else{
+		start_pipeline(pipeline, job);
+		job_update_state(job);
+		TRACE(TRACE_INFO, background ? "background" : "job", job->pgid, job->id, "%s", job->text);
+		if(!background)
+			status = wait_for_job(job);
+		else{
+			if(job->n_processes > 0)
+				LAST_BACKGROUND_PID = job->processes[job->n_processes - 1].pid;
+			if(INTERACTIVE)
+				printf("[%d] %d\n", job->id, job->pgid);
+		}
+	}
+	return status;
+}
+struct job* job_create(struct pipeline_node* pipeline, int background){
+	// Adds a job to the table
+	struct job* job = (struct job*) calloc(1, sizeof(struct job));
+	struct job* last = TAILQ_LAST(&JOBS, job_table);
+	int i;
+	job->id = (last == NULL) ? 1 : last->id + 1;
+	job->background = background;
+	job->timed = pipeline->timed;
+	job->text = pipeline_text(pipeline);
+	job->processes = (struct job_process*) calloc(pipeline->n_commands, sizeof(struct job_process));
+	for(i = 0; i < pipeline->n_commands; i++){
+		job->processes[i].pidfd = -1;
+		job->processes[i].timer_fd = -1;
+		job->processes[i].cpu = -1;
+	}
+	job->in_fd = STDIN_FILENO;
+	job->out_fd = STDOUT_FILENO;
+	job->cgroup_fd = -1;
+	TAILQ_INSERT_TAIL(&JOBS, job, next);
+	return job;
+}
+void job_remove(struct job* job){
+	TAILQ_REMOVE(&JOBS, job, next);
+	job_limits_release(job);
+	free_pipeline_copy(job->pipeline);
+	free(job->processes);
+	free(job->text);
+	free(job);
+}
+int wait_for_job(struct job* job){
+	// Runs the event loop until the job finishes or stops, then hands the
+	// terminal back to the shell. Returns the job's status
+	int status;
+	TRACE(TRACE_DEBUG, "wait", job->pgid, job->id, "%s", job->text);
+	while(job->state == JOB_RUNNING)
+		event_loop_run(FALSE);
+	if(JOB_CONTROL)
+		tcsetpgrp(SHELL_TERMINAL, SHELL_PGID);
+	if(job->state == JOB_STOPPED){
+		job->background = TRUE;
+		job->notified = TRUE;
+		printf("\n[%d]+ Stopped\t%s\n", job->id, job->text);
+		LAST_EXIT_STATUS = 128 + SIGTSTP;
+		return LAST_EXIT_STATUS;
+	}
+	status = job_exit_status(job);
+	TRACE(TRACE_INFO, "done", job->pgid, status, "%s", job->text);
+	job_record_stats(job);
+	job_remove(job);
+	LAST_EXIT_STATUS = status;
+	return status;
+}
+int job_exit_status(struct job* job){
+	// Status of the last process of the pipeline, like $? in sh;
+	// 124 when its 'timeout' killed it, like coreutils
+	int status;
+	if(job->n_processes == 0)
+		return 127;
+	if(job->processes[job->n_processes - 1].timed_out)
+		return 124;
+	status = job->processes[job->n_processes - 1].status;
+	return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+void job_record_stats(struct job* job){
+	// Puts the job's resource usage in KSH_LAST_STATS, as
+	// 'total:wall=..,user=..,sys=..,maxrss=..,nvcsw=..,nivcsw=..,pipe=..;1:...,cpu=..;2:...'
+	// (seconds, KB, pipe capacity in bytes, pinned CPU or -1), and prints it
+	// as a table on stderr if it was timed.
+	// The total wall time runs from the first start to the last exit
+	struct timespec first, last;
+	struct rusage total;
+	char* stats = (char*) malloc((job->n_processes + 1)*192);
+	size_t len;
+	int i;
+	if(job->n_processes == 0){
+		free(stats);
+		return;
+	}
+	memset(&total, 0, sizeof(total));
+	first = job->processes[0].started;
+	last = job->processes[0].finished;
+	for(i = 0; i < job->n_processes; i++){
+		struct job_process* process = &job->processes[i];
+		if(elapsed_seconds(&process->started, &first) > 0)
+			first = process->started;
+		if(elapsed_seconds(&last, &process->finished) > 0)
+			last = process->finished;
+		timeradd(&total.ru_utime, &process->usage.ru_utime, &total.ru_utime);
+		timeradd(&total.ru_stime, &process->usage.ru_stime, &total.ru_stime);
+		if(process->usage.ru_maxrss > total.ru_maxrss)
+			total.ru_maxrss = process->usage.ru_maxrss;
+		total.ru_nvcsw += process->usage.ru_nvcsw;
+		total.ru_nivcsw += process->usage.ru_nivcsw;
+	}
+	len = sprintf(stats, "total:wall=%.6f,user=%ld.%06ld,sys=%ld.%06ld,maxrss=%ld,nvcsw=%ld,nivcsw=%ld,pipe=%d",
+		elapsed_seconds(&first, &last), (long) total.ru_utime.tv_sec, (long) total.ru_utime.tv_usec,
+		(long) total.ru_stime.tv_sec, (long) total.ru_stime.tv_usec, total.ru_maxrss, total.ru_nvcsw, total.ru_nivcsw, job->pipe_size);
+	for(i = 0; i < job->n_processes; i++){
+		struct job_process* process = &job->processes[i];
+		len += sprintf(stats + len, ";%d:wall=%.6f,user=%ld.%06ld,sys=%ld.%06ld,maxrss=%ld,nvcsw=%ld,nivcsw=%ld,cpu=%d", i + 1,
+			elapsed_seconds(&process->started, &process->finished),
+			(long) process->usage.ru_utime.tv_sec, (long) process->usage.ru_utime.tv_usec,
+			(long) process->usage.ru_stime.tv_sec, (long) process->usage.ru_stime.tv_usec,
+			process->usage.ru_maxrss, process->usage.ru_nvcsw, process->usage.ru_nivcsw, process->cpu);
+	}
+	if(!job->background)
+		variable_set("KSH_LAST_STATS", stats, FALSE);  // $KSH_LAST_STATS; children get it only if exported
+	free(stats);
+	if(!job->timed)
+		return;
+	fflush(stdout);
+	fprintf(stderr, "%-6s %10s %10s %10s %10s %7s %7s %4s  %s\n", "stage", "real", "user", "sys", "maxrss", "vcsw", "ivcsw", "cpu", "command");
+	for(i = 0; i < job->n_processes; i++){
+		struct job_process* process = &job->processes[i];
+		char cpu[16] = "-";
+		if(process->cpu >= 0)
+			sprintf(cpu, "%d", process->cpu);
+		fprintf(stderr, "%-6d %9.3fs %9.3fs %9.3fs %8ldKB %7ld %7ld %4s  %s\n", i + 1,
+			elapsed_seconds(&process->started, &process->finished),
+			process->usage.ru_utime.tv_sec + process->usage.ru_utime.tv_usec/1e6,
+			process->usage.ru_stime.tv_sec + process->usage.ru_stime.tv_usec/1e6,
+			process->usage.ru_maxrss, process->usage.ru_nvcsw, process->usage.ru_nivcsw, cpu, process->name);
+	}
+	fprintf(stderr, "%-6s %9.3fs %9.3fs %9.3fs %8ldKB %7ld %7ld %4s  %s\n", "total",
+		elapsed_seconds(&first, &last),
+		total.ru_utime.tv_sec + total.ru_utime.tv_usec/1e6,
+		total.ru_stime.tv_sec + total.ru_stime.tv_usec/1e6,
+		total.ru_maxrss, total.ru_nvcsw, total.ru_nivcsw, "", job->text);
+	if(job->pipe_size > 0)
+		fprintf(stderr, "pipes: %d x %dKB\n", job->n_processes - 1, job->pipe_size/1024);
+}
+double elapsed_seconds(struct timespec* from, struct timespec* to){
+	return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec)/1e9;
+}
+int count_running_jobs(){
+	struct job* job;
+	int running = 0;
+	TAILQ_FOREACH(job, &JOBS, next){
+		if(job->background && job->state == JOB_RUNNING)
+			running++;
+	}
+	return running;
+}
+void start_queued_jobs(){
+	// Starts queued jobs, oldest first, while there is room under max-jobs
+	struct job* job;
+	TAILQ_FOREACH(job, &JOBS, next){
+		if(job->state != JOB_QUEUED)
+			continue;
+		if(MAX_JOBS > 0 && count_running_jobs() >= MAX_JOBS)
+			return;
+		start_pipeline(job->pipeline, job);
+		job_update_state(job);
+		free_pipeline_copy(job->pipeline);
+		job->pipeline = NULL;
+	}
+}
+int notify_jobs(){
+	// Reports background jobs that finished or stopped since the last
+	// prompt. Returns how many were reported
+	struct job* job;
+	struct job* next;
+	int reported = 0;
+	start_queued_jobs();
+	for(job = TAILQ_FIRST(&JOBS); job != NULL; job = next){
+		next = TAILQ_NEXT(job, next);
+		if(job->state == JOB_DONE && job->background){
+			if(INTERACTIVE)  // scripts just forget them, like sh
+				printf("[%d]  %s\t%s\n", job->id, job_state_text(job), job->text);
+			TRACE(TRACE_INFO, "done", job->pgid, job_exit_status(job), "%s", job->text);
+			if(job->timed)
+				job_record_stats(job);
+			job_remove(job);
+			reported++;
+		}else if(job->state == JOB_STOPPED && !job->notified){
+			printf("[%d]  Stopped\t%s\n", job->id, job->text);
+			job->notified = TRUE;
+			reported++;
+		}
+	}
+	return reported;
+}
+char* job_state_text(struct job* job){
+	static char text[32];
+	switch(job->state){
+		case JOB_QUEUED: return "Queued";
+		case JOB_RUNNING: return "Running";
+		case JOB_STOPPED: return "Stopped";
+		default:
+			if(job_exit_status(job) == 0)
+				return "Done";
+			snprintf(text, sizeof(text), "Exit %d", job_exit_status(job));
+			return text;
+	}
+}
+struct job* find_job(char* spec){
+	// '%N' is a job number; a plain number is the pid of one of its processes.
+	// Without a spec, the most recent job
+	struct job* job;
+	int i;
+	if(spec == NULL)
+		return TAILQ_LAST(&JOBS, job_table);
+	TAILQ_FOREACH(job, &JOBS, next){
+		if(spec[0] == '%'){
+			if(job->id == atoi(spec + 1))
+				return job;
+			continue;
+		}
+		for(i = 0; i < job->n_processes; i++){
+			if(job->processes[i].pid == atoi(spec))
+				return job;
+		}
+	}
+	printf_error("job nao encontrado: %s", spec);
+	return NULL;
+}
+void continue_job(struct job* job){
+	// Wakes up a stopped job
+	int i;
+	for(i = 0; i < job->n_processes; i++){
+		if(job->processes[i].state == PROCESS_STOPPED){
+			job->processes[i].state = PROCESS_RUNNING;
+			if(!JOB_CONTROL)
+				kill(job->processes[i].pid, SIGCONT);
+		}
+	}
+	if(JOB_CONTROL)
+		kill(-job->pgid, SIGCONT);
+	job->notified = FALSE;
+	job_update_state(job);
+}
+char* pipeline_text(struct pipeline_node* pipeline){
+	// 'cmd args | cmd args > file', as shown by 'jobs'; malloc'd
+	struct command_node* command;
+	size_t len = 1;
+	char* text;
+	int i;
+	STAILQ_FOREACH(command, &pipeline->commands, next){
+		for(i = 0; i < command->argc; i++)
+			len += strlen(command->argv[i]) + 1;
+		for(i = 0; i < command->n_redirects; i++)
+			len += format_redirect(NULL, 0, &command->redirects[i]) + 1;
+		len += 2;
+	}
+	text = (char*) malloc(len);
+	text[0] = '\0';
+	STAILQ_FOREACH(command, &pipeline->commands, next){
+		if(command != STAILQ_FIRST(&pipeline->commands))
+			strcat(text, "| ");
+		for(i = 0; i < command->argc; i++){
+			strcat(text, command->argv[i]);
+			strcat(text, " ");
+		}
+		for(i = 0; i < command->n_redirects; i++){
+			format_redirect(text + strlen(text), len - strlen(text), &command->redirects[i]);
+			strcat(text, " ");
+		}
+	}
+	text[strlen(text) - 1] = '\0';
+	return text;
+}
+struct pipeline_node* clone_pipeline(struct pipeline_node* pipeline){
+	// Heap copy of a pipeline, for jobs that outlive their command line
+	struct pipeline_node* copy = (struct pipeline_node*) malloc(sizeof(struct pipeline_node));
+	struct command_node* command;
+	int i;
+	STAILQ_INIT(&copy->commands);
+	copy->n_commands = pipeline->n_commands;
+	copy->timed = pipeline->timed;
+	copy->pipe_size = pipeline->pipe_size;
+	copy->limits = NULL;
+	if(pipeline->limits != NULL){
+		copy->limits = (struct job_limits*) malloc(sizeof(struct job_limits));
+		*copy->limits = *pipeline->limits;
+	}
+	STAILQ_FOREACH(command, &pipeline->commands, next){
+		struct command_node* clone = (struct command_node*) calloc(1, sizeof(struct command_node));
+		clone->argc = command->argc;
+		clone->argv = (char**) malloc(sizeof(char*)*(command->argc + 1));
+		for(i = 0; i < command->argc; i++)
+			clone->argv[i] = strdup(command->argv[i]);
+		clone->argv[command->argc] = NULL;
+		if(command->expand != NULL){
+			clone->expand = (char*) malloc(command->argc + 1);
+			memcpy(clone->expand, command->expand, command->argc + 1);
+		}
+		clone->n_redirects = command->n_redirects;
+		clone->redirects = (struct redirect*) malloc(sizeof(struct redirect)*(command->n_redirects + 1));
+		for(i = 0; i < command->n_redirects; i++){
+			clone->redirects[i] = command->redirects[i];
+			if(command->redirects[i].file != NULL)
+				clone->redirects[i].file = strdup(command->redirects[i].file);
+		}
+		clone->timeout_ms = command->timeout_ms;
+		STAILQ_INSERT_TAIL(&copy->commands, clone, next);
+	}
+	return copy;
+}
+void free_pipeline_copy(struct pipeline_node* pipeline){
+	struct command_node* command;
+	int i;
+	if(pipeline == NULL)
+		return;
+	while((command = STAILQ_FIRST(&pipeline->commands)) != NULL){
+		STAILQ_REMOVE_HEAD(&pipeline->commands, next);
+		for(i = 0; i < command->argc; i++)
+			free(command->argv[i]);
+		free(command->argv);
+		free(command->expand);
+		for(i = 0; i < command->n_redirects; i++)
+			free(command->redirects[i].file);
+		free(command->redirects);
+		free(command);
+	}
+	free(pipeline->limits);
+	free(pipeline);
+}
+/*************************************** 
+ * Job Limits
+ ***************************************
+ ***************************************/
+int parse_job_limit(char* word, struct job_limits* limits){
+	// One 'key=value' of 'limit' (or bg-limit) into 'limits'. Returns 1,
+	// 0 if the key is not a limit, or -1 (with a message) if the value is bad
+	long* field;
+	long value;
+	char* end;
+	if(strncmp(word, "cpu=", 4) == 0){  // percent of one CPU: cpu=250% is 2.5 CPUs
+		field = &limits->cpu_percent;
+		value = strtol(word + 4, &end, 10);
+		if(end == word + 4 || (*end != '\0' && strcmp(end, "%") != 0))
+			value = -1;
+	}else if(strncmp(word, "cputime=", 8) == 0){
+		field = &limits->cpu_time;
+		value = parse_duration(word + 8);
+		value = (value > 0) ? (value + 999)/1000 : value;  // whole seconds, rounded up
+	}else if(strncmp(word, "mem=", 4) == 0){
+		field = &limits->memory;
+		value = parse_size(word + 4);
+	}else if(strncmp(word, "as=", 3) == 0){
+		field = &limits->address_space;
+		value = parse_size(word + 3);
+	}else if(strncmp(word, "pids=", 5) == 0){
+		field = &limits->pids;
+		value = parse_size(word + 5);
+	}else if(strncmp(word, "files=", 6) == 0){
+		field = &limits->open_files;
+		value = parse_size(word + 6);
+	}else
+		return 0;
+	if(value <= 0){
+		printf_error("limit: valor invalido: %s", word);
+		return -1;
+	}
+	*field = value;
+	return 1;
+}
+int format_job_limits(char* out, size_t size, struct job_limits* limits){
+	// The limits as 'limit' words, "cpu=50% mem=512M"; returns the length
+	char* names[] = {"cpu", "cputime", "mem", "as", "pids", "files"};
+	long values[] = {limits->cpu_percent, limits->cpu_time, limits->memory, limits->address_space, limits->pids, limits->open_files};
+	size_t len = 0;
+	int i;
+	out[0] = '\0';
+	for(i = 0; i < 6 && len < size; i++){
+		long value = values[i];
+		char* unit = (i == 0) ? "%" : (i == 1) ? "s" : "";
+		if(value == 0)
+			continue;
+		if(i == 2 || i == 3){  // sizes
+			if(value % (1L << 30) == 0){
+				value >>= 30;
+				unit = "G";
+			}else if(value % (1L << 20) == 0){
+				value >>= 20;
+				unit = "M";
+			}else if(value % (1L << 10) == 0){
+				value >>= 10;
+				unit = "K";
+			}
+		}
+		len += snprintf(out + len, size - len, "%s%s=%ld%s", len > 0 ? " " : "", names[i], value, unit);
+	}
+	return (len < size) ? (int) len : (int) size - 1;
+}
+void bg_limit_changed(){
+	// 'set -o bg-limit="cpu=50% mem=1G"': the limits of background jobs
+	// started without a 'limit' of their own. A bad word drops them all
+	char* words;
+	char* word;
+	char* save;
+	memset(&BG_LIMITS, 0, sizeof(BG_LIMITS));
+	if(BG_LIMIT == NULL)
+		return;
+	words = strdup(BG_LIMIT);
+	for(word = strtok_r(words, " \t", &save); word != NULL; word = strtok_r(NULL, " \t", &save)){
+		int found = parse_job_limit(word, &BG_LIMITS);
+		if(found > 0)
+			continue;
+		if(found == 0)
+			printf_error("limit: limite desconhecido: %s", word);
+		memset(&BG_LIMITS, 0, sizeof(BG_LIMITS));
+		free(BG_LIMIT);
+		BG_LIMIT = NULL;
+		break;
+	}
+	free(words);
+}
+int cgroup_init(){
+	// The first time a job needs a cgroup: makes <the shell's cgroup
+	// v2>/kshell-PID, the parent of the job cgroups, and hands it the cpu,
+	// memory and pids controllers it can get. A cgroup with processes
+	// can't pass controllers on (except the root), so if the shell is
+	// alone in its cgroup (a delegated scope) it moves to kshell-PID/shell.
+	// Returns FALSE without a cgroup v2 the shell can write to
+	static pid_t tried = 0;
+	char mount[PATH_MAX] = "", path[PATH_MAX] = "", line[2*PATH_MAX], self[32];
+	char base[2*PATH_MAX], dir[2*PATH_MAX + 32], shell[2*PATH_MAX + 64];
+	size_t len;
+	FILE* f;
+	if(tried == getpid())
+		return CGROUP_DIR != NULL;
+	tried = getpid();
+	free(CGROUP_DIR);  // a forked session does not share its parent's
+	CGROUP_DIR = NULL;
+	CGROUP_SHELL_MOVED = FALSE;
+	if((f = fopen("/proc/self/mountinfo", "re")) != NULL){
+		while(mount[0] == '\0' && fgets(line, sizeof(line), f) != NULL){
+			if(strstr(line, " - cgroup2 ") != NULL)
+				sscanf(line, "%*s %*s %*s %*s %4095s", mount);
+		}
+		fclose(f);
+	}
+	if((f = fopen("/proc/self/cgroup", "re")) != NULL){
+		while(path[0] == '\0' && fgets(line, sizeof(line), f) != NULL){
+			if(strncmp(line, "0::", 3) == 0){
+				line[strcspn(line, "\n")] = '\0';
+				if((len = strlen(line + 3)) >= sizeof(path))  // too deep to use: no cgroup
+					break;
+				memcpy(path, line + 3, len + 1);
+			}
+		}
+		fclose(f);
+	}
+	if(mount[0] == '\0' || path[0] == '\0')
+		return FALSE;
+	snprintf(base, sizeof(base), "%s%s", mount, strcmp(path, "/") == 0 ? "" : path);
+	snprintf(dir, sizeof(dir), "%s/kshell-%d", base, (int) getpid());
+	if(mkdir(dir, 0755) < 0 && errno != EEXIST){
+		TRACE(TRACE_ERROR, "cgroup", getpid(), errno, "%s", dir);
+		return FALSE;
+	}
+	if(cgroup_enable(base)){  // busy: there are processes in it
+		snprintf(self, sizeof(self), "%d\n", (int) getpid());
+		snprintf(shell, sizeof(shell), "%s/shell", dir);
+		if(cgroup_read(base, "cgroup.procs", line, sizeof(line)) > 0 && strcmp(line, self) == 0
+			&& (mkdir(shell, 0755) == 0 || errno == EEXIST) && cgroup_write(shell, "cgroup.procs", "0") == 0){
+			CGROUP_SHELL_MOVED = TRUE;
+			cgroup_enable(base);
+		}
+	}
+	cgroup_enable(dir);
+	CGROUP_DIR = strdup(dir);
+	CGROUP_OWNER = getpid();
+	TRACE(TRACE_INFO, "cgroup", getpid(), CGROUP_SHELL_MOVED, "%s", dir);
+	return TRUE;
+}
+int cgroup_enable(char* dir){
+	// Passes cpu, memory and pids (those 'dir' has) on to its children.
+	// Returns TRUE if one was refused because 'dir' has processes
+	char* controllers[] = {"+cpu", "+memory", "+pids"};
+	int i, busy = FALSE;
+	for(i = 0; i < 3; i++){
+		if(cgroup_write(dir, "cgroup.subtree_control", controllers[i]) < 0 && errno == EBUSY)
+			busy = TRUE;
+	}
+	return busy;
+}
+int cgroup_write(char* dir, char* file, char* value){
+	// Returns 0, or -1 with errno set
+	char path[2*PATH_MAX + 64];
+	int fd, saved;
+	ssize_t written;
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	if((fd = open(path, O_WRONLY | O_CLOEXEC)) < 0)
+		return -1;
+	written = write(fd, value, strlen(value));
+	saved = errno;
+	close(fd);
+	errno = saved;
+	return (written == (ssize_t) strlen(value)) ? 0 : -1;
+}
+int cgroup_read(char* dir, char* file, char* buffer, size_t size){
+	// 'file' as a string; returns its length, or -1 if it is missing
+	char path[2*PATH_MAX + 64];
+	ssize_t len;
+	int fd;
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	if((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+	len = read(fd, buffer, size - 1);
+	close(fd);
+	buffer[len > 0 ? len : 0] = '\0';
+	return (int) len;
+}
+void job_limits_setup(struct job* job, struct pipeline_node* pipeline){
+	// Right before the job starts: its limits are its 'limit' prefix, or
+	// bg-limit for a background job. cpu, mem and pids go in a cgroup of
+	// its own; what that can't take falls back to rlimits (mem becomes an
+	// address space limit) or, for cpu and pids, is only reported
+	static int warned = 0;  // CGROUP_* already reported
+	struct job_limits* limits = pipeline->limits;
+	char path[2*PATH_MAX + 64], value[64];
+	int missing = 0;
+	if(limits == NULL && job->background && BG_LIMIT != NULL)
+		limits = &BG_LIMITS;
+	if(limits == NULL)
+		return;
+	job->limits = *limits;
+	job->limited = TRUE;
+	if(limits->cpu_percent == 0 && limits->memory == 0 && limits->pids == 0)
+		return;  // rlimits only
+	if(cgroup_init()){
+		snprintf(path, sizeof(path), "%s/job-%d", CGROUP_DIR, job->id);
+		if((mkdir(path, 0755) == 0 || errno == EEXIST) && (job->cgroup_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0)
+			job->cgroup = strdup(path);
+		else
+			TRACE(TRACE_ERROR, "cgroup", getpid(), errno, "%s", path);
+	}
+	if(limits->cpu_percent > 0){
+		snprintf(value, sizeof(value), "%ld %d", limits->cpu_percent*CPU_MAX_PERIOD/100, CPU_MAX_PERIOD);
+		if(job->cgroup == NULL || cgroup_write(job->cgroup, "cpu.max", value) < 0)  // ENOENT without the controller
+			missing |= CGROUP_CPU;
+	}
+	if(limits->memory > 0){
+		snprintf(value, sizeof(value), "%ld", limits->memory);
+		if(job->cgroup == NULL || cgroup_write(job->cgroup, "memory.max", value) < 0){
+			missing |= CGROUP_MEMORY;
+			if(job->limits.address_space == 0 || job->limits.memory < job->limits.address_space)
+				job->limits.address_space = job->limits.memory;
+		}
+	}
+	if(limits->pids > 0){
+		snprintf(value, sizeof(value), "%ld", limits->pids);
+		if(job->cgroup == NULL || cgroup_write(job->cgroup, "pids.max", value) < 0)
+			missing |= CGROUP_PIDS;
+	}
+	if((missing & ~warned) != 0){
+		snprintf(value, sizeof(value), "%s%s%s", (missing & CGROUP_CPU) ? " cpu" : "",
+			(missing & CGROUP_MEMORY) ? " mem (como as)" : "", (missing & CGROUP_PIDS) ? " pids" : "");
+		printf_alert("limit: sem cgroup v2 para%s: so os rlimits valem", value);
+		warned |= missing;
+	}
+}
+void job_limits_release(struct job* job){
+	// The job is gone: so is its cgroup
+	if(job->cgroup_fd >= 0)
+		close(job->cgroup_fd);
+	job->cgroup_fd = -1;
+	if(job->cgroup != NULL && rmdir(job->cgroup) < 0)
+		TRACE(TRACE_ERROR, "cgroup", getpid(), errno, "%s", job->cgroup);
+	free(job->cgroup);
+	job->cgroup = NULL;
+}
+void apply_job_limits(struct launch_spec* spec){
+	// In the child, before exec: joins the job's cgroup and sets the
+	// rlimits, hard limits too, so the command can't raise them again
+	struct job_limits* limits = spec->limits;
+	int fd;
+	if(spec->cgroup_fd >= 0){
+		if((fd = openat(spec->cgroup_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC)) < 0 || write(fd, "0", 1) != 1)
+			fprintf(stderr, "limit: cgroup: %s\n", strerror(errno));
+		if(fd >= 0)
+			close(fd);
+		close(spec->cgroup_fd);
+	}
+	if(limits->cpu_time > 0)
+		set_rlimit(RLIMIT_CPU, limits->cpu_time, limits->cpu_time + 1);  // SIGXCPU, then SIGKILL a second later
+	if(limits->address_space > 0)
+		set_rlimit(RLIMIT_AS, limits->address_space, limits->address_space);
+	if(limits->open_files > 0)
+		set_rlimit(RLIMIT_NOFILE, limits->open_files, limits->open_files);
+}
+void set_rlimit(int resource, long soft, long hard){
+	// Never above the hard limit the shell has (only root could raise it)
+	struct rlimit limit;
+	if(getrlimit(resource, &limit) == 0 && limit.rlim_max != RLIM_INFINITY){
+		if((rlim_t) hard > limit.rlim_max)
+			hard = (long) limit.rlim_max;
+		if(soft > hard)
+			soft = hard;
+	}
+	limit.rlim_cur = (rlim_t) soft;
+	limit.rlim_max = (rlim_t) hard;
+	if(setrlimit(resource, &limit) < 0)
+		fprintf(stderr, "limit: setrlimit: %s\n", strerror(errno));
+}
+void cgroup_release(){
+	// On exit: kshell-PID is removed and a moved shell goes back to its
+	// cgroup, unless a job cgroup in it still has processes
+	struct job* job;
+	char base[2*PATH_MAX], shell[2*PATH_MAX + 64];
+	char* controllers[] = {"-cpu", "-memory", "-pids"};
+	int i;
+	if(CGROUP_DIR == NULL || CGROUP_OWNER != getpid())
+		return;
+	TAILQ_FOREACH(job, &JOBS, next){
+		if(job->cgroup != NULL && job->state != JOB_DONE)
+			return;
+		job_limits_release(job);
+	}
+	snprintf(base, sizeof(base), "%s", CGROUP_DIR);
+	*strrchr(base, '/') = '\0';
+	if(CGROUP_SHELL_MOVED){  // the controllers leave first: base takes no process while it passes them on
+		for(i = 0; i < 3; i++)
+			cgroup_write(CGROUP_DIR, "cgroup.subtree_control", controllers[i]);
+		for(i = 0; i < 3; i++)
+			cgroup_write(base, "cgroup.subtree_control", controllers[i]);
+		if(cgroup_write(base, "cgroup.procs", "0") == 0){
+			snprintf(shell, sizeof(shell), "%s/shell", CGROUP_DIR);
+			rmdir(shell);
+		}
+	}
+	if(rmdir(CGROUP_DIR) < 0)
+		TRACE(TRACE_ERROR, "cgroup", getpid(), errno, "%s", CGROUP_DIR);
+	free(CGROUP_DIR);
+	CGROUP_DIR = NULL;
+}
+/*************************************** 
+ * Input
+ ***************************************
+ ***************************************/
+int open_input_fd(int fd){
+	// Reads commands from 'fd' in INPUT_BUFFER_SIZE chunks. Only a terminal
+	// makes the shell interactive
+	INPUT.size = INPUT_BUFFER_SIZE;
+	INPUT.data = (char*) malloc(INPUT.size);
+	INPUT.start = INPUT.end = 0;
+	INPUT.fd = fd;
+	INPUT.eof = FALSE;
+	INTERACTIVE = (fd == STDIN_FILENO && isatty(fd));
+	return 0;
+}
+int open_input_file(char* path){
+	// A script is mapped whole and handed out line by line, without a
+	// single read(). Anything that can't be mapped (a fifo, an empty file)
+	// is read in chunks instead
+	struct stat info;
+	void* script;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0){
+		printf_error("Erro ao abrir script: %s", path);
+		perror("->");
+		return -1;
+	}
+	if(fstat(fd, &info) < 0 || !S_ISREG(info.st_mode) || info.st_size == 0)
+		return open_input_fd(fd);
+	script = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(script == MAP_FAILED){
+		printf_error("Erro ao mapear script: %s", path);
+		perror("->");
+		return -1;
+	}
+	madvise(script, info.st_size, MADV_SEQUENTIAL);
+	INPUT.data = (char*) script;
+	INPUT.size = INPUT.end = info.st_size;
+	INPUT.start = 0;
+	INPUT.fd = -1;
+	INPUT.eof = TRUE;
+	return 0;
+}
+int open_input_string(char* commands){
+	// 'kshell -c commands': lines are split on '\n' as in a script
+	INPUT.data = commands;
+	INPUT.size = INPUT.end = strlen(commands);
+	INPUT.start = 0;
+	INPUT.fd = -1;
+	INPUT.eof = TRUE;
+	return 0;
+}
+char* read_line(){
+	// Next line of input without its '\n', copied into the line arena (the
+	// lexer writes into it). Lines can be of any length. Returns NULL at the
+	// end of the input
+	char* text;
+	char* line;
+	size_t len;
+	if(INPUT.fd < 0 && !TAILQ_EMPTY(&JOBS))
+		event_loop_run(TRUE);  // nothing to wait for: just reap
+	if((text = input_next_line(&INPUT, &len)) == NULL)
+		return NULL;
+	line = (char*) arena_alloc(&LINE_ARENA, len + 1);
+	memcpy(line, text, len);
+	line[len] = '\0';
+	return line;
+}
+char* input_next_line(struct input_buffer* input, size_t* len){
+	// Next line of 'input', without its '\n' and not '\0' terminated (the
+	// data may be a read-only mapping); good until the next call. Returns
+	// NULL at the end of the input
+	char* newline;
+	char* line;
+	while(TRUE){
+		line = input->data + input->start;
+		newline = (char*) memchr(line, '\n', input->end - input->start);
+		if(newline != NULL || (input->eof && input->start < input->end)){
+			*len = (newline != NULL) ? (size_t) (newline - line) : input->end - input->start;
+			input->start += *len + (newline != NULL);
+			return line;
+		}
+		if(input->eof)
+			return NULL;
+		fill_input(input);
+	}
+}
+void fill_input(struct input_buffer* input){
+	// Appends one read() to the buffer, which doubles when a line doesn't
+	// fit. For the shell's own input it first runs the event loop until
+	// the input is readable (jobs that finish while the user is typing are
+	// reported right away)
+	ssize_t n;
+	if(input->start > 0){  // keep only the partial line
+		memmove(input->data, input->data + input->start, input->end - input->start);
+		input->end -= input->start;
+		input->start = 0;
+	}
+	if(input->end == input->size){
+		input->size *= 2;
+		input->data = (char*) realloc(input->data, input->size);
+		if(input->data == NULL){
+			print_error("Sem memoria");
+			exit(1);
+		}
+	}
+	if(input == &INPUT){
+		fflush(stdout);
+		while(!event_loop_run(TRUE)){
+			if(notify_jobs() > 0)
+				print_prompt();
+		}
+	}
+	n = read(input->fd, input->data + input->end, input->size - input->end);
+	if(n < 0 && (errno == EINTR || errno == EAGAIN))
+		return;
+	if(n <= 0)
+		input->eof = TRUE;
+	else
+		input->end += n;
+}
+/*************************************** 
+ * History
+ ***************************************
+ ***************************************/
+int history_open(){
+	// Maps history-file (appended to by every session) or, when the shell
+	// is not interactive and no file was asked for, a memfd: 'last' and
+	// 'history' work the same, nothing is written to disk
+	char path[PATH_MAX];
+	char* home = variable_get("HOME");
+	if(HISTORY.fd >= 0)
+		return 0;
+	if(HISTORY_FILE != NULL)
+		HISTORY.fd = open(HISTORY_FILE, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	else if(INTERACTIVE && home != NULL){
+		snprintf(path, sizeof(path), "%s/.kshell_history", home);
+		HISTORY.fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	}
+	if(HISTORY.fd < 0)
+		HISTORY.fd = memfd_create("history", MFD_CLOEXEC);
+	if(HISTORY.fd < 0)
+		return -1;
+	HISTORY.capacity = HISTORY_INITIAL_CAPACITY;
+	HISTORY.offsets = (size_t*) malloc(sizeof(size_t)*(HISTORY.capacity + 1));
+	HISTORY.offsets[0] = 0;
+	history_sync();
+	return 0;
+}
+void history_sync(){
+	// Maps what the file has grown to (our lines and other sessions') and
+	// finds its complete lines. A line another shell is still writing
+	// waits for the next sync
+	struct stat info;
+	char* line, *end;
+	if(HISTORY.fd < 0 || fstat(HISTORY.fd, &info) < 0 || (size_t) info.st_size <= HISTORY.indexed)
+		return;
+	if((size_t) info.st_size > HISTORY.mapped){
+		char* map = (HISTORY.map == NULL) ? mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, HISTORY.fd, 0)
+			: mremap(HISTORY.map, HISTORY.mapped, info.st_size, MREMAP_MAYMOVE);
+		if(map == MAP_FAILED)
+			return;
+		HISTORY.map = map;
+		HISTORY.mapped = info.st_size;
+	}
+	line = HISTORY.map + HISTORY.indexed;
+	while((end = memchr(line, '\n', HISTORY.map + HISTORY.mapped - line)) != NULL){
+		if(HISTORY.count == HISTORY.capacity){
+			HISTORY.capacity *= 2;
+			HISTORY.offsets = (size_t*) realloc(HISTORY.offsets, sizeof(size_t)*(HISTORY.capacity + 1));
+		}
+		HISTORY.offsets[++HISTORY.count] = end + 1 - HISTORY.map;
+		line = end + 1;
+	}
+	HISTORY.indexed = line - HISTORY.map;
+}
+void history_index(){
+	// Brings the trigram index up to date: each entry goes once in the
+	// postings of every trigram it has. Buckets fold each byte to its low
+	// 6 bits, a table small enough to index directly; the matches are
+	// checked against the text anyway
+	struct trigram_postings* postings;
+	size_t len, i;
+	char* text;
+	if(HISTORY.trigrams == NULL)
+		HISTORY.trigrams = (struct trigram_postings*) calloc(TRIGRAM_BUCKETS, sizeof(struct trigram_postings));
+	for(; HISTORY.trigram_count < HISTORY.count; HISTORY.trigram_count++){
+		text = history_entry(HISTORY.trigram_count, &len);
+		for(i = 0; i + 3 <= len; i++){
+			postings = &HISTORY.trigrams[trigram_bucket(text + i)];
+			if(postings->n_ids > 0 && postings->ids[postings->n_ids - 1] == HISTORY.trigram_count)
+				continue;
+			if(postings->n_ids == postings->capacity){
+				postings->capacity = (postings->capacity == 0) ? 4 : postings->capacity*2;
+				postings->ids = (uint32_t*) realloc(postings->ids, sizeof(uint32_t)*postings->capacity);
+			}
+			postings->ids[postings->n_ids++] = HISTORY.trigram_count;
+		}
+	}
+}
+uint32_t trigram_bucket(char* text){
+	uint32_t mask = (1 << TRIGRAM_BITS) - 1;
+	return ((text[0] & mask) << (2*TRIGRAM_BITS)) | ((text[1] & mask) << TRIGRAM_BITS) | (text[2] & mask);
+}
+void history_add(char* line){
+	// Appends the line with a single write, so lines of concurrent
+	// sessions never mix. Blank lines are not kept
+	size_t len = strlen(line);
+	char* record;
+	if(strspn(line, " \t") == len || history_open() < 0)
+		return;
+	record = (char*) malloc(len + 1);
+	memcpy(record, line, len);
+	record[len] = '\n';
+	if(write_all(HISTORY.fd, record, len + 1) == 0){
+		history_sync();
+		HISTORY.current = (long) HISTORY.count - 1;
+	}
+	free(record);
+}
+char* history_entry(long id, size_t* len){
+	// Entry 'id' (from 0), not terminated: its length goes in *len
+	if(history_open() < 0 || id < 0 || id >= (long) HISTORY.count)
+		return NULL;
+	*len = HISTORY.offsets[id + 1] - HISTORY.offsets[id] - 1;
+	return HISTORY.map + HISTORY.offsets[id];
+}
+long history_next_match(char* pattern, size_t len, long from){
+	// First entry >= 'from' that contains 'pattern', or -1. Only the
+	// entries in the shortest postings list of the pattern's trigrams can
+	struct trigram_postings* best = NULL;
+	uint32_t low, high;
+	size_t i, entry_len;
+	char* text;
+	long id;
+	if(history_open() < 0)
+		return -1;
+	if(len >= 3)
+		history_index();
+	for(i = 0; i + 3 <= len; i++){
+		struct trigram_postings* postings = &HISTORY.trigrams[trigram_bucket(pattern + i)];
+		if(best == NULL || postings->n_ids < best->n_ids)
+			best = postings;
+	}
+	if(best == NULL){  // shorter than a trigram
+		for(id = from; (text = history_entry(id, &entry_len)) != NULL; id++){
+			if(memmem(text, entry_len, pattern, len) != NULL)
+				return id;
+		}
+		return -1;
+	}
+	for(low = 0, high = best->n_ids; low < high; ){  // first posting >= from
+		uint32_t middle = (low + high)/2;
+		if((long) best->ids[middle] < from)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	for(; low < best->n_ids; low++){
+		text = history_entry(best->ids[low], &entry_len);
+		if(memmem(text, entry_len, pattern, len) != NULL)
+			return best->ids[low];
+	}
+	return -1;
+}
+long history_find_prefix(char* prefix, size_t len){
+	// The most recent entry (before the current line) starting with prefix.
+	// A backward scan usually stops a few entries back; the postings are
+	// used only if a search already built the index, never built for this
+	struct trigram_postings* postings = NULL;
+	size_t entry_len;
+	char* text;
+	long id;
+	if(history_open() < 0)
+		return -1;
+	if(len >= 3 && HISTORY.trigrams != NULL){
+		history_index();  // only the entries added since
+		postings = &HISTORY.trigrams[trigram_bucket(prefix)];
+		for(id = (long) postings->n_ids - 1; id >= 0; id--){
+			text = history_entry(postings->ids[id], &entry_len);
+			if(entry_len >= len && memcmp(text, prefix, len) == 0)
+				return postings->ids[id];
+		}
+		return -1;
+	}
+	for(id = (long) HISTORY.count - 1; (text = history_entry(id, &entry_len)) != NULL; id--){
+		if(entry_len >= len && memcmp(text, prefix, len) == 0)
+			return id;
+	}
+	return -1;
+}
+char* history_expand(char* line){
+	// Replaces '!!', '!n', '!-n' and '!prefix' (up to a blank or an
+	// operator) with the history lines. Like bash, a '!' in single quotes,
+	// after '$', inside '${...}' or before '"' is left alone. Returns
+	// 'line' itself when there is nothing to expand, NULL (after the
+	// message) for an unknown event, else the new line in the line arena
+	char* out, *text, *start, *original = line;
+	size_t out_len = 0, len, capacity;
+	int quoted = FALSE, changed = FALSE, braces = 0;
+	long id;
+	if(strchr(line, '!') == NULL)
+		return line;
+	history_sync();
+	capacity = strlen(line) + 1;
+	out = (char*) malloc(capacity);
+	while(*line != '\0'){
+		if(*line == '\'')
+			quoted = !quoted;
+		else if(!quoted && line[0] == '$' && line[1] == '{')
+			braces++;
+		else if(braces > 0 && line[0] == '}')
+			braces--;
+		if(quoted || braces > 0 || line[0] != '!' || (line > original && line[-1] == '$') || line[1] == '\0' || strchr(" \t=(\"", line[1]) != NULL){
+			out[out_len++] = *line++;
+			continue;
+		}
+		start = ++line;
+		if(*line == '!'){
+			id = (long) HISTORY.count - 1;
+			line++;
+		}else if((*line >= '0' && *line <= '9') || (*line == '-' && line[1] >= '0' && line[1] <= '9')){
+			id = strtol(line, &line, 10);
+			id = (id < 0) ? (long) HISTORY.count + id : id - 1;
+		}else{
+			while(*line != '\0' && strchr(" \t;&|<>", *line) == NULL)
+				line++;
+			id = history_find_prefix(start, line - start);
+		}
+		if((text = history_entry(id, &len)) == NULL){
+			char* event = strndup(start - 1, line - start + 1);
+			printf_error("%s: evento nao encontrado", event);
+			free(event);
+			free(out);
+			return NULL;
+		}
+		capacity += len;
+		out = (char*) realloc(out, capacity);
+		memcpy(out + out_len, text, len);
+		out_len += len;
+		changed = TRUE;
+	}
+	out[out_len] = '\0';
+	if(!changed){
+		free(out);
+		return original;
+	}
+	text = (char*) arena_alloc(&LINE_ARENA, out_len + 1);
+	memcpy(text, out, out_len + 1);
+	free(out);
+	return text;
+}
+/*************************************** 
+ * Event Loop
+ ***************************************
+ ***************************************/
+void init_event_loop(){
+	// The shell only ever sleeps in epoll_wait, on: stdin (while a line is
+	// being read), a signalfd for SIGCHLD, a pidfd per running child and a
+	// timerfd per 'timeout'. SIGCHLD stays blocked so it is only seen
+	// through the signalfd; children get an empty mask back
+	struct epoll_event event;
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	EVENT_LOOP = epoll_create1(EPOLL_CLOEXEC);
+	SIGNAL_FD = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if(EVENT_LOOP < 0 || SIGNAL_FD < 0){
+		print_error("Erro ao criar o event loop");
+		perror("->");
+		exit(EXIT_FAILURE);
+	}
+	event.events = EPOLLIN;
+	event.data.u64 = EVENT_DATA(EVENT_SIGNAL, 0);
+	epoll_ctl(EVENT_LOOP, EPOLL_CTL_ADD, SIGNAL_FD, &event);
+}
+int event_loop_run(int want_input){
+	// Sleeps until something happens and handles it: reaps children, kills
+	// the ones past their deadline and starts queued jobs. With want_input,
+	// stdin is watched too; returns TRUE when it can be read
+	struct epoll_event events[EVENT_BATCH_SIZE];
+	struct signalfd_siginfo info;
+	int n, i, input_ready = FALSE;
+	event_loop_watch_input(want_input);
+	if(want_input && (INPUT_NOT_POLLABLE || INPUT.fd < 0))
+		input_ready = TRUE;  // just collect what already happened
+	if(LAUNCHER == LAUNCHER_ZYGOTE && !input_ready)
+		zygote_refill();  // nothing else to do
+	n = epoll_wait(EVENT_LOOP, events, EVENT_BATCH_SIZE, input_ready ? 0 : -1);
+	if(n < 0 && errno != EINTR){
+		print_error("Erro no event loop");
+		perror("->");
+		return want_input;  // fall back to a blocking read
+	}
+	for(i = 0; i < n; i++){
+		pid_t pid = (pid_t) (uint32_t) events[i].data.u64;
+		switch(events[i].data.u64 >> 32){
+			case EVENT_INPUT:
+				input_ready = TRUE;
+				break;
+			case EVENT_SIGNAL:  // stops, continues and exits without a pidfd
+				while(read(SIGNAL_FD, &info, sizeof(info)) == sizeof(info))
+					;
+				reap_children(-1);
+				break;
+			case EVENT_CHILD:
+				reap_children(pid);
+				break;
+			case EVENT_TIMEOUT:
+				expire_timeout(pid);
+				break;
+			case EVENT_ACCEPT:
+				serve_accept();
+				break;
+		}
+	}
+	start_queued_jobs();
+	return input_ready;
+}
+void event_loop_watch_input(int watch){
+	// stdin leaves the set while a command runs: it may read the same
+	// terminal, and a hung up pipe would wake the loop up for nothing
+	struct epoll_event event;
+	if(watch == INPUT_WATCHED || INPUT_NOT_POLLABLE || INPUT.fd < 0)
+		return;
+	event.events = EPOLLIN;
+	event.data.u64 = EVENT_DATA(EVENT_INPUT, 0);
+	if(epoll_ctl(EVENT_LOOP, watch ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, INPUT.fd, &event) < 0){
+		if(errno == EPERM)  // regular files can't be polled
+			INPUT_NOT_POLLABLE = TRUE;
+		return;
+	}
+	INPUT_WATCHED = watch;
+}
+void event_loop_watch_process(struct job_process* process, long timeout_ms){
+	// The pidfd turns readable when the process exits. The child can't be
+	// reaped before this runs, so its pid can't have been reused either
+	struct epoll_event event;
+	struct itimerspec deadline;
+	event.events = EPOLLIN;
+	process->pidfd = pidfd_open(process->pid, 0);  // close-on-exec
+	if(process->pidfd >= 0){  // otherwise the signalfd still reaps it
+		event.data.u64 = EVENT_DATA(EVENT_CHILD, process->pid);
+		epoll_ctl(EVENT_LOOP, EPOLL_CTL_ADD, process->pidfd, &event);
+	}
+	if(timeout_ms <= 0)
+		return;
+	process->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(process->timer_fd < 0){
+		print_error("Erro ao criar timer");
+		perror("->");
+		return;
+	}
+	memset(&deadline, 0, sizeof(deadline));
+	deadline.it_value.tv_sec = timeout_ms / 1000;
+	deadline.it_value.tv_nsec = (timeout_ms % 1000) * 1000000;
+	timerfd_settime(process->timer_fd, 0, &deadline, NULL);
+	event.data.u64 = EVENT_DATA(EVENT_TIMEOUT, process->pid);
+	epoll_ctl(EVENT_LOOP, EPOLL_CTL_ADD, process->timer_fd, &event);
+}
+void event_loop_forget_process(struct job_process* process){
+	// Forked builtins hold copies of these fds, so they are taken out of the
+	// set explicitly instead of relying on close
+	if(process->pidfd >= 0){
+		epoll_ctl(EVENT_LOOP, EPOLL_CTL_DEL, process->pidfd, NULL);
+		close(process->pidfd);
+		process->pidfd = -1;
+	}
+	event_loop_forget_timer(process);
+}
+void event_loop_forget_timer(struct job_process* process){
+	if(process->timer_fd >= 0){
+		epoll_ctl(EVENT_LOOP, EPOLL_CTL_DEL, process->timer_fd, NULL);
+		close(process->timer_fd);
+		process->timer_fd = -1;
+	}
+}
+void event_loop_reset(){
+	// For shell code running in a forked child (a builtin in a pipeline):
+	// the epoll instance is shared with the shell after fork, so the child
+	// gets its own. The jobs it inherited are the shell's to run and reap
+	// (they're just dropped, the child exits soon) and it doesn't own the
+	// terminal either
+	TAILQ_INIT(&JOBS);
+	zygote_reset();
+	if(ZYGOTE_SPAWNER >= 0)
+		close(ZYGOTE_SPAWNER);  // its helpers would be the shell's children, not ours
+	ZYGOTE_SPAWNER = -1;
+	close(EVENT_LOOP);
+	close(SIGNAL_FD);
+	INPUT_WATCHED = FALSE;
+	JOB_CONTROL = FALSE;
+	init_event_loop();
+}
+void reap_children(pid_t pid){
+	// Collects every pending state change of 'pid' (-1: of any child),
+	// with the resources used by the ones that are done
+	struct rusage usage;
+	pid_t child;
+	int status;
+	while((child = wait4(pid, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0)
+		job_process_changed(child, status, &usage);
+}
+void expire_timeout(pid_t pid){
+	// SIGTERM like coreutils' timeout; a stopped process is woken up so it
+	// can die. The exit is then reported through its pidfd as usual
+	struct job* job;
+	struct job_process* process = find_job_process(pid, &job);
+	if(process == NULL || process->state == PROCESS_DONE)
+		return;
+	event_loop_forget_timer(process);
+	process->timed_out = TRUE;
+	TRACE(TRACE_INFO, "timeout", pid, SIGTERM, "%s", process->name);
+	kill(pid, SIGTERM);
+	if(process->state == PROCESS_STOPPED)
+		kill(pid, SIGCONT);
+}
+/*************************************** 
+ * Launcher
+ ***************************************
+ ***************************************/
+pid_t launch_command(struct command_node* command, struct launch_spec* spec){
+	// Starts 'command' wired as described by 'spec'.
+	// Returns the child pid, or -1 if it could not be started
+	command->builtin = find_command_builtin(command->argv);
+	if(command->builtin != NULL)  // the child runs it without exec
+		return launch_with_fork(command, spec);
+	struct timespec start;
+	pid_t child;
+	int launcher = LAUNCHER;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	command->path = path_cache_lookup(command->argv[0]);
+	if(command->path == NULL){
+		TRACE(TRACE_ERROR, "launch", 0, ENOENT, "%s", command->argv[0]);
+		printf_error("Comando possívelmente invalido ou incompleto: %s", command->argv[0]);
+		fprintf(stderr, "->: %s\n", strerror(ENOENT));
+		return -1;
+	}
+	if(spec->limits != NULL)
+		launcher = LAUNCHER_FORK;  // the child sets them up before exec
+	if(launcher == LAUNCHER_ZYGOTE && (child = launch_with_zygote(command, spec)) != 0){
+		record_launch(launcher, &start);
+		return child;
+	}
+	if(launcher == LAUNCHER_ZYGOTE)
+		launcher = LAUNCHER_SPAWN;  // no helper left: the pool grows on the next refill
+	if(launcher == LAUNCHER_SPAWN)
+		child = launch_with_spawn(command, spec);
+	else
+		child = launch_with_fork(command, spec);
+	if(child > 0)
+		record_launch(launcher, &start);
+	return child;
+}
+pid_t launch_with_fork(struct command_node* command, struct launch_spec* spec){
+	// Copies the shell's page tables; needed when the child has to run
+	// shell code before (or instead of) exec. A child that can't exec says
+	// so on a status pipe (EOF: it did); if the cached path went stale the
+	// command is started again with the path looked up anew
+	pid_t child;
+	int status[2], error, retried = FALSE;
+	while(TRUE){
+		spec->status_fd = -1;
+		if(command->builtin == NULL && pipe2(status, O_CLOEXEC) == 0)
+			spec->status_fd = status[WRITE_END];
+		fflush(stdout);  // or the child would write the shell's pending output again
+		child = fork();
+		if(child == 0){
+			TRACE_COUNT = 0;  // the shell flushes its own records
+			if(spec->unused_fd >= 0)
+				close(spec->unused_fd);
+			exec_pipeline_stage(command, spec);
+		}
+		if(spec->status_fd < 0)
+			break;
+		close(status[WRITE_END]);
+		spec->status_fd = -1;
+		if(child < 0 || read(status[READ_END], &error, sizeof(error)) != sizeof(error))
+			error = 0;
+		close(status[READ_END]);
+		if(error == 0)
+			break;
+		waitpid(child, NULL, 0);
+		if(!retried && command->path != command->argv[0] && access(command->path, F_OK) < 0 && (command->path = path_cache_refresh(command->argv[0])) != NULL){
+			retried = TRUE;  // cached binary is gone
+			continue;
+		}
+		TRACE(TRACE_ERROR, "exec", child, error, "%s", command->argv[0]);
+		printf_error("Comando possívelmente invalido ou incompleto: %s", command->argv[0]);
+		fprintf(stderr, "->: %s\n", strerror(error));
+		return -1;
+	}
+	if(child < 0){
+		TRACE(TRACE_ERROR, "fork", 0, errno, "%s", command->argv[0]);
+		print_error("Erro ao criar processo");
+		perror("->");
+	}else{
+		TRACE(TRACE_DEBUG, "fork", child, 0, "%s", command->argv[0]);
+	}
+	return child;
+}
+pid_t launch_with_spawn(struct command_node* command, struct launch_spec* spec){
+	// posix_spawn shares the shell's memory with the child until it execs
+	// (glibc uses clone(CLONE_VM|CLONE_VFORK)), so starting a command costs
+	// the same no matter how big the shell is. The fd plumbing that
+	// exec_pipeline_stage does by hand is expressed as file actions.
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t signals;
+	pid_t child;
+	int error, i;
+	short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawnattr_init(&attr);
+	if(spec->pgid >= 0){
+		posix_spawnattr_setpgroup(&attr, spec->pgid);
+		flags |= POSIX_SPAWN_SETPGROUP;
+#if __GLIBC_PREREQ(2, 35)
+		if(spec->foreground)  // before fd 0 is replaced
+			posix_spawn_file_actions_addtcsetpgrp_np(&actions, SHELL_TERMINAL);
+#endif
+	}
+	if(spec->unused_fd >= 0)
+		posix_spawn_file_actions_addclose(&actions, spec->unused_fd);
+	if(spec->in_fd != STDIN_FILENO){
+		posix_spawn_file_actions_adddup2(&actions, spec->in_fd, STDIN_FILENO);
+		posix_spawn_file_actions_addclose(&actions, spec->in_fd);
+	}
+	if(spec->out_fd != STDOUT_FILENO){
+		posix_spawn_file_actions_adddup2(&actions, spec->out_fd, STDOUT_FILENO);
+		posix_spawn_file_actions_addclose(&actions, spec->out_fd);
+	}
+	for(i = 0; i < command->n_redirects; i++){  // the kernel does the work, nothing goes through the shell
+		struct redirect* redirect = &command->redirects[i];
+		if(redirect->type == REDIRECT_DUP)
+			posix_spawn_file_actions_adddup2(&actions, redirect->source_fd, redirect->fd);
+		else if(redirect->type == REDIRECT_CLOSE)
+			posix_spawn_file_actions_addclose(&actions, redirect->fd);
+		else
+			posix_spawn_file_actions_addopen(&actions, redirect->fd, redirect->file, redirect_open_flags(redirect->type), 0666);
+	}
+	child_default_signals(&signals);
+	posix_spawnattr_setsigdefault(&attr, &signals);
+	sigemptyset(&signals);
+	posix_spawnattr_setsigmask(&attr, &signals);
+	posix_spawnattr_setflags(&attr, flags);
+	error = posix_spawn(&child, command->path, &actions, &attr, command->argv, environ);
+	if(error == ENOENT && command->path != command->argv[0] && access(command->path, F_OK) < 0){  // cached binary is gone (not a redirect into a missing directory)
+		command->path = path_cache_refresh(command->argv[0]);
+		if(command->path != NULL)
+			error = posix_spawn(&child, command->path, &actions, &attr, command->argv, environ);
+	}
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	if(error != 0){
+		TRACE(TRACE_ERROR, "spawn", 0, error, "%s", command->argv[0]);
+		if(command->n_redirects > 0 && command->path != NULL && access(command->path, X_OK) == 0)
+			printf_error("Erro ao redirecionar: %s", command->argv[0]);  // a file action failed
+		else
+			printf_error("Comando possívelmente invalido ou incompleto: %s", command->argv[0]);
+		fprintf(stderr, "->: %s\n", strerror(error));
+		return -1;
+	}
+	TRACE(TRACE_DEBUG, "spawn", child, 0, "%s", command->path);
+	return child;
+}
+pid_t launch_with_zygote(struct command_node* command, struct launch_spec* spec){
+	// Hands the command to an idle helper: the shell only builds one
+	// message and sends it with the fds (SCM_RIGHTS); the helper sets
+	// itself up like a forked child and execs, or sends back the errno of
+	// a failed exec. The helper is already the shell's child, so it is
+	// reaped and timed like any other.
+	// Returns its pid, 0 when no helper could take it, -1 on error
+	struct zygote_request* request;
+	struct zygote_redirect* redirects;
+	struct msghdr message;
+	struct iovec iov;
+	struct cmsghdr* control;
+	char control_buffer[CMSG_SPACE(3*sizeof(int))];
+	size_t size;
+	char* strings;
+	int envc, cwd, error, i;
+	if(N_ZYGOTES == 0){
+		ZYGOTE_MISSES++;
+		ZYGOTE_USED++;
+		return 0;
+	}
+	size = sizeof(struct zygote_request) + command->n_redirects*sizeof(struct zygote_redirect) + strlen(command->path) + 1;
+	for(i = 0; i < command->argc; i++)
+		size += strlen(command->argv[i]) + 1;
+	for(envc = 0; environ[envc] != NULL; envc++)
+		size += strlen(environ[envc]) + 1;
+	for(i = 0; i < command->n_redirects; i++)
+		size += (command->redirects[i].file != NULL) ? strlen(command->redirects[i].file) + 1 : 0;
+	request = (struct zygote_request*) arena_alloc(&LINE_ARENA, size);
+	request->pgid = spec->pgid;
+	request->foreground = spec->foreground;
+	request->umask = umask(0);
+	umask(request->umask);
+	request->argc = command->argc;
+	request->envc = envc;
+	request->n_redirects = command->n_redirects;
+	redirects = (struct zygote_redirect*) (request + 1);
+	strings = stpcpy((char*) (redirects + command->n_redirects), command->path) + 1;
+	for(i = 0; i < command->argc; i++)
+		strings = stpcpy(strings, command->argv[i]) + 1;
+	for(i = 0; i < envc; i++)
+		strings = stpcpy(strings, environ[i]) + 1;
+	for(i = 0; i < command->n_redirects; i++){
+		redirects[i].type = command->redirects[i].type;
+		redirects[i].fd = command->redirects[i].fd;
+		redirects[i].source_fd = command->redirects[i].source_fd;
+		redirects[i].has_file = (command->redirects[i].file != NULL);
+		if(redirects[i].has_file)
+			strings = stpcpy(strings, command->redirects[i].file) + 1;
+	}
+	if((cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0){  // the helper has the cwd it was forked in
+		ZYGOTE_MISSES++;
+		ZYGOTE_USED++;
+		return 0;
+	}
+	memset(&message, 0, sizeof(message));
+	iov.iov_base = request;
+	iov.iov_len = size;
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control_buffer;
+	message.msg_controllen = sizeof(control_buffer);
+	control = CMSG_FIRSTHDR(&message);
+	control->cmsg_level = SOL_SOCKET;
+	control->cmsg_type = SCM_RIGHTS;
+	control->cmsg_len = CMSG_LEN(3*sizeof(int));
+	memcpy(CMSG_DATA(control), (int[]){spec->in_fd, spec->out_fd, cwd}, 3*sizeof(int));
+	while(N_ZYGOTES > 0){
+		struct zygote zygote = ZYGOTES[--N_ZYGOTES];  // the newest: its pages are the warmest
+		ssize_t sent = sendmsg(zygote.fd, &message, MSG_NOSIGNAL);
+		if(sent != (ssize_t) size || recv(zygote.fd, &error, sizeof(error), 0) != sizeof(error))
+			error = 0;  // EOF: its end of the socket closed on exec
+		close(zygote.fd);  // one command per helper
+		if(sent == (ssize_t) size && error != 0){
+			close(cwd);
+			waitpid(zygote.pid, NULL, 0);
+			TRACE(TRACE_ERROR, "zygote", zygote.pid, error, "%s", command->path);
+			ZYGOTE_MISSES++;
+			ZYGOTE_USED++;
+			return 0;  // spawn looks the path up again, or reports the error
+		}
+		if(sent == (ssize_t) size){
+			close(cwd);
+			ZYGOTE_HITS++;
+			ZYGOTE_USED++;
+			TRACE(TRACE_DEBUG, "zygote", zygote.pid, 0, "%s", command->path);
+			return zygote.pid;
+		}
+		TRACE(TRACE_ERROR, "zygote", zygote.pid, errno, "%s", command->path);
+		if(errno == EMSGSIZE)  // environment too big for one message
+			break;
+	}
+	close(cwd);
+	ZYGOTE_MISSES++;
+	ZYGOTE_USED++;
+	return 0;
+}
+void zygote_refill(){
+	// Called when the shell is about to sleep: sizes the pool to the recent
+	// demand (a peak that decays by a quarter per refill, plus one spare)
+	// and asks the spawner for what is missing (or forks it, without one).
+	// Helpers that are no longer wanted just get their socket closed and exit
+	int target, fds[2], i;
+	pid_t pid;
+	if(LAUNCHER != LAUNCHER_ZYGOTE){
+		zygote_reset();
+		return;
+	}
+	ZYGOTE_DEMAND = (ZYGOTE_USED > ZYGOTE_DEMAND - ZYGOTE_DEMAND/4) ? ZYGOTE_USED : ZYGOTE_DEMAND - ZYGOTE_DEMAND/4;
+	ZYGOTE_USED = 0;
+	target = ZYGOTE_DEMAND + 1;
+	if(target > ZYGOTE_POOL)
+		target = ZYGOTE_POOL;
+	if(target > MAX_ZYGOTE_POOL)
+		target = MAX_ZYGOTE_POOL;
+	while(N_ZYGOTES > target && N_ZYGOTES > 1)
+		close(ZYGOTES[--N_ZYGOTES].fd);
+	if(N_ZYGOTES < target)
+		fflush(stdout);  // or a helper that fails to exec would write it again
+	while(N_ZYGOTES < target){
+		if(ZYGOTE_SPAWNER >= 0 && (pid = zygote_from_spawner(&fds[0])) > 0){
+			ZYGOTES[N_ZYGOTES].pid = pid;
+			ZYGOTES[N_ZYGOTES].fd = fds[0];
+			N_ZYGOTES++;
+			TRACE(TRACE_DEBUG, "zygote_start", pid, N_ZYGOTES, "target=%d spawner", target);
+			continue;
+		}
+		if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0)
+			return;
+		pid = fork();
+		if(pid == 0){
+			TRACE_COUNT = 0;  // the shell flushes its own records
+			for(i = 0; i < N_ZYGOTES; i++)
+				close(ZYGOTES[i].fd);  // or the helpers would keep each other alive
+			close(fds[0]);
+			zygote_main(fds[1]);
+		}
+		close(fds[1]);
+		if(pid < 0){
+			close(fds[0]);
+			TRACE(TRACE_ERROR, "fork", 0, errno, "zygote");
+			return;
+		}
+		ZYGOTES[N_ZYGOTES].pid = pid;
+		ZYGOTES[N_ZYGOTES].fd = fds[0];
+		N_ZYGOTES++;
+		TRACE(TRACE_DEBUG, "zygote_start", pid, N_ZYGOTES, "target=%d", target);
+	}
+}
+void zygote_spawner_start(){
+	// Forks the spawner, for --launcher=zygote right after the options
+	// are read, before the shell maps its history, fills its caches and
+	// grows its arenas: the helpers are copies of this small process
+	// instead of the whole shell
+	int fds[2], i;
+	pid_t pid;
+	if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0)
+		return;
+	fflush(stdout);
+	pid = fork();
+	if(pid == 0){
+		TRACE_COUNT = 0;  // the shell flushes its own records
+		for(i = 0; i < N_ZYGOTES; i++)
+			close(ZYGOTES[i].fd);  // or the helpers would keep each other alive
+		close(fds[0]);
+		zygote_spawner_main(fds[1]);
+	}
+	close(fds[1]);
+	if(pid < 0){
+		close(fds[0]);
+		return;
+	}
+	ZYGOTE_SPAWNER = fds[0];
+}
+void zygote_spawner_main(int sock){
+	// Every byte the shell sends asks for one helper. It is forked with
+	// CLONE_PARENT, so it is the shell's child (reaped and timed like any
+	// other) while being a copy of this process; its pid and its end of
+	// the socket go back to the shell (pid -1: it could not be made).
+	// EOF: the shell exited or runs without the spawner now
+	struct msghdr message;
+	struct iovec iov;
+	struct cmsghdr* control;
+	char control_buffer[CMSG_SPACE(sizeof(int))];
+	char byte;
+	int fds[2];
+	pid_t pid;
+	signal(SIGINT, SIG_IGN);  // they are meant for the terminal's foreground job
+	signal(SIGQUIT, SIG_IGN);
+	signal(SIGTSTP, SIG_IGN);
+	signal(SIGTTIN, SIG_IGN);
+	signal(SIGTTOU, SIG_IGN);
+	while(read(sock, &byte, 1) == 1){
+		pid = -1;
+		fds[0] = fds[1] = -1;
+		if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) == 0){
+			pid = (pid_t) syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, NULL, NULL, 0);  // a fork, but a sibling
+			if(pid == 0){
+				close(sock);
+				close(fds[0]);
+				zygote_main(fds[1]);
+			}
+		}
+		memset(&message, 0, sizeof(message));
+		iov.iov_base = &pid;
+		iov.iov_len = sizeof(pid);
+		message.msg_iov = &iov;
+		message.msg_iovlen = 1;
+		if(pid > 0){
+			message.msg_control = control_buffer;
+			message.msg_controllen = sizeof(control_buffer);
+			control = CMSG_FIRSTHDR(&message);
+			control->cmsg_level = SOL_SOCKET;
+			control->cmsg_type = SCM_RIGHTS;
+			control->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(control), &fds[0], sizeof(int));
+		}
+		if(sendmsg(sock, &message, MSG_NOSIGNAL) < 0)
+			_exit(0);
+		if(fds[0] >= 0){
+			close(fds[0]);
+			close(fds[1]);
+		}
+	}
+	_exit(0);
+}
+pid_t zygote_from_spawner(int* fd){
+	// One helper from the spawner: its pid, and its socket in *fd. Returns
+	// -1 if there is none; a spawner that is gone is not asked again
+	struct msghdr message;
+	struct iovec iov;
+	struct cmsghdr* control;
+	char control_buffer[CMSG_SPACE(sizeof(int))];
+	pid_t pid = -1;
+	memset(&message, 0, sizeof(message));
+	iov.iov_base = &pid;
+	iov.iov_len = sizeof(pid);
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control_buffer;
+	message.msg_controllen = sizeof(control_buffer);
+	if(send(ZYGOTE_SPAWNER, "+", 1, MSG_NOSIGNAL) != 1 || recvmsg(ZYGOTE_SPAWNER, &message, MSG_CMSG_CLOEXEC) != sizeof(pid)){
+		TRACE(TRACE_ERROR, "zygote_spawner", 0, errno, "gone");
+		close(ZYGOTE_SPAWNER);
+		ZYGOTE_SPAWNER = -1;
+		return -1;
+	}
+	if(pid <= 0 || (control = CMSG_FIRSTHDR(&message)) == NULL)
+		return -1;
+	memcpy(fd, CMSG_DATA(control), sizeof(int));
+	return pid;
+}
+void zygote_main(int fd){
+	// The helper: sleeps in recvmsg until the shell sends a command, then
+	// moves to the shell's working directory and umask and becomes the
+	// command through the same code a forked child runs. EOF (the shell
+	// closed the socket or exited) means it is not needed
+	struct zygote_request* request;
+	struct zygote_redirect* redirects;
+	struct command_node command;
+	struct launch_spec spec;
+	struct msghdr message;
+	struct iovec iov;
+	struct cmsghdr* control;
+	char control_buffer[CMSG_SPACE(3*sizeof(int))];
+	char** envp;
+	char* strings;
+	ssize_t size;
+	int cwd, i;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	iov.iov_base = NULL;
+	iov.iov_len = 0;
+	size = recvmsg(fd, &message, MSG_PEEK | MSG_TRUNC);  // the size of the message
+	if(size <= 0)
+		_exit(0);
+	request = (struct zygote_request*) malloc(size);
+	iov.iov_base = request;
+	iov.iov_len = size;
+	message.msg_control = control_buffer;
+	message.msg_controllen = sizeof(control_buffer);
+	if(recvmsg(fd, &message, MSG_CMSG_CLOEXEC) != size || (control = CMSG_FIRSTHDR(&message)) == NULL)
+		_exit(127);
+	memcpy(&spec.in_fd, CMSG_DATA(control), sizeof(int));
+	memcpy(&spec.out_fd, CMSG_DATA(control) + sizeof(int), sizeof(int));
+	memcpy(&cwd, CMSG_DATA(control) + 2*sizeof(int), sizeof(int));
+	if(fchdir(cwd) < 0)
+		_exit(127);
+	close(cwd);
+	umask(request->umask);
+	spec.unused_fd = -1;
+	spec.status_fd = fd;  // CLOEXEC: the shell sees EOF on exec
+	spec.pgid = request->pgid;
+	spec.foreground = request->foreground;
+	spec.limits = NULL;  // limited jobs are forked
+	spec.cgroup_fd = -1;
+	memset(&command, 0, sizeof(command));
+	command.argc = request->argc;
+	command.argv = (char**) malloc(sizeof(char*)*(request->argc + 1));
+	command.n_redirects = request->n_redirects;
+	command.redirects = (struct redirect*) malloc(sizeof(struct redirect)*(request->n_redirects + 1));
+	envp = (char**) malloc(sizeof(char*)*(request->envc + 1));
+	redirects = (struct zygote_redirect*) (request + 1);
+	strings = (char*) (redirects + request->n_redirects);
+	command.path = strings;
+	strings += strlen(strings) + 1;
+	for(i = 0; i < request->argc; i++, strings += strlen(strings) + 1)
+		command.argv[i] = strings;
+	command.argv[i] = NULL;
+	for(i = 0; i < request->envc; i++, strings += strlen(strings) + 1)
+		envp[i] = strings;
+	envp[i] = NULL;
+	for(i = 0; i < request->n_redirects; i++){
+		command.redirects[i].type = (enum redirect_type) redirects[i].type;
+		command.redirects[i].fd = redirects[i].fd;
+		command.redirects[i].source_fd = redirects[i].source_fd;
+		command.redirects[i].file = NULL;
+		if(redirects[i].has_file){
+			command.redirects[i].file = strings;
+			strings += strlen(strings) + 1;
+		}
+	}
+	environ = envp;  // the shell's environment now, not the one it had at fork
+	exec_pipeline_stage(&command, &spec);
+}
+void zygote_forget(pid_t pid){
+	// A helper died while idle (killed from outside)
+	int i;
+	for(i = 0; i < N_ZYGOTES; i++){
+		if(ZYGOTES[i].pid == pid){
+			close(ZYGOTES[i].fd);
+			ZYGOTES[i] = ZYGOTES[--N_ZYGOTES];
+			return;
+		}
+	}
+}
+void zygote_reset(){
+	// Drops the pool: the helpers see EOF and exit. Also for a forked
+	// child, whose copies of the sockets must not reach the helpers
+	while(N_ZYGOTES > 0)
+		close(ZYGOTES[--N_ZYGOTES].fd);
+}
+void launcher_changed(){
+	if(ZYGOTE_POOL < 1)
+		ZYGOTE_POOL = 1;
+	if(EVENT_LOOP < 0)  // --launcher: main starts the spawner, the shell isn't set up yet
+		return;
+	if(LAUNCHER == LAUNCHER_ZYGOTE && ZYGOTE_SPAWNER < 0)
+		zygote_spawner_start();  // a copy of the grown shell, but made only once
+	zygote_refill();  // the first command already finds a helper
+}
+void record_launch(int launcher, struct timespec* start){
+	struct timespec now;
+	struct launch_stats* stats = &LAUNCH_STATS[launcher];
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	stats->samples[stats->count++ % LAUNCH_SAMPLES] = (now.tv_sec - start->tv_sec)*1000000000L + (now.tv_nsec - start->tv_nsec);
+}
+int compare_long(const void* a, const void* b){
+	long x = *(const long*) a, y = *(const long*) b;
+	return (x > y) - (x < y);
+}
+void child_default_signals(sigset_t* signals){
+	// Signals the shell ignores or handles that a command gets back as default
+	sigemptyset(signals);
+	sigaddset(signals, SIGPIPE);  // stop early when a later stage exits
+	sigaddset(signals, SIGCHLD);
+	sigaddset(signals, SIGINT);
+	sigaddset(signals, SIGQUIT);
+	sigaddset(signals, SIGTSTP);
+	sigaddset(signals, SIGTTIN);
+	sigaddset(signals, SIGTTOU);
+}
+void exec_pipeline_stage(struct command_node* command, struct launch_spec* spec){
+	// Runs in the child: joins the job's process group, wires stdin/stdout
+	// and never returns
+	sigset_t signals;
+	int sig;
+	if(spec->pgid >= 0){
+		setpgid(0, spec->pgid);
+		if(spec->foreground)
+			tcsetpgrp(SHELL_TERMINAL, getpgrp());
+	}
+	child_default_signals(&signals);
+	for(sig = 1; sig < NSIG; sig++){
+		if(sigismember(&signals, sig) == 1)
+			signal(sig, SIG_DFL);
+	}
+	sigemptyset(&signals);
+	sigprocmask(SIG_SETMASK, &signals, NULL);
+	if(spec->in_fd != STDIN_FILENO){
+		dup2(spec->in_fd, STDIN_FILENO);
+		close(spec->in_fd);
+	}
+	if(spec->out_fd != STDOUT_FILENO){
+		dup2(spec->out_fd, STDOUT_FILENO);
+		close(spec->out_fd);
+	}
+	if(apply_redirects(command, NULL) < 0){
+		fflush(stdout);
+		_exit(1);
+	}
+	if(spec->limits != NULL)
+		apply_job_limits(spec);
+	if(command->builtin != NULL){
+		int status;
+		event_loop_reset();
+		status = command->builtin->run(command->argv);
+		fflush(stdout);
+		trace_flush();  // what the builtin did (parallel starts jobs)
+		_exit(status);
+	}
+	TRACE(TRACE_DEBUG, "exec", getpid(), 0, "%s", command->path);
+	trace_flush();
+	execv(command->path, command->argv);
+	if(spec->status_fd >= 0){  // the shell retries a stale path or prints the error
+		int error = errno;
+		if(write(spec->status_fd, &error, sizeof(error)) == sizeof(error))
+			_exit(127);
+	}
+	TRACE(TRACE_ERROR, "exec", getpid(), errno, "%s", command->path);
+	trace_flush();
+	print_error("Comando possívelmente invalido ou incompleto:");
+	perror("->");
+	fflush(stdout);
+	_exit(127);
+}
+/*************************************** 
+ * Command Path Cache
+ ***************************************
+ ***************************************/
+char* path_cache_lookup(char* name){
+	// Resolves a command name to the executable that execvp would run, walking
+	// PATH only the first time a name is seen. Names with a '/' are used as is.
+	// The cache is dropped whenever PATH changes
+	struct path_cache_entry* entry;
+	char* path_env = variable_get("PATH");
+	if(strchr(name, '/') != NULL)
+		return name;
+	if(path_env == NULL)
+		path_env = DEFAULT_PATH;
+	if(PATH_CACHE.path_env == NULL || strcmp(PATH_CACHE.path_env, path_env) != 0){
+		path_cache_clear();
+		free(PATH_CACHE.path_env);
+		PATH_CACHE.path_env = strdup(path_env);
+	}
+	entry = path_cache_slot(name);
+	if(entry->path != NULL){
+		PATH_CACHE.hits++;
+		entry->hits++;
+		return entry->path;
+	}
+	PATH_CACHE.misses++;
+	entry->path = resolve_in_path(name, path_env);
+	if(entry->path == NULL)
+		return NULL;  // not cached: it may be installed later
+	if(entry->name == NULL){
+		entry->name = strdup(name);
+		entry->hits = 0;
+		PATH_CACHE.count++;
+		path_cache_grow();
+		return path_cache_slot(name)->path;
+	}
+	return entry->path;
+}
+char* path_cache_refresh(char* name){
+	// Forgets a stale entry and resolves it again
+	struct path_cache_entry* entry;
+	if(PATH_CACHE.slots != NULL){
+		entry = path_cache_slot(name);
+		free(entry->path);
+		entry->path = NULL;
+	}
+	return path_cache_lookup(name);
+}
+struct path_cache_entry* path_cache_slot(char* name){
+	// Slot holding 'name', or the empty slot where it would go
+	size_t i;
+	if(PATH_CACHE.slots == NULL){
+		PATH_CACHE.capacity = PATH_CACHE_INITIAL_CAPACITY;
+		PATH_CACHE.slots = (struct path_cache_entry*) calloc(PATH_CACHE.capacity, sizeof(struct path_cache_entry));
+	}
+	i = hash_string(name) & (PATH_CACHE.capacity - 1);
+	while(PATH_CACHE.slots[i].name != NULL && strcmp(PATH_CACHE.slots[i].name, name) != 0)
+		i = (i + 1) & (PATH_CACHE.capacity - 1);
+	return &PATH_CACHE.slots[i];
+}
+void path_cache_grow(){
+	// Keeps the load factor under 70%
+	struct path_cache_entry* old = PATH_CACHE.slots;
+	size_t old_capacity = PATH_CACHE.capacity, i;
+	if(PATH_CACHE.count*10 < PATH_CACHE.capacity*7)
+		return;
+	PATH_CACHE.capacity *= 2;
+	PATH_CACHE.slots = (struct path_cache_entry*) calloc(PATH_CACHE.capacity, sizeof(struct path_cache_entry));
+	for(i = 0; i < old_capacity; i++){
+		if(old[i].name != NULL)
+			*path_cache_slot(old[i].name) = old[i];
+	}
+	free(old);
+}
+void path_cache_clear(){
+	size_t i;
+	for(i = 0; i < PATH_CACHE.capacity; i++){
+		free(PATH_CACHE.slots[i].name);
+		free(PATH_CACHE.slots[i].path);
+	}
+	if(PATH_CACHE.slots != NULL)
+		memset(PATH_CACHE.slots, 0, sizeof(struct path_cache_entry)*PATH_CACHE.capacity);
+	PATH_CACHE.count = 0;
+}
+char* resolve_in_path(char* name, char* path_env){
+	// First executable regular file named 'name' in the PATH directories
+	// (an empty entry means the current directory). Returns a malloc'd path
+	size_t name_len = strlen(name);
+	char* dir = path_env;
+	struct stat info;
+	while(TRUE){
+		char* end = strchrnul(dir, ':');
+		size_t dir_len = end - dir;
+		char* candidate = (char*) malloc(dir_len + name_len + 3);
+		if(dir_len == 0){
+			candidate[0] = '.';
+			dir_len = 1;
+		}else
+			memcpy(candidate, dir, dir_len);
+		candidate[dir_len] = '/';
+		memcpy(candidate + dir_len + 1, name, name_len + 1);
+		if(stat(candidate, &info) == 0 && S_ISREG(info.st_mode) && access(candidate, X_OK) == 0)
+			return candidate;
+		free(candidate);
+		if(*end == '\0')
+			return NULL;
+		dir = end + 1;
+	}
+}
+unsigned long hash_string(char* str){
+	// FNV-1a
+	unsigned long hash = 14695981039346656037UL;
+	while(*str != '\0'){
+		hash ^= (unsigned char) *str++;
+		hash *= 1099511628211UL;
+	}
+	return hash;
+}
+/*************************************** 
+ * Output Cache
+ ***************************************
+ ***************************************/
+char* cache_directory(){
+	// cache-dir, or $XDG_CACHE_HOME/kshell, ~/.cache/kshell,
+	// /tmp/kshell-cache-UID; created on the first use. NULL if it can't be
+	static char directory[PATH_MAX];
+	char* base = variable_get("XDG_CACHE_HOME");
+	if(CACHE_DIR != NULL)
+		snprintf(directory, sizeof(directory), "%s", CACHE_DIR);
+	else if(base != NULL && *base != '\0')
+		snprintf(directory, sizeof(directory), "%s/kshell", base);
+	else if((base = variable_get("HOME")) != NULL && *base != '\0'){
+		snprintf(directory, sizeof(directory), "%s/.cache", base);
+		mkdir(directory, S_IRWXU);
+		snprintf(directory, sizeof(directory), "%s/.cache/kshell", base);
+	}else
+		snprintf(directory, sizeof(directory), "/tmp/kshell-cache-%d", (int) getuid());
+	if(mkdir(directory, S_IRWXU) < 0 && errno != EEXIST)
+		return NULL;
+	return directory;
+}
+char* cache_key(char** argv){
+	// Everything the output may depend on, as 'length:text' fields: argv,
+	// the working directory, the CACHE_ENV variables, and device, inode,
+	// size and mtime of the executable and of every argument that names a
+	// file (a directory changes mtime when an entry comes or goes)
+	char cwd[PATH_MAX];
+	struct stat info;
+	char* key = NULL, *value;
+	size_t len;
+	FILE* out = open_memstream(&key, &len);
+	int i;
+	for(i = 0; argv[i] != NULL; i++)
+		fprintf(out, "a%zu:%s", strlen(argv[i]), argv[i]);
+	if(getcwd(cwd, sizeof(cwd)) != NULL)
+		fprintf(out, "d%zu:%s", strlen(cwd), cwd);
+	for(i = 0; CACHE_ENV[i] != NULL; i++){
+		if((value = variable_get(CACHE_ENV[i])) != NULL)
+			fprintf(out, "e%s=%zu:%s", CACHE_ENV[i], strlen(value), value);
+	}
+	value = (find_command_builtin(argv) == NULL) ? path_cache_lookup(argv[0]) : NULL;
+	if(value != NULL && stat(value, &info) == 0)
+		fprintf(out, "x%lu.%lu.%ld.%ld.%ld", (unsigned long) info.st_dev, (unsigned long) info.st_ino, (long) info.st_size, (long) info.st_mtim.tv_sec, info.st_mtim.tv_nsec);
+	for(i = 1; argv[i] != NULL; i++){
+		if(stat(argv[i], &info) == 0)
+			fprintf(out, "f%d:%lu.%lu.%ld.%ld.%ld", i, (unsigned long) info.st_dev, (unsigned long) info.st_ino, (long) info.st_size, (long) info.st_mtim.tv_sec, info.st_mtim.tv_nsec);
+	}
+	fclose(out);
+	return key;
+}
+int cache_replay(char* path, char* key, long ttl_ms){
+	// Writes the output of the entry at 'path' to stdout straight from its
+	// mapping and marks it as recently used. Returns the stored status, or
+	// -1 if there is no valid entry for 'key' (another key with the same
+	// hash, expired, truncated...)
+	struct cache_header* header;
+	struct stat info;
+	struct timespec now;
+	char* map;
+	size_t key_len = strlen(key);
+	int fd = open(path, O_RDONLY | O_CLOEXEC), status = -1;
+	if(fd < 0)
+		return -1;
+	if(fstat(fd, &info) < 0 || info.st_size < (off_t) sizeof(struct cache_header)
+		|| (map = (char*) mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED){
+		close(fd);
+		return -1;
+	}
+	header = (struct cache_header*) map;
+	clock_gettime(CLOCK_REALTIME, &now);
+	if(memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 || header->key_len != key_len
+		|| (off_t) (sizeof(struct cache_header) + key_len + header->output_size) != info.st_size
+		|| memcmp(map + sizeof(struct cache_header), key, key_len) != 0){
+		status = -1;
+	}else if(ttl_ms > 0 && (now.tv_sec - header->created)*1000 > ttl_ms){
+		unlink(path);
+		CACHE_STATS.expired++;
+	}else{
+		write_all(STDOUT_FILENO, map + sizeof(struct cache_header) + key_len, header->output_size);
+		futimens(fd, NULL);  // LRU: mtime is the last use
+		status = header->status;
+	}
+	munmap(map, info.st_size);
+	close(fd);
+	return status;
+}
+void cache_store(char* directory, char* path, char* key, int output, int status){
+	// Writes the entry to a temporary file and renames it over 'path', so
+	// readers (other shells too) never see half of it. Then trims the store
+	struct cache_header header;
+	struct timespec now;
+	char* temporary = (char*) malloc(strlen(path) + 32);
+	int fd, ok;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+	clock_gettime(CLOCK_REALTIME, &now);
+	header.status = status;
+	header.key_len = strlen(key);
+	header.created = now.tv_sec;
+	header.output_size = lseek(output, 0, SEEK_END);
+	if(header.output_size + header.key_len > CACHE_SIZE){
+		free(temporary);
+		return;
+	}
+	sprintf(temporary, "%s.%d.tmp", path, (int) getpid());
+	fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if(fd < 0){
+		free(temporary);
+		return;
+	}
+	lseek(output, 0, SEEK_SET);
+	ok = write_all(fd, (char*) &header, sizeof(header)) == 0 && write_all(fd, key, header.key_len) == 0 && copy_fd(output, fd) == 0;
+	close(fd);
+	if(!ok || rename(temporary, path) < 0){
+		unlink(temporary);
+		free(temporary);
+		return;
+	}
+	free(temporary);
+	TRACE(TRACE_DEBUG, "cache_store", 0, (long) header.output_size, "%s", path);
+	cache_evict(directory, CACHE_SIZE);
+}
+void cache_evict(char* directory, off_t limit){
+	// Drops the least recently used entries (and temporary files left by
+	// a killed shell) until the store fits in 'limit' bytes
+	struct cache_file* files = NULL;
+	struct dirent* entry;
+	struct stat info;
+	off_t total = 0;
+	int n_files = 0, capacity = 0, i;
+	DIR* dir = opendir(directory);
+	if(dir == NULL)
+		return;
+	while((entry = readdir(dir)) != NULL){
+		if(strlen(entry->d_name) < 16 || strspn(entry->d_name, "0123456789abcdef") < 16 || strlen(entry->d_name) >= sizeof(files->name))
+			continue;
+		if(fstatat(dirfd(dir), entry->d_name, &info, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISREG(info.st_mode))
+			continue;
+		if(n_files == capacity){
+			capacity = (capacity == 0) ? 64 : capacity*2;
+			files = (struct cache_file*) realloc(files, capacity*sizeof(struct cache_file));
+		}
+		strcpy(files[n_files].name, entry->d_name);
+		files[n_files].size = info.st_blocks*512;
+		files[n_files].used = info.st_mtim;
+		total += files[n_files++].size;
+	}
+	if(total > limit)
+		qsort(files, n_files, sizeof(struct cache_file), compare_cache_file);
+	for(i = 0; i < n_files && total > limit; i++){
+		if(unlinkat(dirfd(dir), files[i].name, 0) < 0)
+			continue;
+		total -= files[i].size;
+		if(strlen(files[i].name) == 16)
+			CACHE_STATS.evictions++;
+	}
+	closedir(dir);
+	free(files);
+}
+int compare_cache_file(const void* a, const void* b){
+	// Oldest use first
+	const struct timespec* x = &((const struct cache_file*) a)->used;
+	const struct timespec* y = &((const struct cache_file*) b)->used;
+	if(x->tv_sec != y->tv_sec)
+		return (x->tv_sec < y->tv_sec) ? -1 : 1;
+	return (x->tv_nsec < y->tv_nsec) ? -1 : (x->tv_nsec > y->tv_nsec);
+}
+/*************************************** 
+ * Internal Commands
+ ***************************************
+ ***************************************/
+struct builtin* find_builtin(char* name){
+	// Binary search on BUILTINS; disabled builtins are not found
+	struct builtin* builtin = (struct builtin*) bsearch(name, BUILTINS, N_BUILTINS, sizeof(struct builtin), compare_builtin);
+	if(builtin == NULL || !builtin->enabled)
+		return NULL;
+	return builtin;
+}
+struct builtin* find_command_builtin(char** argv){
+	// The builtin that runs argv, or NULL for the external command: also
+	// when argv has an option the builtin does not implement
+	struct builtin* builtin = find_builtin(argv[0]);
+	int i;
+	if(builtin == NULL || builtin->options == NULL)
+		return builtin;
+	for(i = 1; argv[i] != NULL && strcmp(argv[i], "--") != 0; i++){
+		if(argv[i][0] == '-' && argv[i][1] != '\0' && strspn(argv[i] + 1, builtin->options) != strlen(argv[i] + 1))
+			return NULL;
+	}
+	return builtin;
+}
+int compare_builtin(const void* name, const void* builtin){
+	return strcmp((char*) name, ((struct builtin*) builtin)->name);
+}
+int run_builtin_in_shell(struct command_node* command){
+	// Runs a builtin in the shell process, with its redirections in place
+	// for the duration of the command only
+	int* saved = NULL;
+	int status;
+	if(command->n_redirects > 0){
+		saved = (int*) arena_alloc(&LINE_ARENA, sizeof(int)*command->n_redirects);
+		fflush(stdout);
+		if(apply_redirects(command, saved) < 0)
+			return 1;
+	}
+	status = command->builtin->run(command->argv);
+	if(saved != NULL){
+		fflush(stdout);
+		restore_redirects(command, saved, command->n_redirects);
+	}
+	return status;
+}
+int execute_internal_help(char** argv){
+	int i;
+	print_alert("-- Shell Internal Commands: --");
+	for(i = 0; i < N_BUILTINS; i++){
+		if(BUILTINS[i].enabled)
+			printf_alert("	%s", BUILTINS[i].usage);
+	}
+	return 0;
+}
+int execute_internal_close(char** argv){
+	SHELL_CLOSE_REQUESTED = TRUE;
+	return 0;
+}
+int execute_internal_last(char** argv){
+	// The line before this one
+	size_t len;
+	char* text = history_entry((HISTORY.current >= 0 ? HISTORY.current : (long) HISTORY.count) - 1, &len);
+	if(text == NULL)
+		return 1;
+	text = strndup(text, len);
+	print_alert(text);
+	free(text);
+	return 0;
+}
+int execute_internal_history(char** argv){
+	// 'history [N]': the last N lines (all of them), numbered for '!n';
+	// 'history search text': every line with text, through the trigram
+	// index (a plain scan for less than 3 bytes)
+	char* text, *pattern;
+	size_t len, pattern_len = 0;
+	long id, first = 0;
+	int i;
+	history_sync();
+	if(argv[1] != NULL && strcmp(argv[1], "search") == 0){
+		if(argv[2] == NULL){
+			print_error("history: uso: history search texto");
+			return 2;
+		}
+		for(i = 2; argv[i] != NULL; i++)  // the words, as typed
+			pattern_len += strlen(argv[i]) + 1;
+		pattern = (char*) malloc(pattern_len);
+		for(pattern_len = 0, i = 2; argv[i] != NULL; i++)
+			pattern_len += sprintf(pattern + pattern_len, (i > 2) ? " %s" : "%s", argv[i]);
+		for(id = history_next_match(pattern, pattern_len, 0); id >= 0; id = history_next_match(pattern, pattern_len, id + 1)){
+			text = history_entry(id, &len);
+			printf("%5ld  %.*s\n", id + 1, (int) len, text);
+		}
+		free(pattern);
+		return 0;
+	}
+	if(argv[1] != NULL){
+		char* end;
+		first = (long) HISTORY.count - strtol(argv[1], &end, 10);
+		if(*argv[1] == '\0' || *end != '\0'){
+			printf_error("history: numero invalido: %s", argv[1]);
+			return 2;
+		}
+		if(first < 0)
+			first = 0;
+	}
+	for(id = first; (text = history_entry(id, &len)) != NULL; id++)
+		printf("%5ld  %.*s\n", id + 1, (int) len, text);
+	return 0;
+}
+int execute_internal_arena(char** argv){
+	printf("\033[01;33m--> arena: %zu bytes in use, peak %zu, reserved %zu \033[0m\n",
+		LINE_ARENA.used, LINE_ARENA.peak, LINE_ARENA.reserved);
+	return 0;
+}
+int execute_internal_launchstat(char** argv){
+	// Percentiles of the time the shell spent starting each command (path
+	// lookup to launch returned), over the last LAUNCH_SAMPLES per launcher
+	long* sorted = (long*) arena_alloc(&LINE_ARENA, sizeof(long)*LAUNCH_SAMPLES);
+	int launcher, n;
+	if(argv[1] != NULL && strcmp(argv[1], "-r") == 0){
+		memset(LAUNCH_STATS, 0, sizeof(LAUNCH_STATS));
+		ZYGOTE_HITS = ZYGOTE_MISSES = 0;
+		return 0;
+	}
+	printf("%-8s %8s %10s %10s %10s %10s\n", "launcher", "count", "p50", "p90", "p99", "max");
+	for(launcher = 0; launcher < N_LAUNCHERS; launcher++){
+		struct launch_stats* stats = &LAUNCH_STATS[launcher];
+		if(stats->count == 0)
+			continue;
+		n = (stats->count < LAUNCH_SAMPLES) ? (int) stats->count : LAUNCH_SAMPLES;
+		memcpy(sorted, stats->samples, sizeof(long)*n);
+		qsort(sorted, n, sizeof(long), compare_long);
+		printf("%-8s %8ld %8.1fus %8.1fus %8.1fus %8.1fus\n", LAUNCHER_CHOICES[launcher], stats->count,
+			sorted[n*50/100]/1e3, sorted[n*90/100]/1e3, sorted[n*99/100]/1e3, sorted[n - 1]/1e3);
+	}
+	printf("\033[01;33m--> zygote: %d idle, %ld hits, %ld misses \033[0m\n", N_ZYGOTES, ZYGOTE_HITS, ZYGOTE_MISSES);
+	return 0;
+}
+int execute_internal_hash(char** argv){
+	size_t i;
+	int status = 0;
+	if(argv[1] != NULL && strcmp(argv[1], "-r") == 0){
+		path_cache_clear();
+		return 0;
+	}
+	if(argv[1] != NULL){  // resolves and remembers the given names
+		for(i = 1; argv[i] != NULL; i++){
+			if(path_cache_lookup(argv[i]) == NULL){
+				printf_error("hash: %s nao encontrado", argv[i]);
+				status = 1;
+			}
+		}
+		return status;
+	}
+	printf("hits\tcommand\n");
+	for(i = 0; i < PATH_CACHE.capacity; i++){
+		struct path_cache_entry* entry = &PATH_CACHE.slots[i];
+		if(entry->name != NULL && entry->path != NULL)
+			printf("%4lu\t%s\n", entry->hits, entry->path);
+	}
+	printf("\033[01;33m--> hash: %lu hits, %lu misses \033[0m\n", PATH_CACHE.hits, PATH_CACHE.misses);
+	return 0;
+}
+int execute_internal_enable(char** argv){
+	// 'enable -n name' makes 'name' run the external command again
+	int disable = FALSE, status = 0, i;
+	char** name = argv + 1;
+	if(*name != NULL && strcmp(*name, "-n") == 0){
+		disable = TRUE;
+		name++;
+	}
+	if(*name == NULL){
+		for(i = 0; i < N_BUILTINS; i++)
+			printf("enable %s%s\n", BUILTINS[i].enabled ? "" : "-n ", BUILTINS[i].name);
+		return 0;
+	}
+	for(; *name != NULL; name++){
+		struct builtin* builtin = (struct builtin*) bsearch(*name, BUILTINS, N_BUILTINS, sizeof(struct builtin), compare_builtin);
+		if(builtin == NULL){
+			printf_error("enable: %s nao e um comando interno", *name);
+			status = 1;
+		}else if(disable && builtin->special){
+			printf_error("enable: %s so existe no shell", *name);
+			status = 1;
+		}else
+			builtin->enabled = !disable;
+	}
+	return status;
+}
+int execute_internal_true(char** argv){
+	return 0;
+}
+int execute_internal_false(char** argv){
+	return 1;
+}
+int execute_internal_pwd(char** argv){
+	char* cwd = getcwd(NULL, 0);
+	if(cwd == NULL){
+		print_error("pwd");
+		perror("->");
+		return 1;
+	}
+	printf("%s\n", cwd);
+	free(cwd);
+	return 0;
+}
+int execute_internal_cd(char** argv){
+	char* dir = argv[1];
+	char* cwd;
+	if(dir == NULL)
+		dir = variable_get("HOME");
+	else if(strcmp(dir, "-") == 0){
+		dir = variable_get("OLDPWD");
+		if(dir != NULL)
+			printf("%s\n", dir);
+	}
+	if(dir == NULL){
+		print_error("cd: HOME/OLDPWD nao definido");
+		return 1;
+	}
+	cwd = getcwd(NULL, 0);
+	if(chdir(dir) < 0){
+		printf_error("cd: %s", dir);
+		perror("->");
+		free(cwd);
+		return 1;
+	}
+	if(cwd != NULL)
+		variable_set("OLDPWD", cwd, TRUE);
+	free(cwd);
+	cwd = getcwd(NULL, 0);
+	if(cwd != NULL)
+		variable_set("PWD", cwd, TRUE);
+	free(cwd);
+	return 0;
+}
+int execute_internal_echo(char** argv){
+	// Same options as coreutils echo: -n (no newline), -e/-E (escapes on/off)
+	int newline = TRUE, escapes = FALSE, i = 1;
+	char* flag;
+	while(argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0' && strspn(argv[i] + 1, "neE") == strlen(argv[i] + 1)){
+		for(flag = argv[i] + 1; *flag != '\0'; flag++){
+			if(*flag == 'n')
+				newline = FALSE;
+			else
+				escapes = (*flag == 'e');
+		}
+		i++;
+	}
+	for(; argv[i] != NULL; i++){
+		if(escapes){
+			if(!print_escaped(argv[i], FALSE))
+				return 0;  // '\c': stop printing
+		}else
+			fputs(argv[i], stdout);
+		if(argv[i + 1] != NULL)
+			putchar(' ');
+	}
+	if(newline)
+		putchar('\n');
+	return 0;
+}
+int execute_internal_printf(char** argv){
+	// Like printf(1): the format is reused while there are arguments left
+	char** args;
+	if(argv[1] == NULL){
+		print_error("printf: uso: printf <formato> [argumentos]");
+		return 2;
+	}
+	args = argv + 2;
+	while(TRUE){
+		char** before = args;
+		int status = printf_format(argv[1], &args);
+		if(status != 0)
+			return status;
+		if(*args == NULL || args == before)
+			return 0;
+	}
+}
+int printf_format(char* format, char*** args){
+	// Prints 'format' once, consuming the arguments its conversions need
+	char spec[32];
+	char* c = format;
+	while(*c != '\0'){
+		if(*c == '\\'){
+			c += print_escape(c, TRUE);
+			continue;
+		}
+		if(*c != '%'){
+			putchar(*c++);
+			continue;
+		}
+		if(c[1] == '%'){
+			putchar('%');
+			c += 2;
+			continue;
+		}
+		// %[flags][width][.precision]conversion
+		size_t len = 1 + strspn(c + 1, "-+ #0");
+		len += strspn(c + len, "0123456789");
+		if(c[len] == '.'){
+			len++;
+			len += strspn(c + len, "0123456789");
+		}
+		if(c[len] == '\0' || len + 4 > sizeof(spec)){
+			printf_error("printf: formato invalido: %s", format);
+			return 1;
+		}
+		char conversion = c[len];
+		char* arg = (**args != NULL) ? *(*args)++ : "";
+		memcpy(spec, c, len);
+		c += len + 1;
+		switch(conversion){
+			case 'd': case 'i':
+				sprintf(spec + len, "ll%c", conversion);
+				printf(spec, strtoll(arg, NULL, 0));
+				break;
+			case 'o': case 'u': case 'x': case 'X':
+				sprintf(spec + len, "ll%c", conversion);
+				printf(spec, strtoull(arg, NULL, 0));
+				break;
+			case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+				sprintf(spec + len, "%c", conversion);
+				printf(spec, strtod(arg, NULL));
+				break;
+			case 'c':
+				sprintf(spec + len, "c");
+				printf(spec, arg[0]);
+				break;
+			case 's':
+				sprintf(spec + len, "s");
+				printf(spec, arg);
+				break;
+			case 'b':  // string with escapes
+				if(!print_escaped(arg, FALSE)){
+					**args = NULL;  // '\c' stops all output
+					return 0;
+				}
+				break;
+			default:
+				printf_error("printf: conversao invalida: %s", format);
+				return 1;
+		}
+	}
+	return 0;
+}
+int print_escaped(char* str, int printf_style){
+	// Prints 'str' interpreting backslash escapes; FALSE if it had a '\c'
+	while(*str != '\0'){
+		if(*str == '\\'){
+			if(str[1] == 'c')
+				return FALSE;
+			str += print_escape(str, printf_style);
+		}else
+			putchar(*str++);
+	}
+	return TRUE;
+}
+int print_escape(char* escape, int printf_style){
+	// Prints the escape sequence starting at 'escape' (a backslash) and
+	// returns its length. Octal is \0nnn for echo and \nnn for printf
+	int value = 0, len = 1, max_digits = 3;
+	switch(escape[1]){
+		case 'a': putchar('\a'); return 2;
+		case 'b': putchar('\b'); return 2;
+		case 'e': putchar('\033'); return 2;
+		case 'f': putchar('\f'); return 2;
+		case 'n': putchar('\n'); return 2;
+		case 'r': putchar('\r'); return 2;
+		case 't': putchar('\t'); return 2;
+		case 'v': putchar('\v'); return 2;
+		case '\\': putchar('\\'); return 2;
+		case '\0': putchar('\\'); return 1;
+	}
+	if(!printf_style && escape[1] == '0')
+		len++;
+	else if(!(printf_style && escape[1] >= '0' && escape[1] <= '7')){
+		putchar('\\');  // not an escape
+		return 1;
+	}
+	while(max_digits-- > 0 && escape[len] >= '0' && escape[len] <= '7')
+		value = value*8 + (escape[len++] - '0');
+	putchar(value);
+	return len;
+}
+int execute_internal_cat(char** argv){
+	// cat [-u] [file|-...]: -u is the default, nothing is buffered
+	int i = 1, fd, status = 0;
+	while(argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'){
+		if(strcmp(argv[i++], "--") == 0)
+			break;
+	}
+	fflush(stdout);
+	if(argv[i] == NULL && copy_fd(STDIN_FILENO, STDOUT_FILENO) < 0){
+		perror("cat");
+		return 1;
+	}
+	for(; argv[i] != NULL; i++){
+		if(strcmp(argv[i], "-") == 0)
+			fd = STDIN_FILENO;
+		else if((fd = open(argv[i], O_RDONLY | O_CLOEXEC)) < 0){
+			fprintf(stderr, "cat: %s: %s\n", argv[i], strerror(errno));  // stdout carries the data
+			status = 1;
+			continue;
+		}
+		if(copy_fd(fd, STDOUT_FILENO) < 0){
+			fprintf(stderr, "cat: %s: %s\n", argv[i], strerror(errno));
+			status = 1;
+		}
+		if(fd != STDIN_FILENO)
+			close(fd);
+	}
+	return status;
+}
+int execute_internal_tee(char** argv){
+	// tee [-a] [file...]: stdin goes to stdout and to every file
+	int append = FALSE, i = 1, n, n_fds = 0, status = 0;
+	int* fds;
+	for(; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'; i++){
+		if(strcmp(argv[i], "--") == 0){
+			i++;
+			break;
+		}
+		append = TRUE;  // only -a gets here
+	}
+	for(n = i; argv[n] != NULL; n++);
+	fds = (int*) arena_alloc(&LINE_ARENA, sizeof(int)*(n - i + 1));
+	fds[n_fds++] = STDOUT_FILENO;
+	for(; argv[i] != NULL; i++){
+		int fd = open(argv[i], O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0666);
+		if(fd < 0){
+			fprintf(stderr, "tee: %s: %s\n", argv[i], strerror(errno));  // stdout carries the data
+			status = 1;
+			continue;
+		}
+		fds[n_fds++] = fd;
+	}
+	fflush(stdout);
+	if(tee_fds(fds, n_fds) < 0){
+		perror("tee");
+		status = 1;
+	}
+	for(i = 1; i < n_fds; i++)
+		close(fds[i]);
+	return status;
+}
+int copy_fd(int in_fd, int out_fd){
+	// Moves everything from in_fd to out_fd without bringing it to user
+	// space when the kernel can: splice when either side is a pipe,
+	// sendfile from a regular file to anything else. read/write is the
+	// last resort (a terminal on both sides, an O_APPEND file...).
+	// Returns 0 at EOF or -1 with errno set
+	char buffer[COPY_BUFFER_SIZE];
+	int how = 0;  // 0: splice, 1: sendfile, 2: read/write
+	ssize_t n;
+	while(TRUE){
+		if(how == 0)
+			n = splice(in_fd, NULL, out_fd, NULL, COPY_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+		else if(how == 1)
+			n = sendfile(out_fd, in_fd, NULL, COPY_CHUNK_SIZE);
+		else if((n = read(in_fd, buffer, sizeof(buffer))) > 0 && write_all(out_fd, buffer, n) < 0)
+			return -1;
+		if(n == 0)
+			return 0;
+		if(n < 0 && how < 2 && (errno == EINVAL || errno == ENOSYS)){
+			how++;  // this pair of fds can't do it
+			continue;
+		}
+		if(n < 0 && errno != EINTR)
+			return -1;
+	}
+}
+int tee_fds(int* fds, int n_fds){
+	// Copies stdin to fds[0] (stdout) and the rest. When stdin and stdout are
+	// pipes the bytes are duplicated with tee(2), which leaves them in stdin,
+	// then spliced to the files (regular files or pipes); the last one
+	// consumes them. Otherwise (or for O_APPEND files, which splice
+	// refuses) they go through a buffer.
+	// Returns 0 at EOF or -1 with errno set
+	char buffer[COPY_BUFFER_SIZE];
+	int scratch[2];  // for the files but the last: tee(2) works pipe to pipe
+	size_t* got = (size_t*) arena_alloc(&LINE_ARENA, sizeof(size_t)*n_fds);  // bytes of the chunk each file has
+	size_t done, from;
+	struct stat info;
+	ssize_t n = -1, m;
+	int i, moved = FALSE, short_tee;
+	if(n_fds == 1)
+		return copy_fd(STDIN_FILENO, STDOUT_FILENO);
+	for(i = 1; i < n_fds; i++){
+		if(fstat(fds[i], &info) < 0 || !(S_ISREG(info.st_mode) || S_ISFIFO(info.st_mode)) || (fcntl(fds[i], F_GETFL) & O_APPEND))
+			break;
+	}
+	errno = EINVAL;
+	if(i == n_fds && pipe2(scratch, O_CLOEXEC) == 0){
+		fcntl(scratch[WRITE_END], F_SETPIPE_SZ, fcntl(STDIN_FILENO, F_GETPIPE_SZ));  // holds whatever stdin holds
+		while((n = tee(STDIN_FILENO, STDOUT_FILENO, COPY_CHUNK_SIZE, 0)) > 0){
+			moved = TRUE;
+			short_tee = FALSE;
+			for(i = 1; i < n_fds - 1; i++){
+				if((m = tee(STDIN_FILENO, scratch[WRITE_END], n, 0)) < 0 || splice_all(scratch[READ_END], fds[i], m) < 0)
+					break;
+				got[i] = m;
+				short_tee |= (m < n);
+			}
+			if(i < n_fds - 1){
+				n = -1;
+				break;
+			}
+			if(!short_tee){
+				if(splice_all(STDIN_FILENO, fds[n_fds - 1], n) < 0){
+					n = -1;
+					break;
+				}
+				continue;
+			}
+			// tee(2) always starts at the head of stdin, so what a short
+			// one left out is read from stdin and written from the buffer
+			got[n_fds - 1] = 0;
+			for(done = 0; done < (size_t) n; done += m){
+				m = read(STDIN_FILENO, buffer, ((size_t) n - done < sizeof(buffer)) ? (size_t) n - done : sizeof(buffer));
+				if(m < 0 && errno == EINTR){
+					m = 0;
+					continue;
+				}
+				if(m <= 0)
+					break;
+				for(i = 1; i < n_fds; i++){
+					from = (got[i] > done) ? got[i] : done;
+					if(from < done + m && write_all(fds[i], buffer + (from - done), done + m - from) < 0)
+						break;
+				}
+				if(i < n_fds)
+					break;
+			}
+			if(done < (size_t) n){
+				n = -1;
+				break;
+			}
+		}
+		close(scratch[READ_END]);
+		close(scratch[WRITE_END]);
+		if(n >= 0)
+			return 0;
+	}
+	if(moved || errno != EINVAL)
+		return -1;
+	while((n = read(STDIN_FILENO, buffer, sizeof(buffer))) != 0){  // not pipes: the plain way
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0)
+			return -1;
+		for(i = 0; i < n_fds; i++){
+			if(write_all(fds[i], buffer, n) < 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+int splice_all(int in_fd, int out_fd, size_t len){
+	// splice exactly 'len' bytes (they are known to be in the pipe)
+	ssize_t n;
+	while(len > 0){
+		n = splice(in_fd, NULL, out_fd, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+int write_all(int fd, char* data, size_t len){
+	ssize_t n;
+	while(len > 0){
+		n = write(fd, data, len);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0)
+			return -1;
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+int execute_internal_filters(char** argv){
+	// filters stage ['|' stage...]: what fuse-filters makes of a run of
+	// grep, head, wc and cut stages. The lines go through the stages in
+	// this one process; the exit status is the last stage's, as for the
+	// pipeline
+	struct filter_chain chain;
+	char* buffer, *locale;
+	size_t capacity = FILTER_BUFFER_SIZE, used = 0, done;
+	ssize_t n;
+	int i, start, status;
+	chain.n_stages = 1;
+	for(i = 1; argv[i] != NULL; i++)
+		chain.n_stages += (strcmp(argv[i], "|") == 0);
+	chain.stages = (struct filter_stage*) calloc(chain.n_stages, sizeof(struct filter_stage));
+	chain.n_stages = 0;
+	chain.done = FALSE;
+	for(start = i = 1; TRUE; i++){
+		if(argv[i] != NULL && strcmp(argv[i], "|") != 0)
+			continue;
+		if(i == start || !filter_compile(argv + start, i - start, &chain.stages[chain.n_stages])){
+			fprintf(stderr, "filters: estagio nao suportado: %s\n", (i > start) ? argv[start] : "(vazio)");
+			free(chain.stages);
+			return 2;
+		}
+		chain.done |= chain.stages[chain.n_stages++].closed;  // head -n 0
+		if(argv[i] == NULL)
+			break;
+		start = i + 1;
+	}
+	// grep checks the encoding in a UTF-8 locale, the one its environment
+	// would give it
+	if((locale = getenv("LC_ALL")) == NULL || *locale == '\0')
+		locale = getenv("LC_CTYPE");
+	if(locale == NULL || *locale == '\0')
+		locale = getenv("LANG");
+	chain.utf8 = locale != NULL && (strcasestr(locale, "UTF-8") != NULL || strcasestr(locale, "UTF8") != NULL);
+	chain.out = (char*) malloc(FILTER_OUTPUT_SIZE);
+	chain.out_len = 0;
+	buffer = (char*) malloc(capacity);
+	fflush(stdout);
+	while(!chain.done && (n = read(STDIN_FILENO, buffer + used, capacity - used)) != 0){
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0){
+			perror("filters");
+			break;
+		}
+		used += n;
+		done = filter_lines(&chain, buffer, used);
+		memmove(buffer, buffer + done, used - done);
+		used -= done;
+		if(used == capacity){  // a line longer than the buffer
+			capacity *= 2;
+			buffer = (char*) realloc(buffer, capacity);
+		}
+		filter_flush(&chain);  // what came so far goes on, like a pipe would take it
+	}
+	if(!chain.done && used > 0)  // last line, without '\n'
+		filter_line(&chain, 0, buffer, used, FALSE);
+	filter_finish(&chain);
+	filter_flush(&chain);
+	status = (chain.stages[chain.n_stages - 1].type == FILTER_GREP && !chain.stages[chain.n_stages - 1].selected) ? 1 : 0;
+	for(i = 0; i < chain.n_stages; i++)
+		free(chain.stages[i].line);
+	free(chain.stages);
+	free(chain.out);
+	free(buffer);
+	return status;
+}
+int filter_compile(char** argv, int argc, struct filter_stage* stage){
+	// Fills 'stage' from a grep, head, wc or cut command. FALSE for any
+	// option or pattern it doesn't do exactly like GNU grep, head, wc and
+	// cut: that command stays external
+	char* c;
+	char option;
+	int i, fixed = FALSE;
+	memset(stage, 0, sizeof(struct filter_stage));
+	if(strcmp(argv[0], "grep") == 0){  // grep [-vF] pattern
+		stage->type = FILTER_GREP;
+		for(i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++){
+			for(c = argv[i] + 1; *c != '\0'; c++){
+				if(*c == 'v')
+					stage->invert = TRUE;
+				else if(*c == 'F')
+					fixed = TRUE;
+				else
+					return FALSE;
+			}
+		}
+		if(i != argc - 1 || strchr(argv[i], '\n') != NULL)  // one pattern, no files
+			return FALSE;
+		if(!fixed && strpbrk(argv[i], ".[\\*^$") != NULL)  // a basic regular expression
+			return FALSE;
+		stage->pattern = argv[i];
+		stage->pattern_len = strlen(argv[i]);
+		return TRUE;
+	}
+	if(strcmp(argv[0], "head") == 0){  // head [-n N | -nN | -N]
+		stage->type = FILTER_HEAD;
+		stage->left = 10;
+		if(argc == 1)
+			return TRUE;
+		if(argc == 3 && strcmp(argv[1], "-n") == 0)
+			c = argv[2];
+		else if(argc == 2 && argv[1][0] == '-')
+			c = argv[1] + 1 + (argv[1][1] == 'n');
+		else
+			return FALSE;
+		if(*c == '\0' || strspn(c, "0123456789") != strlen(c))
+			return FALSE;
+		stage->left = strtol(c, NULL, 10);
+		stage->closed = (stage->left == 0);
+		return TRUE;
+	}
+	if(strcmp(argv[0], "wc") == 0){  // wc -l, -c or both
+		stage->type = FILTER_WC;
+		for(i = 1; i < argc; i++){
+			if(argv[i][0] != '-' || argv[i][1] == '\0')
+				return FALSE;
+			for(c = argv[i] + 1; *c != '\0'; c++){
+				if(*c == 'l')
+					stage->lines = TRUE;
+				else if(*c == 'c')
+					stage->bytes = TRUE;
+				else
+					return FALSE;
+			}
+		}
+		return stage->lines || stage->bytes;
+	}
+	if(strcmp(argv[0], "cut") == 0){  // cut [-d X] -f LIST
+		stage->type = FILTER_CUT;
+		stage->delimiter = '\t';
+		for(i = 1; i < argc; i++){
+			option = argv[i][1];
+			if(argv[i][0] != '-' || (option != 'd' && option != 'f'))
+				return FALSE;
+			if((c = (argv[i][2] != '\0') ? argv[i] + 2 : (i + 1 < argc) ? argv[++i] : NULL) == NULL)
+				return FALSE;
+			if(option == 'f' && !filter_parse_fields(c, stage))
+				return FALSE;
+			if(option == 'd' && (strlen(c) != 1 || (unsigned char) *c >= 0x80))  // one byte, in any locale
+				return FALSE;
+			if(option == 'd')
+				stage->delimiter = *c;
+		}
+		return stage->fields_from > 0 || stage->last_field > 0;
+	}
+	return FALSE;
+}
+int filter_parse_fields(char* list, struct filter_stage* stage){
+	// cut -f: N, N-M, N- and -M, comma separated, counted from 1
+	char* c = list;
+	long from, to, n;
+	while(TRUE){
+		from = 1;
+		if(*c >= '0' && *c <= '9')
+			from = strtol(c, &c, 10);
+		else if(*c != '-')
+			return FALSE;
+		to = from;
+		if(*c == '-'){
+			c++;
+			to = (*c >= '0' && *c <= '9') ? strtol(c, &c, 10) : 0;  // 0: no end
+		}
+		if(from < 1 || (to != 0 && to < from) || to >= FILTER_MAX_FIELDS)
+			return FALSE;
+		if(to == 0 && (stage->fields_from == 0 || from < stage->fields_from))
+			stage->fields_from = from;
+		for(n = from; n <= to; n++)
+			stage->fields[n/8] |= 1 << (n % 8);
+		if(to > stage->last_field)
+			stage->last_field = to;
+		if(*c == '\0')
+			return TRUE;
+		if(*c++ != ',')
+			return FALSE;
+	}
+}
+size_t filter_lines(struct filter_chain* chain, char* data, size_t len){
+	// Sends the complete lines in data through the chain and returns how
+	// many bytes they take. When the first stage is a grep, memmem jumps
+	// from match to match and the lines in between are never looked at.
+	// Like GNU grep, it looks for NUL bytes in all it read: from the read
+	// that has one, the input is binary
+	struct filter_stage* grep = &chain->stages[0];
+	char* c = data, *end, *line, *newline, *match;
+	if((end = (char*) memrchr(data, '\n', len)) == NULL)
+		return 0;
+	end++;
+	if(grep->type == FILTER_GREP && !grep->binary && memchr(data, '\0', end - data) != NULL)
+		grep->binary = TRUE;
+	if(grep->type == FILTER_GREP && !grep->invert && grep->pattern_len > 0 && !grep->binary){
+		while(!chain->done && (match = (char*) memmem(c, end - c, grep->pattern, grep->pattern_len)) != NULL){
+			line = (char*) memrchr(c, '\n', match - c);
+			line = (line != NULL) ? line + 1 : c;
+			newline = (char*) memchr(match, '\n', end - match);
+			filter_line(chain, 0, line, newline - line, TRUE);
+			c = newline + 1;
+		}
+		return end - data;
+	}
+	for(; !chain->done && c < end; c = newline + 1){
+		newline = (char*) memchr(c, '\n', end - c);
+		filter_line(chain, 0, c, newline - c, TRUE);
+	}
+	return end - data;
+}
+void filter_line(struct filter_chain* chain, int i, char* line, size_t len, int newline){
+	// One line (without its '\n'; only the last line of the input may not
+	// have one) into stage i and on; after the last stage it is written
+	struct filter_stage* stage;
+	for(; i < chain->n_stages; i++){
+		stage = &chain->stages[i];
+		if(stage->closed)
+			return;
+		switch(stage->type){
+			case FILTER_GREP:
+				if(memchr(line, '\0', len) != NULL)
+					stage->binary = TRUE;
+				if((memmem(line, len, stage->pattern, stage->pattern_len) != NULL) == stage->invert)
+					return;
+				stage->selected = TRUE;
+				if(stage->binary){  // GNU grep stops at the first one
+					write_all(STDERR_FILENO, GREP_BINARY_MESSAGE, strlen(GREP_BINARY_MESSAGE));
+					stage->closed = chain->done = TRUE;
+					return;
+				}
+				if(chain->utf8 && !utf8_valid(line, len)){  // left out, grep goes on
+					stage->suppressed = TRUE;
+					return;
+				}
+				newline = TRUE;  // grep ends every line it writes
+				break;
+			case FILTER_HEAD:
+				if(--stage->left == 0)
+					stage->closed = chain->done = TRUE;
+				break;
+			case FILTER_WC:
+				stage->n_lines += newline;
+				stage->n_bytes += len + newline;
+				return;
+			case FILTER_CUT:
+				line = filter_cut(stage, line, &len);
+				newline = TRUE;
+				break;
+		}
+	}
+	filter_write(chain, line, len);
+	if(newline)
+		filter_write(chain, "\n", 1);
+}
+char* filter_cut(struct filter_stage* stage, char* line, size_t* len){
+	// The selected fields of the line joined by the delimiter (in
+	// stage->line); a line without the delimiter comes back whole
+	char* c = line, *end = line + *len, *field_end;
+	size_t o = 0;
+	long n;
+	int selected = 0;
+	if(memchr(line, stage->delimiter, *len) == NULL)
+		return line;
+	if(stage->line_capacity < *len){
+		stage->line_capacity = 2*(*len);
+		stage->line = (char*) realloc(stage->line, stage->line_capacity);
+	}
+	for(n = 1; c <= end && (stage->fields_from > 0 || n <= stage->last_field); n++){
+		if((field_end = (char*) memchr(c, stage->delimiter, end - c)) == NULL)
+			field_end = end;
+		if((stage->fields_from > 0 && n >= stage->fields_from) || (n < FILTER_MAX_FIELDS && stage->fields[n/8] & (1 << (n % 8)))){
+			if(selected++ > 0)
+				stage->line[o++] = stage->delimiter;
+			memcpy(stage->line + o, c, field_end - c);
+			o += field_end - c;
+		}
+		c = field_end + 1;
+	}
+	*len = o;
+	return stage->line;
+}
+void filter_finish(struct filter_chain* chain){
+	// End of the input: each wc, in order, sends its counts to the stages
+	// after it (GNU wc pads them to 7 when there are two), and a grep that
+	// left lines out says so
+	struct filter_stage* stage;
+	char text[48];
+	int i, len;
+	for(i = 0; i < chain->n_stages; i++){
+		stage = &chain->stages[i];
+		if(stage->type == FILTER_GREP && stage->suppressed && !stage->closed)
+			write_all(STDERR_FILENO, GREP_BINARY_MESSAGE, strlen(GREP_BINARY_MESSAGE));
+		if(stage->type != FILTER_WC)
+			continue;
+		if(stage->lines && stage->bytes)
+			len = sprintf(text, "%7ld %7ld", stage->n_lines, stage->n_bytes);
+		else
+			len = sprintf(text, "%ld", stage->lines ? stage->n_lines : stage->n_bytes);
+		filter_line(chain, i + 1, text, len, TRUE);
+	}
+}
+void filter_write(struct filter_chain* chain, char* data, size_t len){
+	if(chain->out_len + len > FILTER_OUTPUT_SIZE)
+		filter_flush(chain);
+	if(len > FILTER_OUTPUT_SIZE){
+		if(write_all(STDOUT_FILENO, data, len) < 0)
+			chain->done = TRUE;
+		return;
+	}
+	memcpy(chain->out + chain->out_len, data, len);
+	chain->out_len += len;
+}
+void filter_flush(struct filter_chain* chain){
+	if(chain->out_len > 0 && write_all(STDOUT_FILENO, chain->out, chain->out_len) < 0)
+		chain->done = TRUE;  // the reader is gone (with SIGPIPE ignored)
+	chain->out_len = 0;
+}
+int utf8_valid(char* text, size_t len){
+	// Well formed UTF-8: no overlong forms, surrogates or code points over
+	// U+10FFFF. ASCII is skipped 8 bytes at a time
+	const unsigned char* c = (const unsigned char*) text, *end = c + len;
+	uint64_t word;
+	int n, i;
+	while(c < end){
+		if(end - c >= 8){
+			memcpy(&word, c, 8);
+			if((word & 0x8080808080808080ULL) == 0){
+				c += 8;
+				continue;
+			}
+		}
+		if(*c < 0x80){
+			c++;
+			continue;
+		}
+		if(*c >= 0xC2 && *c <= 0xDF)
+			n = 1;
+		else if(*c >= 0xE0 && *c <= 0xEF)
+			n = 2;
+		else if(*c >= 0xF0 && *c <= 0xF4)
+			n = 3;
+		else
+			return FALSE;
+		if(end - c <= n || (*c == 0xE0 && c[1] < 0xA0) || (*c == 0xED && c[1] > 0x9F) || (*c == 0xF0 && c[1] < 0x90) || (*c == 0xF4 && c[1] > 0x8F))
+			return FALSE;
+		for(i = 1; i <= n; i++){
+			if((c[i] & 0xC0) != 0x80)
+				return FALSE;
+		}
+		c += n + 1;
+	}
+	return TRUE;
+}
+int execute_internal_test(char** argv){
+	// test/[ following the POSIX rules for 0 to 4 arguments
+	int argc = 0;
+	while(argv[argc] != NULL)
+		argc++;
+	if(strcmp(argv[0], "[") == 0){
+		if(strcmp(argv[argc - 1], "]") != 0){
+			print_error("[: falta ']'");
+			return 2;
+		}
+		argc--;
+	}
+	return test_expression(argv + 1, argc - 1);
+}
+int test_expression(char** args, int n){
+	// 0: true, 1: false, 2: error
+	struct stat info;
+	int status;
+	if(n == 0)
+		return 1;
+	if(n == 1)
+		return args[0][0] == '\0';
+	if(strcmp(args[0], "!") == 0 && n != 3){
+		status = test_expression(args + 1, n - 1);
+		return status == 2 ? 2 : !status;
+	}
+	if(n == 2){
+		char* op = args[0];
+		char* arg = args[1];
+		if(strcmp(op, "-n") == 0) return arg[0] == '\0';
+		if(strcmp(op, "-z") == 0) return arg[0] != '\0';
+		if(strcmp(op, "-L") == 0 || strcmp(op, "-h") == 0)
+			return !(lstat(arg, &info) == 0 && S_ISLNK(info.st_mode));
+		if(strcmp(op, "-r") == 0) return access(arg, R_OK) != 0;
+		if(strcmp(op, "-w") == 0) return access(arg, W_OK) != 0;
+		if(strcmp(op, "-x") == 0) return access(arg, X_OK) != 0;
+		if(op[0] != '-' || op[1] == '\0' || op[2] != '\0' || strchr("efdsbcpS", op[1]) == NULL){
+			printf_error("test: operador desconhecido: %s", op);
+			return 2;
+		}
+		if(stat(arg, &info) < 0)
+			return 1;
+		switch(op[1]){
+			case 'e': return 0;
+			case 'f': return !S_ISREG(info.st_mode);
+			case 'd': return !S_ISDIR(info.st_mode);
+			case 's': return !(info.st_size > 0);
+			case 'b': return !S_ISBLK(info.st_mode);
+			case 'c': return !S_ISCHR(info.st_mode);
+			case 'p': return !S_ISFIFO(info.st_mode);
+			default: return !S_ISSOCK(info.st_mode);
+		}
+	}
+	if(n == 3){
+		char* op = args[1];
+		long long left, right;
+		char* end_left;
+		char* end_right;
+		if(strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(args[0], args[2]) != 0;
+		if(strcmp(op, "!=") == 0) return strcmp(args[0], args[2]) == 0;
+		if(strcmp(args[0], "!") == 0){
+			status = test_expression(args + 1, 2);
+			return status == 2 ? 2 : !status;
+		}
+		left = strtoll(args[0], &end_left, 10);
+		right = strtoll(args[2], &end_right, 10);
+		if(args[0][0] == '\0' || *end_left != '\0' || args[2][0] == '\0' || *end_right != '\0'){
+			print_error("test: esperado um numero inteiro");
+			return 2;
+		}
+		if(strcmp(op, "-eq") == 0) return !(left == right);
+		if(strcmp(op, "-ne") == 0) return !(left != right);
+		if(strcmp(op, "-lt") == 0) return !(left < right);
+		if(strcmp(op, "-le") == 0) return !(left <= right);
+		if(strcmp(op, "-gt") == 0) return !(left > right);
+		if(strcmp(op, "-ge") == 0) return !(left >= right);
+		printf_error("test: operador desconhecido: %s", op);
+		return 2;
+	}
+	print_error("test: argumentos demais");
+	return 2;
+}
+int execute_internal_jobs(char** argv){
+	// 'jobs -l' also lists the pids of every process
+	struct job* job;
+	struct job* next;
+	int long_format = (argv[1] != NULL && strcmp(argv[1], "-l") == 0);
+	int i;
+	for(job = TAILQ_FIRST(&JOBS); job != NULL; job = next){
+		next = TAILQ_NEXT(job, next);
+		printf("[%d]%c %-10s %s%s\n", job->id, next == NULL ? '+' : ' ', job_state_text(job),
+			job->text, job->background ? " &" : "");
+		for(i = 0; long_format && i < job->n_processes; i++)
+			printf("      %d\n", job->processes[i].pid);
+		if(job->state == JOB_DONE)
+			job_remove(job);
+		else if(job->state == JOB_STOPPED)
+			job->notified = TRUE;
+	}
+	return 0;
+}
+int execute_internal_jobstat(char** argv){
+	// Per job (or only %job): its limits and, from its cgroup, the CPU it
+	// used (and how long cpu.max held it back) and its memory and processes
+	struct job* job;
+	struct job* only = NULL;
+	char limits[256], stat[1024], value[64];
+	char* line;
+	char* save;
+	long usage, user, system, throttled, throttled_usec;
+	if(argv[1] != NULL && (only = find_job(argv[1])) == NULL)
+		return 1;
+	TAILQ_FOREACH(job, &JOBS, next){
+		if(only != NULL && job != only)
+			continue;
+		format_job_limits(limits, sizeof(limits), &job->limits);
+		printf("[%d]  %-10s %s\n", job->id, job_state_text(job), job->text);
+		printf("      limits: %s\n", job->limited && limits[0] != '\0' ? limits : "none");
+		if(job->cgroup == NULL){
+			if(job->limited)
+				printf("      cgroup: none (rlimits only)\n");
+			continue;
+		}
+		printf("      cgroup: %s\n", job->cgroup);
+		if(cgroup_read(job->cgroup, "cpu.stat", stat, sizeof(stat)) > 0){
+			usage = user = system = throttled_usec = 0;
+			throttled = -1;  // only with the cpu controller
+			for(line = strtok_r(stat, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)){
+				sscanf(line, "usage_usec %ld", &usage);
+				sscanf(line, "user_usec %ld", &user);
+				sscanf(line, "system_usec %ld", &system);
+				sscanf(line, "nr_throttled %ld", &throttled);
+				sscanf(line, "throttled_usec %ld", &throttled_usec);
+			}
+			printf("      cpu: %.3fs (user %.3fs, sys %.3fs)", usage/1e6, user/1e6, system/1e6);
+			if(throttled >= 0)
+				printf(", throttled %ld times, %.3fs", throttled, throttled_usec/1e6);
+			printf("\n");
+		}
+		if(cgroup_read(job->cgroup, "memory.current", value, sizeof(value)) > 0){
+			printf("      memory: %.1fM", atol(value)/1048576.0);
+			if(cgroup_read(job->cgroup, "memory.peak", value, sizeof(value)) > 0)  // Linux 5.19+
+				printf(" (peak %.1fM)", atol(value)/1048576.0);
+			printf("\n");
+		}
+		if(cgroup_read(job->cgroup, "pids.current", value, sizeof(value)) > 0)
+			printf("      pids: %ld\n", atol(value));
+	}
+	return 0;
+}
+int execute_internal_wait(char** argv){
+	// Without arguments waits for every background job (queued ones too);
+	// returns the exit status of the last job waited for
+	struct job* job;
+	int status = 0, i, pending;
+	if(argv[1] == NULL){
+		do{
+			pending = FALSE;
+			TAILQ_FOREACH(job, &JOBS, next){
+				if(job->background && (job->state == JOB_RUNNING || job->state == JOB_QUEUED))
+					pending = TRUE;
+			}
+			if(pending)
+				event_loop_run(FALSE);  // also starts the queued ones
+		}while(pending);
+		notify_jobs();
+		return 0;
+	}
+	for(i = 1; argv[i] != NULL; i++){
+		job = find_job(argv[i]);
+		if(job == NULL){
+			status = 127;
+			continue;
+		}
+		while(job->state == JOB_RUNNING || job->state == JOB_QUEUED)
+			event_loop_run(FALSE);
+		status = (job->state == JOB_STOPPED) ? 128 + SIGTSTP : job_exit_status(job);
+		if(job->state == JOB_DONE)
+			job_remove(job);
+	}
+	return status;
+}
+int execute_internal_fg(char** argv){
+	// Brings a job to the foreground (starting it if it was queued)
+	struct job* job = find_job(argv[1]);
+	if(job == NULL || job->state == JOB_DONE){
+		if(job == NULL && argv[1] == NULL)
+			print_error("fg: nenhum job");
+		return 1;
+	}
+	printf("%s\n", job->text);
+	job->background = FALSE;
+	if(job->state == JOB_QUEUED){
+		start_pipeline(job->pipeline, job);
+		free_pipeline_copy(job->pipeline);
+		job->pipeline = NULL;
+		job_update_state(job);
+	}else{
+		if(JOB_CONTROL)
+			tcsetpgrp(SHELL_TERMINAL, job->pgid);
+		continue_job(job);
+	}
+	return wait_for_job(job);
+}
+int execute_internal_bg(char** argv){
+	// Resumes a stopped job in the background
+	struct job* job = find_job(argv[1]);
+	if(job == NULL || job->state != JOB_STOPPED){
+		if(job != NULL)
+			printf_error("bg: job %s nao esta parado", job->text);
+		else if(argv[1] == NULL)
+			print_error("bg: nenhum job");
+		return 1;
+	}
+	job->background = TRUE;
+	continue_job(job);
+	printf("[%d] %s &\n", job->id, job->text);
+	return 0;
+}
+int execute_internal_set(char** argv){
+	// 'set -o' lists the options, 'set -o name=value' changes one
+	int i, status = 0;
+	if(argv[1] == NULL || strcmp(argv[1], "-o") != 0){
+		print_error("set: uso: set -o [nome=valor...]");
+		return 2;
+	}
+	if(argv[2] == NULL){
+		for(i = 0; i < N_SHELL_OPTIONS; i++){
+			struct shell_option* option = &SHELL_OPTIONS[i];
+			if(option->text != NULL)
+				printf("%-18s %s\n", option->name, *option->text != NULL ? *option->text : "-");
+			else if(option->choices != NULL)
+				printf("%-18s %s\n", option->name, option->choices[*option->value]);
+			else
+				printf("%-18s %d\n", option->name, *option->value);
+		}
+		return 0;
+	}
+	for(i = 2; argv[i] != NULL; i++){
+		if(set_shell_option(argv[i]) < 0)
+			status = 1;
+	}
+	return status;
+}
+int execute_internal_export(char** argv){
+	// 'export' lists the exported variables, sorted; 'export name=value'
+	// sets and exports one, 'export name' exports the one there is
+	char** entries;
+	char* name, *c;
+	size_t n;
+	int i, status = 0;
+	if(argv[1] == NULL){
+		entries = (char**) malloc(sizeof(char*)*(VARIABLES.n_env + 1));
+		memcpy(entries, VARIABLES.envp, sizeof(char*)*VARIABLES.n_env);
+		qsort(entries, VARIABLES.n_env, sizeof(char*), compare_path);
+		for(i = 0; i < VARIABLES.n_env; i++){
+			c = strchr(entries[i], '=');
+			printf("export %.*s=\"", (int) (c - entries[i]), entries[i]);
+			for(c++; *c != '\0'; c++){
+				if(*c == '"' || *c == '\\' || *c == '$' || *c == '`')
+					putchar('\\');
+				putchar(*c);
+			}
+			printf("\"\n");
+		}
+		free(entries);
+		return 0;
+	}
+	for(i = 1; argv[i] != NULL; i++){
+		n = variable_name_length(argv[i]);
+		if(n == 0 || (argv[i][n] != '\0' && argv[i][n] != '=')){
+			printf_error("export: nome invalido: %s", argv[i]);
+			status = 1;
+			continue;
+		}
+		name = strndup(argv[i], n);
+		variable_set(name, (argv[i][n] == '=') ? argv[i] + n + 1 : NULL, TRUE);
+		free(name);
+	}
+	return status;
+}
+int execute_internal_unset(char** argv){
+	int i;
+	for(i = 1; argv[i] != NULL; i++)
+		variable_unset(argv[i]);
+	return 0;
+}
+int execute_internal_parallel(char** argv){
+	// Keeps N jobs running over the inputs: the words after ':::', or the
+	// lines of stdin, read as slots free up. '{}' in cmd is replaced by the
+	// input (appended when there is no '{}'). Each job writes to its own
+	// memfd, copied to stdout once it exits, so outputs never interleave.
+	// The jobs share one foreground process group, so ^C reaches them all.
+	// Returns how many jobs failed, like GNU parallel
+	struct parallel_task* tasks;
+	struct input_buffer lines = {NULL, INPUT_BUFFER_SIZE, 0, 0, STDIN_FILENO, FALSE};
+	char** inputs = NULL;  // ':::' words (NULL: read stdin)
+	char* line = NULL;
+	char* text;
+	size_t len, line_size = 0;
+	pid_t group = 0;  // of the jobs (0: the next one leads a new one)
+	long slots = sysconf(_SC_NPROCESSORS_ONLN);
+	int first = 1, n_template = 0, running = 0, failed = 0, more = TRUE, i;
+	if(argv[first] != NULL && strncmp(argv[first], "-j", 2) == 0){
+		char* value = (argv[first][2] != '\0') ? argv[first] + 2 : argv[++first];
+		char* end;
+		slots = (value != NULL) ? strtol(value, &end, 10) : -1;
+		if(value == NULL || *value == '\0' || *end != '\0' || slots < 0){
+			print_error("parallel: uso: parallel [-j N] cmd {} [::: input...]");
+			return 255;
+		}
+		first++;
+	}
+	while(argv[first + n_template] != NULL && strcmp(argv[first + n_template], ":::") != 0)
+		n_template++;
+	if(n_template == 0){
+		print_error("parallel: uso: parallel [-j N] cmd {} [::: input...]");
+		return 255;
+	}
+	if(argv[first + n_template] != NULL)
+		inputs = &argv[first + n_template + 1];
+	if(inputs != NULL){
+		for(i = 0; inputs[i] != NULL; i++)
+			;
+		if(slots <= 0 || slots > i)  // -j 0: all of them at once
+			slots = (i > 0) ? i : 1;
+	}else if(slots <= 0){
+		slots = PARALLEL_MAX_SLOTS;
+	}
+	tasks = (struct parallel_task*) calloc(slots, sizeof(struct parallel_task));
+	if(inputs == NULL)
+		lines.data = (char*) malloc(lines.size);
+	if(JOB_CONTROL && getpgrp() != SHELL_PGID)
+		group = getpgrp();  // a stage of a pipeline: the jobs stay in its group
+	fflush(stdout);  // the jobs write to stdout directly
+	while(more || running > 0){
+		for(i = 0; more && i < slots; i++){
+			if(tasks[i].job != NULL)
+				continue;
+			if(inputs != NULL){
+				more = (*inputs != NULL);
+				if(more && parallel_start(&tasks[i], &argv[first], n_template, *inputs++, group) < 0)
+					failed++;
+			}else{
+				more = ((text = input_next_line(&lines, &len)) != NULL);
+				if(more && len >= line_size){
+					line_size = 2*len + 1;
+					line = (char*) realloc(line, line_size);
+				}
+				if(more){
+					memcpy(line, text, len);
+					line[len] = '\0';
+				}
+				if(more && parallel_start(&tasks[i], &argv[first], n_template, line, group) < 0)
+					failed++;
+			}
+			if(tasks[i].job != NULL){
+				running++;
+				if(JOB_CONTROL)
+					group = tasks[i].job->pgid;
+			}
+		}
+		if(running == 0){
+			if(group != getpgrp())
+				group = 0;  // gone with its last job
+			continue;
+		}
+		event_loop_run(FALSE);
+		for(i = 0; i < slots; i++){
+			if(tasks[i].job != NULL && tasks[i].job->state == JOB_STOPPED)
+				continue_job(tasks[i].job);  // ^Z: a builtin can't be suspended without the shell
+			if(tasks[i].job == NULL || tasks[i].job->state != JOB_DONE)
+				continue;
+			if(job_exit_status(tasks[i].job) != 0)
+				failed++;
+			if(job_exit_status(tasks[i].job) == 128 + SIGINT)
+				more = FALSE;  // ^C: no new jobs either
+			parallel_finish(&tasks[i]);
+			running--;
+		}
+	}
+	if(JOB_CONTROL && getpgrp() == SHELL_PGID)
+		tcsetpgrp(SHELL_TERMINAL, SHELL_PGID);
+	free(lines.data);
+	free(line);
+	free(tasks);
+	return (failed > 101) ? 101 : failed;
+}
+int parallel_start(struct parallel_task* task, char** template, int n_template, char* input, pid_t group){
+	// Builds 'template' with 'input' in place of every '{}' and starts it
+	// as a foreground job in process group 'group' (0: a new one), reading
+	// /dev/null (stdin may be the input list) and writing to a fresh
+	// memfd. Returns -1 if it could not be started
+	struct pipeline_node* pipeline;
+	char** argv = (char**) malloc(sizeof(char*)*(n_template + 2));
+	size_t input_len = strlen(input);
+	int replaced = FALSE, marks, i;
+	char* mark, *from, *out;
+	for(i = 0; i < n_template; i++){
+		for(marks = 0, mark = strstr(template[i], "{}"); mark != NULL; mark = strstr(mark + 2, "{}"))
+			marks++;
+		if(marks == 0){
+			argv[i] = strdup(template[i]);
+			continue;
+		}
+		out = argv[i] = (char*) malloc(strlen(template[i]) + marks*input_len - 2*marks + 1);
+		for(from = template[i]; (mark = strstr(from, "{}")) != NULL; from = mark + 2){
+			out = mempcpy(out, from, mark - from);
+			out = mempcpy(out, input, input_len);
+		}
+		strcpy(out, from);
+		replaced = TRUE;
+	}
+	if(!replaced)
+		argv[i++] = strdup(input);
+	argv[i] = NULL;
+	pipeline = single_command_pipeline(argv, i);
+	task->output = memfd_create("parallel", MFD_CLOEXEC);
+	task->job = job_create(pipeline, FALSE);
+	task->job->pgid = group;
+	task->job->pipeline = pipeline;  // freed with the job
+	task->job->in_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	task->job->out_fd = (task->output >= 0) ? task->output : STDOUT_FILENO;
+	start_pipeline(pipeline, task->job);
+	job_update_state(task->job);
+	if(task->job->state == JOB_DONE){
+		parallel_finish(task);
+		return -1;
+	}
+	return 0;
+}
+void parallel_finish(struct parallel_task* task){
+	// Copies the job's output to stdout in one go and frees the slot
+	char buffer[8192];
+	ssize_t n;
+	if(task->output >= 0){
+		lseek(task->output, 0, SEEK_SET);
+		while((n = read(task->output, buffer, sizeof(buffer))) > 0){
+			if(write(STDOUT_FILENO, buffer, n) != n)
+				break;
+		}
+		close(task->output);
+	}
+	job_remove(task->job);
+	task->job = NULL;
+}
+struct pipeline_node* single_command_pipeline(char** argv, int argc){
+	// A pipeline of one command that owns argv and its strings, for the
+	// jobs builtins start (freed with the job: set job->pipeline)
+	struct pipeline_node* pipeline = (struct pipeline_node*) malloc(sizeof(struct pipeline_node));
+	struct command_node* command = (struct command_node*) calloc(1, sizeof(struct command_node));
+	command->argv = argv;
+	command->argc = argc;
+	STAILQ_INIT(&pipeline->commands);
+	STAILQ_INSERT_TAIL(&pipeline->commands, command, next);
+	pipeline->n_commands = 1;
+	pipeline->timed = FALSE;
+	pipeline->pipe_size = 0;
+	pipeline->limits = NULL;
+	return pipeline;
+}
+int execute_internal_cache(char** argv){
+	// 'cache cmd': replays the entry for the key of cmd, or runs cmd with
+	// stdout in a memfd, copies it out and stores it with the status
+	// (not when a signal or 'timeout' ended it). '--ttl N' ignores (and
+	// drops) entries older than N. Without cmd: the counters
+	struct pipeline_node* pipeline;
+	struct job* job;
+	char** copy;
+	char* directory, *key, *path;
+	long ttl_ms = 0;
+	int first = 1, output, status, i;
+	if(argv[first] != NULL && strcmp(argv[first], "-r") == 0){
+		if((directory = cache_directory()) != NULL)
+			cache_evict(directory, 0);
+		memset(&CACHE_STATS, 0, sizeof(CACHE_STATS));
+		return 0;
+	}
+	if(argv[first] != NULL && strcmp(argv[first], "--ttl") == 0){
+		if(argv[first + 1] == NULL || (ttl_ms = parse_duration(argv[first + 1])) < 0){
+			print_error("cache: uso: cache [-r] [--ttl N] [cmd...]");
+			return 2;
+		}
+		first += 2;
+	}
+	if(argv[first] != NULL && strcmp(argv[first], "--") == 0)
+		first++;
+	if(argv[first] == NULL){
+		printf("\033[01;33m--> cache: %ld hits, %ld misses, %ld evictions, %ld expired (%s, max %d KB) \033[0m\n",
+			CACHE_STATS.hits, CACHE_STATS.misses, CACHE_STATS.evictions, CACHE_STATS.expired,
+			cache_directory() != NULL ? cache_directory() : "-", CACHE_SIZE/1024);
+		return 0;
+	}
+	directory = cache_directory();
+	key = cache_key(&argv[first]);
+	path = (char*) malloc(strlen(directory != NULL ? directory : "") + 32);
+	sprintf(path, "%s/%016lx", directory != NULL ? directory : "", hash_string(key));
+	fflush(stdout);  // the entry goes straight to fd 1
+	if(directory != NULL && (status = cache_replay(path, key, ttl_ms)) >= 0){
+		CACHE_STATS.hits++;
+		TRACE(TRACE_DEBUG, "cache_hit", 0, status, "%s", path);
+		free(key);
+		free(path);
+		return status;
+	}
+	CACHE_STATS.misses++;
+	for(i = first; argv[i] != NULL; i++)
+		;
+	copy = (char**) malloc(sizeof(char*)*(i - first + 1));
+	for(i = first; argv[i] != NULL; i++)
+		copy[i - first] = strdup(argv[i]);
+	copy[i - first] = NULL;
+	pipeline = single_command_pipeline(copy, i - first);
+	output = memfd_create("cache", MFD_CLOEXEC);
+	job = job_create(pipeline, FALSE);
+	job->pipeline = pipeline;  // freed with the job
+	job->out_fd = (output >= 0) ? output : STDOUT_FILENO;
+	start_pipeline(pipeline, job);
+	job_update_state(job);
+	status = wait_for_job(job);
+	if(output >= 0){
+		lseek(output, 0, SEEK_SET);
+		copy_fd(output, STDOUT_FILENO);
+		if(directory != NULL && status < 124)
+			cache_store(directory, path, key, output, status);
+		close(output);
+	}
+	free(key);
+	free(path);
+	return status;
+}
+int set_shell_option(char* assignment){
+	// 'name=value'; choices are matched by name, numbers must be >= 0 (a
+	// K/M/G suffix multiplies them by 1024...) and '-' resets a string option
+	char* value = strchr(assignment, '=');
+	size_t name_len;
+	int i, j;
+	if(value == NULL){
+		printf_error("set: esperado nome=valor: %s", assignment);
+		return -1;
+	}
+	name_len = value++ - assignment;
+	for(i = 0; i < N_SHELL_OPTIONS; i++){
+		struct shell_option* option = &SHELL_OPTIONS[i];
+		if(strlen(option->name) != name_len || strncmp(option->name, assignment, name_len) != 0)
+			continue;
+		if(option->text != NULL){
+			free(*option->text);
+			*option->text = (*value == '\0' || strcmp(value, "-") == 0) ? NULL : strdup(value);
+		}else if(option->choices == NULL){
+			long number = parse_size(value);
+			if(number < 0 || number > INT_MAX){
+				printf_error("set: valor invalido: %s", assignment);
+				return -1;
+			}
+			*option->value = (int) number;
+		}else{
+			for(j = 0; option->choices[j] != NULL && strcmp(option->choices[j], value) != 0; j++)
+				;
+			if(option->choices[j] == NULL){
+				printf_error("set: valor invalido: %s", assignment);
+				return -1;
+			}
+			*option->value = j;
+		}
+		if(option->changed != NULL)
+			option->changed();
+		return 0;
+	}
+	printf_error("set: opcao desconhecida: %s", assignment);
+	return -1;
+}
+/*************************************** 
+ * Trace
+ ***************************************
+ ***************************************/
+void trace_event(int level, char* event, pid_t pid, long value, char* format, ...){
+	// Only reached through TRACE, when 'level' is enabled. The record goes in
+	// the ring as is; turning it into JSON waits for the flush
+	struct trace_record* record;
+	va_list args;
+	if(TRACE_COUNT == TRACE_RING_SIZE)
+		trace_flush();
+	record = &TRACE_RING[TRACE_COUNT++];
+	clock_gettime(CLOCK_REALTIME, &record->time);
+	record->level = level;
+	record->event = event;
+	record->pid = pid;
+	record->value = value;
+	va_start(args, format);
+	vsnprintf(record->detail, sizeof(record->detail), format, args);
+	va_end(args);
+}
+void trace_flush(){
+	// Writes the ring out as JSON lines, a buffer at a time. Called after
+	// every command line, when the ring is full and at exit
+	char buffer[TRACE_FLUSH_BUFFER];
+	size_t len = 0;
+	int i;
+	if(TRACE_COUNT == 0)
+		return;
+	if(TRACE_FD < 0)
+		TRACE_FD = (TRACE_FILE == NULL) ? STDERR_FILENO : open(TRACE_FILE, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if(TRACE_FD < 0){
+		printf_error("trace: erro ao abrir %s", TRACE_FILE);
+		perror("->");
+		TRACE_LEVEL = TRACE_OFF;
+		TRACE_COUNT = 0;
+		return;
+	}
+	for(i = 0; i <= TRACE_COUNT; i++){
+		struct trace_record* record = &TRACE_RING[i];
+		if(i == TRACE_COUNT || len + TRACE_RECORD_MAX > sizeof(buffer)){
+			if(write(TRACE_FD, buffer, len) < 0)
+				break;
+			len = 0;
+		}
+		if(i == TRACE_COUNT)
+			break;
+		len += sprintf(buffer + len, "{\"ts\":%ld.%09ld,\"level\":\"%s\",\"pid\":%d,\"event\":\"%s\",\"value\":%ld,\"detail\":\"",
+			(long) record->time.tv_sec, record->time.tv_nsec, TRACE_LEVELS[record->level],
+			record->pid, record->event, record->value);
+		len += json_escape(buffer + len, record->detail);
+		len += sprintf(buffer + len, "\"}\n");
+	}
+	TRACE_COUNT = 0;
+}
+void trace_changed(){
+	// 'set -o trace=...' or 'trace-file=...': what was recorded so far goes
+	// out now, and the file is opened again on the next flush
+	trace_flush();
+	if(TRACE_FD > STDERR_FILENO)
+		close(TRACE_FD);
+	TRACE_FD = -1;
+}
+size_t json_escape(char* out, char* text){
+	// Writes 'text' as the inside of a JSON string; returns its length
+	size_t len = 0;
+	for(; *text != '\0'; text++){
+		unsigned char c = (unsigned char) *text;
+		if(c == '"' || c == '\\'){
+			out[len++] = '\\';
+			out[len++] = c;
+		}else if(c < 0x20){
+			len += sprintf(out + len, "\\u%04x", c);
+		}else{
+			out[len++] = c;
+		}
+	}
+	out[len] = '\0';
+	return len;
+}
+/*************************************** 
+ * Funções e Procedimentos Auxiliares
+ ***************************************
+ ***************************************/
+long parse_duration(char* text){
+	// 'timeout' durations: seconds, maybe fractional, with an optional
+	// s/m/h/d suffix like coreutils. Returns milliseconds, or -1
+	char* end;
+	double seconds = strtod(text, &end);
+	long timeout_ms;
+	if(end == text || seconds < 0 || (*end != '\0' && end[1] != '\0'))
+		return -1;
+	switch(*end){
+		case '\0':
+		case 's': break;
+		case 'm': seconds *= 60; break;
+		case 'h': seconds *= 60*60; break;
+		case 'd': seconds *= 24*60*60; break;
+		default: return -1;
+	}
+	timeout_ms = (long) (seconds * 1000);
+	if(timeout_ms == 0 && seconds > 0)
+		timeout_ms = 1;
+	return timeout_ms;
+}
+long parse_size(char* text){
+	// Byte counts and other numbers: digits with an optional K/M/G suffix
+	// (powers of 1024). Returns -1 if it is not one
+	char* end;
+	long size;
+	int shift;
+	if(*text < '0' || *text > '9')
+		return -1;
+	errno = 0;
+	size = strtol(text, &end, 10);
+	if(errno == ERANGE)
+		return -1;
+	switch(*end){
+		case '\0': return size;
+		case 'k': case 'K': shift = 10; break;
+		case 'm': case 'M': shift = 20; break;
+		case 'g': case 'G': shift = 30; break;
+		default: return -1;
+	}
+	if(end[1] != '\0' || size > (LONG_MAX >> shift))  // would overflow
+		return -1;
+	return size << shift;
+}
+void print_tokens(struct token* tokens){
+	int i =0;
+	printf("\033[1;35m---------------\n Comandos:\n");
+	while(tokens[i].type != TOKEN_END){
+		if(tokens[i].type != TOKEN_WORD)
+			printf("	Operador %d: (%s)\n", i, tokens[i].text);
+		else
+			printf("	Palavra %d: <<%s>>\n", i, tokens[i].text);
+		i++;
+	}
+	printf("---------------\033[0m\n");
+}
+int is_operador_char(char c){
+	if( c  == '|' || c == '&' || c == '<' || c == '>' || c == ';')
+		return TRUE;
+	return FALSE;
+}
+void close_fd(int fd){
+	if(fd != 0 && fd != 1)
+		close(fd);
+}
+void print_error(char* c){
+	printf("\033[1;31mErro: %s\033[0m\n", c);
+}
+void printf_error(char* format, char* c){
+	printf("\033[1;31mErro: ");
+	printf(format, c);
+	printf("\033[0m\n");
 }
 void print_alert(char* c){
 	printf("\033[01;33m--> %s \033[0m\n", c);
@@ -0,0 +1,140 @@
+#!/bin/sh
+# K-Shell benchmark driver: runs the same generated scripts under kshell,
+# dash and bash and prints one CSV row per shell and benchmark.
+#
+#   bench/bench.sh [kshell binary]          (or: make bench)
+#
+# Tunables (environment):
+#   BENCH_SHELLS  shells to compare (default: the kshell binary, dash, bash)
+#   BENCH_N       commands per launch/fan-out script (default 2000)
+#   BENCH_MB      size of the pipeline/redirect/cat input in MB (default 64)
+#   BENCH_RUNS    runs per measurement, the best one is kept (default 3)
+#   BENCH_REFERENCE  shell whose output the others must match (default dash, or sh)
+#
+# The scripts only use what every shell understands (no quoting, loops or
+# variables), so the numbers compare the shells and not the scripts.
+# The pipelineN stages are /bin/cat, to compare the pipe plumbing; the
+# cat and tee rows use whatever 'cat' and 'tee' are in each shell (kshell
+# builtins) and bincat is the same pipeline as cat with /bin/cat.
+# Before a script is timed under a shell it is run once and its output
+# compared with the reference shell's; a failing run or a different
+# output stops the benchmark instead of timing a broken build.
+# The filters row is a grep/cut/wc chain over numbered lines, fused into
+# one process by kshell (fuse-filters).
+set -e
+
+KSHELL=${1:-./kshell}
+SHELLS=${BENCH_SHELLS:-"$KSHELL dash bash"}
+N=${BENCH_N:-2000}
+MB=${BENCH_MB:-64}
+RUNS=${BENCH_RUNS:-3}
+REFERENCE=${BENCH_REFERENCE:-$(command -v dash || echo sh)}
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/kshell-bench.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT INT TERM
+
+# repeat COUNT LINE > FILE
+repeat() {
+	yes "$2" | head -n "$1"
+}
+
+# chain STAGES [CAT]: 'CAT input | CAT | ... | wc -c' with STAGES commands
+chain() {
+	cat=${2:-/bin/cat}
+	line="$cat $WORK/input"
+	i=2
+	while [ "$i" -lt "$1" ]; do
+		line="$line | $cat"
+		i=$((i + 1))
+	done
+	echo "$line | wc -c"
+}
+
+now() {
+	date +%s%N
+}
+
+# check SHELL SCRIPT: the script succeeds and prints what REFERENCE prints
+check() {
+	if [ ! -f "$2.expected" ] && ! "$REFERENCE" "$2" > "$2.expected" 2> /dev/null; then
+		echo "bench: $REFERENCE failed on $(basename "$2")" >&2
+		exit 1
+	fi
+	if ! "$1" "$2" > "$2.out" 2> "$2.err"; then
+		echo "bench: $1 failed on $(basename "$2"):" >&2
+		cat "$2.err" >&2
+		exit 1
+	fi
+	if ! cmp -s "$2.expected" "$2.out"; then
+		echo "bench: $1 printed something else than $REFERENCE on $(basename "$2")" >&2
+		exit 1
+	fi
+}
+
+# measure SHELL SCRIPT: best wall time of RUNS runs, in seconds
+measure() {
+	best=
+	run=0
+	while [ "$run" -lt "$RUNS" ]; do
+		start=$(now)
+		if ! "$1" "$2" > /dev/null 2>&1; then
+			echo "bench: $1 failed on $(basename "$2")" >&2
+			exit 1
+		fi
+		end=$(now)
+		elapsed=$((end - start))
+		if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+			best=$elapsed
+		fi
+		run=$((run + 1))
+	done
+	awk -v ns="$best" 'BEGIN { printf "%.6f", ns / 1e9 }'
+}
+
+# row SHELL BENCHMARK ITERATIONS SECONDS AMOUNT UNIT: rate is AMOUNT/SECONDS
+row() {
+	awk -v shell="$1" -v bench="$2" -v n="$3" -v s="$4" -v amount="$5" -v unit="$6" \
+		'BEGIN { printf "%s,%s,%d,%s,%.2f,%s\n", shell, bench, n, s, (s > 0 ? amount / s : 0), unit }'
+}
+
+# bench SHELL BENCHMARK ITERATIONS AMOUNT UNIT: checks $WORK/BENCHMARK.sh,
+# then times it and prints its row
+bench() {
+	check "$1" "$WORK/$2.sh"
+	seconds=$(measure "$1" "$WORK/$2.sh") || exit 1
+	row "$(basename "$1")" "$2" "$3" "$seconds" "$4" "$5"
+}
+
+# Workloads
+repeat "$N" /bin/true > "$WORK/external.sh"
+repeat "$N" true > "$WORK/builtin.sh"
+{ repeat "$N" '/bin/true &'; echo wait; } > "$WORK/fanout.sh"
+head -c $((MB * 1024 * 1024)) /dev/zero | tr '\0' 'k' > "$WORK/input"
+for stages in 2 4 16; do
+	chain "$stages" > "$WORK/pipeline$stages.sh"
+done
+echo "cat $WORK/input > $WORK/output" > "$WORK/redirect.sh"
+chain 4 cat > "$WORK/cat.sh"
+chain 4 /bin/cat > "$WORK/bincat.sh"
+echo "cat $WORK/input | tee $WORK/output | wc -c" > "$WORK/tee.sh"
+seq $((MB * 128 * 1024)) > "$WORK/lines"
+LINES_MB=$(($(wc -c < "$WORK/lines") / 1024 / 1024))
+echo "cat $WORK/lines | cat | grep 1 | grep -v 7 | cut -d0 -f1 | grep 2 | wc -l" > "$WORK/filters.sh"
+
+echo "shell,benchmark,iterations,seconds,rate,unit"
+for shell in $SHELLS; do
+	if ! command -v "$shell" > /dev/null 2>&1; then
+		echo "bench: $shell not found, skipped" >&2
+		continue
+	fi
+	bench "$shell" external "$N" "$N" cmd/s
+	bench "$shell" builtin "$N" "$N" cmd/s
+	bench "$shell" fanout "$N" "$N" cmd/s
+	for stages in 2 4 16; do
+		bench "$shell" "pipeline$stages" 1 "$MB" MB/s
+	done
+	bench "$shell" redirect 1 "$MB" MB/s
+	for name in cat bincat tee; do
+		bench "$shell" "$name" 1 "$MB" MB/s
+	done
+	bench "$shell" filters 1 "$LINES_MB" MB/s
+done
@@ -0,0 +1,44 @@
+#!/bin/sh
+# History expansion regression test: runs lines through kshell with a
+# history file (which turns '!' expansion on without a terminal) and
+# compares stdout with the expected one.
+#
+#   tests/history_expand.sh [kshell binary]          (or: make test)
+#
+# '$!', '${!...}' and '!"' are not events; '!!' and '!n' are.
+set -e
+
+KSHELL=${1:-./kshell}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+cat > "$DIR/input" <<'EOF'
+echo first
+echo "pid=$!"
+echo $!;echo next
+echo ${!x} b
+echo "a!"
+echo !!
+echo !1
+EOF
+
+cat > "$DIR/expected" <<'EOF'
+first
+pid=
+
+next
+${!x} b
+a!
+echo echo "a!"
+echo a!
+echo echo first
+echo first
+EOF
+
+"$KSHELL" --history-file="$DIR/history" < "$DIR/input" > "$DIR/output" 2>&1
+if ! cmp -s "$DIR/expected" "$DIR/output"; then
+	echo "history_expand: saida diferente" >&2
+	diff "$DIR/expected" "$DIR/output" >&2 || true
+	exit 1
+fi
+echo "history_expand: ok"
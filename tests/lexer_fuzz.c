@@ -0,0 +1,96 @@
+/***************************************
+ * K-Shell lexer differential fuzzer
+ ***************************************
+ * Lexes random lines with the scalar, SSE2 and AVX2 scans and fails on
+ * the first line where the tokens differ. The lines are short runs of
+ * letters broken by the bytes the lexer stops at, so every stop set and
+ * every tail length gets hit. Then each scan is run by itself on every
+ * offset of a buffer, against the scalar one.
+ *   tests/lexer_fuzz [iterations] [seed]
+ ***************************************/
+#define main kshell_main
+#include "../KShell.c"
+#undef main
+
+#define FUZZ_ITERATIONS 200000
+#define FUZZ_LINE_MAX 300
+
+int same_tokens(struct token* a, struct token* b);
+int check_scans(lexer_scan_function* scans, int n_scans);
+
+int same_tokens(struct token* a, struct token* b){
+	int i;
+	if(a == NULL || b == NULL)
+		return a == b;
+	for(i = 0; ; i++){
+		if(a[i].type != b[i].type)
+			return FALSE;
+		if(a[i].type == TOKEN_END)
+			return TRUE;
+		if(strcmp(a[i].text, b[i].text) != 0 || a[i].expand != b[i].expand)
+			return FALSE;
+	}
+}
+int check_scans(lexer_scan_function* scans, int n_scans){
+	// Every scan against the scalar one, from every start offset (the
+	// unaligned loads) to every length (the tails)
+	char text[FUZZ_LINE_MAX];
+	size_t start, len, expected;
+	int stop, i;
+	for(i = 0; i < FUZZ_LINE_MAX; i++)
+		text[i] = (i % 37 == 36) ? "\"$ |*"[i % 5] : 'a' + i % 26;
+	for(stop = 0; stop < N_LEXER_STOPS; stop++){
+		for(start = 0; start < 64; start++){
+			for(len = 0; start + len <= FUZZ_LINE_MAX; len++){
+				expected = lexer_scan_scalar(text + start, len, stop);
+				for(i = 1; i < n_scans; i++){
+					if(scans[i](text + start, len, stop) != expected){
+						printf("scan %d difere: stop %d, inicio %zu, tamanho %zu\n", i, stop, start, len);
+						return -1;
+					}
+				}
+			}
+		}
+	}
+	return 0;
+}
+int main(int argc, char** argv){
+	const char alphabet[] = " \t'\"\\|&;<>#-$*?[{}=12";
+	lexer_scan_function scans[] = {lexer_scan_scalar, lexer_scan_sse2, lexer_scan_avx2};
+	char* names[] = {"scalar", "sse2", "avx2"};
+	struct token* tokens[3];
+	char line[FUZZ_LINE_MAX];
+	long iterations = (argc > 1) ? atol(argv[1]) : FUZZ_ITERATIONS, n;
+	int n_scans = 3, saved, null, len, i;
+	srand((argc > 2) ? atoi(argv[2]) : 7);
+	lexer_changed();
+#ifdef __SSE2__
+	if(!__builtin_cpu_supports("avx2"))
+		n_scans = 2;  // nothing to compare it on
+#endif
+	if(check_scans(scans, n_scans) < 0)
+		return 1;
+	saved = dup(STDOUT_FILENO);
+	null = open("/dev/null", O_WRONLY);
+	for(n = 0; n < iterations; n++){
+		len = rand() % FUZZ_LINE_MAX;
+		for(i = 0; i < len; i++)
+			line[i] = (rand() % 4 == 0) ? alphabet[rand() % (sizeof(alphabet) - 1)] : 'a' + rand() % 3;
+		line[len] = '\0';
+		fflush(stdout);
+		dup2(null, STDOUT_FILENO);  // the lexer reports unbalanced quotes
+		for(i = 0; i < n_scans; i++)
+			tokens[i] = lex_line(line, scans[i]);
+		fflush(stdout);
+		dup2(saved, STDOUT_FILENO);
+		for(i = 1; i < n_scans; i++){
+			if(!same_tokens(tokens[0], tokens[i])){
+				printf("%s difere do scalar: '%s'\n", names[i], line);
+				return 1;
+			}
+		}
+		arena_reset(&LINE_ARENA);
+	}
+	printf("lexer: %ld linhas, %d scans iguais\n", iterations, n_scans);
+	return 0;
+}